@@ -25,14 +25,17 @@
 #include "asm.h"
 #include "objfile.h"
 #include "loader.h"
+#include "wcet.h"
 
 #define DEFAULT_INPUT_FORMAT READER_BITS BITS_SUFFIX_SNP
+#define DEFAULT_MEMORY_SIZE 32
+#define MAX_MEMORY_SIZE 0x2000
 
 /* Abstract disassembly */
 struct dis_abstract {
   struct asm_abstract alts[2];
   int n_alts;
-  struct mnemonic *instrs[2];
+  const struct mnemonic *instrs[2];
   int n_instrs;
   struct arch_decoded parts;
   word_t w;
@@ -45,9 +48,13 @@ int usage(FILE *to, int rc, const char *prog) {
 
   fprintf(to, "usage: %s [OPTIONS] OBJECT\n"
     "OPTIONS\n"
+    "  -e, --entry ADDR         analyse routine at ADDR, default: 1\n"
     "  -h, --help               output usage and exit\n"
     "  -I, --input-format FMT   use FMT output format, default: %s\n"
+    "  -L, --listing FILE       annotate analysis with listing from FILE\n"
+    "  -u, --input ADDR         treat store line ADDR as unknown input\n"
     "  -v, --verbose            output verbose information\n"
+    "  -w, --wcet               output cycle counts instead of disassembly\n"
     "\n"
     "%s: supported input formats:",
     prog, DEFAULT_INPUT_FORMAT,
@@ -67,11 +74,12 @@ void disassemble_instruction(struct dis_abstract *a, word_t word)
   a->n_instrs = arch_find_opcode(a->parts.opcode, a->instrs, sizeof a->instrs / sizeof a->instrs[0]);
 }
 
-int render_instr(char *buf, size_t max, size_t *ptr, struct asm_abstract *a) {
+int render_instr(struct asm_ctx *ctx, char *buf, size_t max, size_t *ptr,
+                 struct asm_abstract *a) {
   int ret;
   int i;
 
-  ret = snprintf(buf + *ptr, max - *ptr, "%s", SSTR(a->instr.name));
+  ret = snprintf(buf + *ptr, max - *ptr, "%s", SSTR(ctx, a->instr.name));
   if (ret < 0) {
     perror("snprintf");
     return errno;
@@ -92,10 +100,10 @@ int render_instr(char *buf, size_t max, size_t *ptr, struct asm_abstract *a) {
   return 0;
 }
 
-int disassemble_section(struct segment *segment, struct vm *vmem) {
+int disassemble_section(struct asm_ctx *ctx, struct segment *segment, struct vm *vmem) {
   enum { DATA, INSTR, MAX } type[MAX] = { DATA, MAX };
   struct dis_abstract *ad;
-  struct sym_context *context = sym_root_context();
+  struct sym_context *context = ctx->root;
   addr_t addr;
   int i;
 
@@ -112,7 +120,7 @@ int disassemble_section(struct segment *segment, struct vm *vmem) {
 
   for (addr = 0; addr < segment->length; addr++) {
     struct dis_abstract *d = ad + addr;
-    struct mnemonic *m = d->instrs[0];
+    const struct mnemonic *m = d->instrs[0];
     char auto_label = '\0';
 
     if (d->parts.data != 0 ||
@@ -134,7 +142,7 @@ int disassemble_section(struct segment *segment, struct vm *vmem) {
 
     if (addr == 1) {
       d->alts[0].flags |= HAS_LABEL | HAS_ORG;
-      d->alts[0].label = *sym_add_num(context, SYM_T_LABEL, strtab_put(strtab_src, "_start"), addr);
+      d->alts[0].label = *sym_add_num(context, SYM_T_LABEL, SSTRP(ctx, "_start"), addr);
     } else if (auto_label) {
       d->alts[0].flags |= HAS_ORG;
     }
@@ -147,13 +155,15 @@ int disassemble_section(struct segment *segment, struct vm *vmem) {
       switch (type[i]) {
       case DATA:
         a->n_operands = 1;
-        a->instr = *sym_getref(context, SYM_T_MNEMONIC, SSTRP("NUM"));
+        a->mnemonic = arch_find_instr("NUM");
+        a->instr = (struct symref) { SYM_T_MNEMONIC, SSTRP(ctx, a->mnemonic->name) };
         a->opr_effective = d->w;
         d->n_alts++;
         break;
       case INSTR:
         a->n_operands = m->ins->operands;
-        a->instr = *sym_getref(context, SYM_T_MNEMONIC, SSTRP(m->name));
+        a->mnemonic = m;
+        a->instr = (struct symref) { SYM_T_MNEMONIC, SSTRP(ctx, m->name) };
         a->opr_effective = d->parts.operand;
         d->n_alts++;
         break;
@@ -174,21 +184,21 @@ int disassemble_section(struct segment *segment, struct vm *vmem) {
     size_t max = sizeof buf1;
 
     if (verbose)
-      asm_log_abstract(strtab_src, &ad[addr].alts[0]);
+      asm_log_abstract(ctx->strtab, &ad[addr].alts[0]);
 
     if (a->flags & HAS_LABEL)
-      printf("%s:\n", SSTR(a->label.name));
+      printf("%s:\n", SSTR(ctx, a->label.name));
 
     if (a->flags & HAS_ORG)
       printf("%02d:\n", addr);
 
     if (a->flags & HAS_INSTR) {
-      render_instr(buf1, max, &ptr, a);
+      render_instr(ctx, buf1, max, &ptr, a);
     }
 
     if (alt && alt->flags & HAS_INSTR) {
       ptr = 0;
-      render_instr(buf2, max, &ptr, alt);
+      render_instr(ctx, buf2, max, &ptr, alt);
       printf("  %-20s; %s\n", buf1, buf2);
     } else {
       printf("  %s\n", buf1);
@@ -199,17 +209,132 @@ int disassemble_section(struct segment *segment, struct vm *vmem) {
   return 0;
 }
 
-static void init(void) {
-  strtab_src = strtab_create();
-  sym_init(strtab_src);
-  arch_init(strtab_src);
+/* Read the source line of each address from a listing made by 'bas -a'. */
+static int read_listing(const char *path, char **source, addr_t size) {
+  FILE *f = fopen(path, "r");
+  char *line = NULL;
+  size_t line_size = 0;
+  unsigned addr, value;
+  int rc = 0;
+  int pos;
+
+  if (f == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return EHANDLED;
+  }
+
+  while (rc == 0 && getline(&line, &line_size, f) != -1) {
+    char *file, *colon, *text, *p;
+    long lineno;
+
+    pos = -1;
+    if (sscanf(line, " %x: %x %n", &addr, &value, &pos) != 2 || pos == -1)
+      continue;
+    file = line + pos;
+    colon = strchr(file, ':');
+    if (colon == NULL)
+      continue;
+    *colon = '\0';
+    lineno = strtol(colon + 1, &text, 10);
+    if (lineno <= 0)
+      continue;
+    text += strspn(text, " ");
+    for (p = text + strlen(text); p > text && (p[-1] == ' ' || p[-1] == '\n'); *--p = '\0');
+
+    free(source[addr % size]);
+    if (asprintf(source + addr % size, "%s:%ld %s", file, lineno, text) == -1) {
+      source[addr % size] = NULL;
+      rc = ENOMEM;
+    }
+  }
+
+  free(line);
+  fclose(f);
+  return rc;
+}
+
+static void print_source(char **source, addr_t size, addr_t addr) {
+  if (source && source[addr % size])
+    printf("  ; %s", source[addr % size]);
+  printf("\n");
 }
 
-static void finit(void) {
-  loaders_finit();
-  arch_finit();
-  sym_finit();
-  strtab_destroy(strtab_src);
+static const char *cycles_str(char *buf, size_t max, uint64_t cycles) {
+  if (cycles == WCET_UNBOUNDED)
+    return "unbounded";
+  snprintf(buf, max, "%" PRIu64, cycles);
+  return buf;
+}
+
+int analyse_section(const word_t *mem, addr_t size,
+                    const addr_t *entries, int n_entries,
+                    const bool *inputs, char **source) {
+  struct wcet w;
+  char buf1[24];
+  char buf2[24];
+  int rc;
+  int i;
+
+  rc = wcet_analyse(mem, size, entries, n_entries, inputs, &w);
+  if (rc != 0)
+    return rc;
+
+  printf("-- cycle counts\n\n");
+
+  printf("Blocks:\n");
+  printf("  [%-8.8s  %-8.8s] %6s\n", "START", "END", "CYCLES");
+  for (i = 0; i < w.n_blocks; i++) {
+    printf("  [%08x, %08x] %6u", w.blocks[i].start, w.blocks[i].end, w.blocks[i].cycles);
+    print_source(source, size, w.blocks[i].start);
+  }
+
+  printf("Loops:\n");
+  for (i = 0; i < w.n_loops; i++) {
+    const struct wcet_loop *l = w.loops + i;
+
+    if (l->bound == 0) {
+      printf("  %08x: unbounded, %s", l->header, l->why);
+    } else {
+      printf("  %08x: %" PRIu64 " iterations of at most %s cycles, counter ",
+             l->header, l->bound, cycles_str(buf1, sizeof buf1, l->iteration));
+      if (l->counter == WCET_COUNTER_AC)
+        printf("AC");
+      else
+        printf("%08x", l->counter);
+    }
+    print_source(source, size, l->header);
+  }
+
+  printf("Routines:\n");
+  for (i = 0; i < w.n_routines; i++) {
+    const struct wcet_routine *r = w.routines + i;
+
+    printf("  %08x: best %s, worst %s cycles", r->entry,
+           cycles_str(buf1, sizeof buf1, r->best),
+           cycles_str(buf2, sizeof buf2, r->worst));
+    if (r->why)
+      printf(", %s at %08x", r->why, r->why_at);
+    print_source(source, size, r->entry);
+  }
+
+  wcet_free(&w);
+  return 0;
+}
+
+static int add_address(addr_t **list, int *n, const char *arg) {
+  addr_t *more = reallocarray(*list, *n + 1, sizeof **list);
+  char *end;
+
+  if (more == NULL)
+    return errno;
+  *list = more;
+  more[*n] = strtoul(arg, &end, 0);
+  if (*arg == '\0' || *end != '\0' || more[*n] >= MAX_MEMORY_SIZE) {
+    fprintf(stderr, "Bad address: %s\n", arg);
+    return EHANDLED;
+  }
+  (*n)++;
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -221,31 +346,55 @@ int main(int argc, char *argv[]) {
   struct segment segment = { 0 };
   struct object_file exe = { 0 };
   const struct loader *loader = NULL;
+  struct asm_ctx *ctx = NULL;
   const char *input_format = DEFAULT_INPUT_FORMAT;
+  const char *listing = NULL;
+  addr_t *entries = NULL;
+  addr_t *input_addrs = NULL;
+  int n_entries = 0;
+  int n_inputs = 0;
+  bool *inputs = NULL;
+  char **source = NULL;
+  addr_t mem_size = 0;
+  int wcet = 0;
+  int i;
 
   const struct option options[] = {
+    { "entry",         required_argument, 0,        'e' },
     { "input-format",  required_argument, 0,        'I' },
+    { "input",         required_argument, 0,        'u' },
+    { "listing",       required_argument, 0,        'L' },
     { "help",          no_argument,       0,        'h' },
     { "verbose",       no_argument,       &verbose, 'v' },
+    { "wcet",          no_argument,       &wcet,    'w' },
     { NULL }
   };
 
-  if (loaders_init() != 0)
-    return 1;
-
-  init();
-
   do {
-    c = getopt_long(argc, argv, "hvI:", options, &option_index);
+    c = getopt_long(argc, argv, "hvwe:I:L:u:", options, &option_index);
     switch (c) {
+    case 'e':
+      if (add_address(&entries, &n_entries, optarg) != 0)
+        return usage(stderr, 1, argv[0]);
+      break;
+    case 'u':
+      if (add_address(&input_addrs, &n_inputs, optarg) != 0)
+        return usage(stderr, 1, argv[0]);
+      break;
     case 'I':
       input_format = optarg;
       break;
+    case 'L':
+      listing = optarg;
+      break;
     case 'h':
       return usage(stdout, 0, argv[0]);
     case 'v':
       verbose = c;
       break;
+    case 'w':
+      wcet = c;
+      break;
     }
   } while (c != -1 && c != '?' && c != ':');
 
@@ -275,8 +424,17 @@ int main(int argc, char *argv[]) {
   if (rc != 0)
     goto finish;
 
-  mapped_section.size = segment.length;
-  mapped_section.data = calloc(segment.length, sizeof *mapped_section.data);
+  /* Alias the image through the store as the simulator does */
+  for (mem_size = DEFAULT_MEMORY_SIZE; mem_size < segment.length; mem_size <<= 1);
+  if (mem_size > MAX_MEMORY_SIZE) {
+    fprintf(stderr, "%d words exceeds maximum store size of %d\n",
+            segment.length, MAX_MEMORY_SIZE);
+    rc = EHANDLED; /* ENOMEM */
+    goto finish;
+  }
+
+  mapped_section.size = mem_size;
+  mapped_section.data = calloc(mem_size, sizeof *mapped_section.data);
   vmem.page0.base = 0;
   vmem.page0.size = mapped_section.size;
   vmem.page0.phys = &mapped_section;
@@ -285,7 +443,32 @@ int main(int argc, char *argv[]) {
   if (rc != 0)
     goto finish;
 
-  rc = disassemble_section(&segment, &vmem);
+  if (!wcet) {
+    ctx = asm_ctx_create();
+    if (ctx == NULL) {
+      rc = errno;
+      goto finish;
+    }
+    rc = disassemble_section(ctx, &segment, &vmem);
+    goto finish;
+  }
+
+  inputs = calloc(mem_size, sizeof *inputs);
+  source = calloc(mem_size, sizeof *source);
+  if (!inputs || !source) {
+    rc = errno;
+    goto finish;
+  }
+  for (i = 0; i < n_inputs; i++)
+    inputs[input_addrs[i] % mem_size] = true;
+
+  if (listing)
+    rc = read_listing(listing, source, mem_size);
+
+  if (rc == 0 && n_entries == 0)
+    rc = analyse_section(mapped_section.data, mem_size, &(addr_t) { 1 }, 1, inputs, source);
+  else if (rc == 0)
+    rc = analyse_section(mapped_section.data, mem_size, entries, n_entries, inputs, source);
 
 finish:
   if (rc != 0 && rc != EHANDLED)
@@ -294,10 +477,18 @@ finish:
   if (mapped_section.data != NULL)
     free(mapped_section.data);
 
+  if (source != NULL)
+    for (i = 0; i < mem_size; i++)
+      free(source[i]);
+  free(source);
+  free(inputs);
+  free(entries);
+  free(input_addrs);
+
   if (loader != NULL)
     loader->close(loader, &exe);
 
-  finit();
+  asm_ctx_destroy(ctx);
 
   return rc == 0 ? 0 : 1;
 }
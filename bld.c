@@ -0,0 +1,343 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Linker for Manchester Baby. */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "butils.h"
+#include "arch.h"
+#include "section.h"
+#include "writer.h"
+#include "binfmt.h"
+#include "bobj.h"
+#include "layout.h"
+
+#define DEFAULT_OUTPUT_FILE "b.out"
+#define DEFAULT_OUTPUT_FORMAT WRITER_BITS BITS_SUFFIX_SNP
+
+struct link_object {
+  struct bobj obj;
+  addr_t base;
+};
+
+struct link_symbol {
+  const char *name;
+  addr_t value;
+  struct link_object *object;
+};
+
+struct interval {
+  addr_t start;
+  addr_t end;
+  struct link_object *object;
+};
+
+int verbose;
+
+static int symbol_cmp(const void *a, const void *b) {
+  return strcmp(((const struct link_symbol *) a)->name,
+                ((const struct link_symbol *) b)->name);
+}
+
+static int object_symbol_cmp(const void *a, const void *b) {
+  return strcmp(((const struct bobj_symbol *) a)->name,
+                ((const struct bobj_symbol *) b)->name);
+}
+
+/* Place absolute sections where they ask to be, then each relocatable
+ * section in turn at the lowest address where it fits. 'placed' must
+ * have room for every object and is left sorted by address. */
+static int layout(struct link_object *objects, int n, struct interval *placed, int *n_placed) {
+  struct layout_region *regions;
+  struct layout store;
+  int clash;
+  int rc;
+  int i;
+
+  regions = calloc(n + 1, sizeof *regions);
+  if (regions == NULL)
+    return errno;
+  for (i = 0; i < n; i++) {
+    struct bobj *obj = &objects[i].obj;
+
+    regions[i] = (struct layout_region) {
+      .length = obj->section.length,
+      .fixed = obj->absolute,
+      .start = obj->section.org,
+    };
+  }
+
+  /* The linker does not limit the size of the store */
+  layout_init(&store, (addr_t) -1);
+  rc = layout_place(&store, regions, n, &clash);
+  if (rc == EEXIST) {
+    for (i = 0; regions[i].placed || !regions[i].fixed; i++);
+    fprintf(stderr, "%s overlaps %s at 0x%08x\n", objects[i].obj.path,
+            objects[clash].obj.path, regions[i].start);
+    rc = EHANDLED;
+  }
+
+  *n_placed = 0;
+  for (i = 0; rc == 0 && i < store.n_used; i++)
+    placed[(*n_placed)++] = (struct interval) {
+      store.used[i].start, store.used[i].end, objects + store.used[i].owner
+    };
+  for (i = 0; rc == 0 && i < n; i++)
+    objects[i].base = regions[i].start;
+
+  layout_free(&store);
+  free(regions);
+  return rc;
+}
+
+/* Gather the symbols the objects export, sorted by name for lookup. Each
+ * object's own symbols are sorted too. */
+static int collect_symbols(struct link_object *objects, int n,
+                           struct link_symbol **symbols, size_t *n_symbols) {
+  size_t total = 0;
+  size_t i, j;
+  int rc = 0;
+
+  for (i = 0; i < n; i++)
+    total += objects[i].obj.n_symbols;
+
+  *symbols = calloc(total + 1, sizeof **symbols);
+  if (*symbols == NULL)
+    return errno;
+
+  *n_symbols = 0;
+  for (i = 0; i < n; i++) {
+    struct bobj *obj = &objects[i].obj;
+
+    qsort(obj->symbols, obj->n_symbols, sizeof *obj->symbols, object_symbol_cmp);
+    for (j = 0; j < obj->n_symbols; j++) {
+      if (!obj->symbols[j].global)
+        continue;
+      (*symbols)[(*n_symbols)++] = (struct link_symbol) {
+        .name = obj->symbols[j].name,
+        .value = obj->symbols[j].value + (obj->symbols[j].relative ? objects[i].base : 0),
+        .object = objects + i,
+      };
+    }
+  }
+  qsort(*symbols, *n_symbols, sizeof **symbols, symbol_cmp);
+
+  for (i = 1; i < *n_symbols; i++) {
+    if (!strcmp((*symbols)[i].name, (*symbols)[i - 1].name)) {
+      fprintf(stderr, "%s: multiple definition of %s, first in %s\n",
+              (*symbols)[i].object->obj.path, (*symbols)[i].name,
+              (*symbols)[i - 1].object->obj.path);
+      rc = EHANDLED;
+    }
+  }
+
+  return rc;
+}
+
+/* Apply an object's relocations, resolving names against the object's
+ * own symbols before those exported by the others. */
+static int relocate(struct link_object *object,
+                    struct link_symbol *symbols, size_t n_symbols) {
+  struct bobj *obj = &object->obj;
+  struct bobj_symbol local_key;
+  struct bobj_symbol *local;
+  struct link_symbol key;
+  struct link_symbol *sym;
+  addr_t target;
+  size_t i;
+  int rc = 0;
+
+  for (i = 0; i < obj->n_relocs; i++) {
+    struct bobj_reloc *r = obj->relocs + i;
+
+    local_key.name = r->target;
+    local = r->target == NULL ? NULL :
+      bsearch(&local_key, obj->symbols, obj->n_symbols, sizeof local_key,
+              object_symbol_cmp);
+
+    if (r->target == NULL) {
+      target = object->base;
+    } else if (local != NULL) {
+      target = local->value + (local->relative ? object->base : 0);
+    } else {
+      key.name = r->target;
+      sym = bsearch(&key, symbols, n_symbols, sizeof key, symbol_cmp);
+      if (sym == NULL) {
+        fprintf(stderr, "%s: undefined reference to %s\n", obj->path, r->target);
+        rc = EHANDLED;
+        continue;
+      }
+      target = sym->value;
+    }
+    section_set(&obj->section, obj->section.org + r->offset,
+                bobj_relocate(section_get(&obj->section, obj->section.org + r->offset),
+                              r->field, target));
+  }
+
+  return rc;
+}
+
+int usage(FILE *to, int rc, const char *prog) {
+  int i;
+
+  fprintf(to, "usage: %s [OPTIONS] OBJECT...\n"
+    "OPTIONS\n"
+    "  -h, --help               output usage and exit\n"
+    "  -m, --map                output map\n"
+    "  -o, --output FILE|-      write image to FILE, default: %s\n"
+    "  -o, --output FMT=FILE    write image to FILE in FMT, may be repeated\n"
+    "  -O, --output-format FMT  use FMT output format, default: %s\n"
+    "  -v, --verbose            output verbose information\n"
+    "\n"
+    "%s: supported output formats:",
+    prog, DEFAULT_OUTPUT_FILE, DEFAULT_OUTPUT_FORMAT,
+    prog);
+
+  for (i = 0; formats[i].name != NULL; i++)
+    fprintf(to, " %s", formats[i].name);
+
+  fprintf(to, "\n");
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  int i;
+  int c;
+  int rc = 0;
+  int map = 0;
+  int n_objects;
+  int n_placed = 0;
+  int option_index;
+  size_t n_symbols = 0;
+  struct section image = { 0 };
+  struct link_object *objects = NULL;
+  struct link_symbol *symbols = NULL;
+  struct interval *placed = NULL;
+  const struct format *format = NULL;
+  struct outputs outputs = { 0 };
+  const char *output_format = DEFAULT_OUTPUT_FORMAT;
+
+  const struct option options[] = {
+    { "output-format", required_argument, 0,        'O' },
+    { "output",        required_argument, 0,        'o' },
+    { "help",          no_argument,       0,        'h' },
+    { "map",           no_argument,       &map,     'm' },
+    { "verbose",       no_argument,       &verbose, 'v' },
+    { NULL }
+  };
+
+  do {
+    c = getopt_long(argc, argv, "hmvo:O:", options, &option_index);
+    switch (c) {
+    case 'O':
+      output_format = optarg;
+      break;
+    case 'h':
+      return usage(stdout, 0, argv[0]);
+    case 'm':
+      map = c;
+      break;
+    case 'o':
+      outputs_add(&outputs, optarg);
+      break;
+    case 'v':
+      verbose = c;
+      break;
+    }
+  } while (c != -1 && c != '?' && c != ':');
+
+  if (c != -1)
+    return usage(stderr, 1, argv[0]);
+
+  format = find_format(output_format);
+  if (format == NULL) {
+    fprintf(stderr, "No such output format: %s\n", output_format);
+    rc = EHANDLED; /* EINVAL */
+  } else {
+    outputs_default(&outputs, DEFAULT_OUTPUT_FILE, format);
+  }
+
+  if (optind == argc) {
+    fprintf(stderr, "No object specified\n");
+    usage(stderr, 1, argv[0]);
+    rc = EHANDLED; /* ENOENT */
+  }
+
+  n_objects = argc - optind;
+  objects = calloc(n_objects, sizeof *objects);
+  placed = calloc(n_objects, sizeof *placed);
+  if (rc == 0 && (objects == NULL || placed == NULL))
+    rc = errno;
+
+  for (i = 0; rc == 0 && i < n_objects; i++)
+    rc = bobj_read(argv[optind + i], &objects[i].obj);
+
+  if (rc == 0)
+    rc = layout(objects, n_objects, placed, &n_placed);
+
+  if (rc == 0)
+    rc = collect_symbols(objects, n_objects, &symbols, &n_symbols);
+
+  for (i = 0; rc == 0 && i < n_objects; i++)
+    rc = relocate(objects + i, symbols, n_symbols);
+
+  /* Put the sections into one image, the writer filling any gaps */
+  if (rc == 0 && n_placed > 0) {
+    image.org = placed[0].start;
+    for (i = 0; rc == 0 && i < n_placed; i++) {
+      const struct section *section = &placed[i].object->obj.section;
+      const word_t *run;
+      addr_t start, end, a;
+
+      for (a = 0; rc == 0 && (run = section_next_range(section, a, &start, &end)); ) {
+        image.cursor = placed[i].start + (start - section->org);
+        for (a = start; rc == 0 && a < end; a++)
+          rc = put_word(&image, run[a - start], NULL);
+      }
+    }
+    image.length = placed[n_placed - 1].end - image.org;
+  }
+
+  if (rc == 0)
+    rc = write_outputs(&outputs, &image);
+
+  if (rc == 0 && map) {
+    size_t s;
+
+    printf("Sections:\n");
+    printf("  [%-8.8s  %-8.8s] %-8.8s %s\n",
+           "START","END", "LENGTH", "OBJECT");
+    for (i = 0; i < n_placed; i++)
+      printf("  [%08x, %08x] %08x %s\n",
+             placed[i].start, placed[i].end - 1,
+             placed[i].end - placed[i].start,
+             placed[i].object->obj.path);
+    printf("Symbols:\n");
+    for (s = 0; s < n_symbols; s++)
+      printf("  %08x %s\n", symbols[s].value, symbols[s].name);
+  }
+
+  if (rc != 0 && rc != EHANDLED)
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+
+  if (objects != NULL) {
+    for (i = 0; i < n_objects; i++)
+      bobj_free(&objects[i].obj);
+    free(objects);
+  }
+  free(placed);
+  free(symbols);
+  section_free(&image);
+  outputs_free(&outputs);
+
+  return rc == 0 ? 0 : 1;
+}
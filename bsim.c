@@ -23,6 +23,7 @@
 #include "arch.h"
 #include "objfile.h"
 #include "loader.h"
+#include "lines.h"
 
 #define DEFAULT_MEMORY_SIZE 32
 #define DEFAULT_OUTPUT_FILE "b.out"
@@ -55,6 +56,7 @@ struct mc {
   struct regs regs;
   uint64_t cycles;
   bool stopped;
+  uint64_t *counts;          /* instructions fetched from each line, or NULL */
 };
 
 int verbose;
@@ -74,6 +76,8 @@ static void sim_cycle(struct mc *mc) {
 
   /* t1: Fetch */
   mc->regs.pi = read_word(&mc->vm, ++mc->regs.ci);
+  if (mc->counts)
+    mc->counts[mc->regs.ci & (mc->vm.page0.size - 1)]++;
 
   /* t2: Decode */
   d = arch_decode(mc->regs.pi);
@@ -121,12 +125,167 @@ static void sim_cycle(struct mc *mc) {
   mc->cycles++;
 }
 
+/* Write how often each source line ran in lcov's tracefile format. A
+ * line counts the instructions assembled from it and, if it applies a
+ * macro, as often as the busiest instruction of the expansion. */
+static int write_coverage(const char *path, const struct lines *lines,
+                          const uint64_t *counts, addr_t size) {
+  const struct lines_word *w;
+  const struct lines_site *s;
+  uint64_t *site_counts = NULL;
+  bool *site_code = NULL;
+  int64_t **hits = NULL;
+  int *n_lines = NULL;
+  int found, hit;
+  FILE *file;
+  addr_t a;
+  int i, l;
+  int rc = 0;
+
+  file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return EHANDLED;
+  }
+
+  site_counts = calloc(lines->n_sites + 1, sizeof *site_counts);
+  site_code = calloc(lines->n_sites + 1, sizeof *site_code);
+  hits = calloc(lines->n_files + 1, sizeof *hits);
+  n_lines = calloc(lines->n_files + 1, sizeof *n_lines);
+  if (site_counts == NULL || site_code == NULL || hits == NULL || n_lines == NULL) {
+    perror("allocating coverage");
+    exit(1);
+  }
+
+  /* Lines that hold code, which are counted from zero */
+  for (a = 0; a < lines->n_words && a < size; a++) {
+    w = lines->words + a;
+    if (!w->code)
+      continue;
+    if (w->line >= n_lines[w->file])
+      n_lines[w->file] = w->line + 1;
+    for (i = w->site; i != 0; i = lines->sites[i].caller) {
+      s = lines->sites + i;
+      site_code[i] = true;
+      if (s->line >= n_lines[s->file])
+        n_lines[s->file] = s->line + 1;
+    }
+  }
+  for (i = 1; i <= lines->n_files; i++) {
+    hits[i] = malloc(n_lines[i] * sizeof **hits);
+    if (n_lines[i] > 0 && hits[i] == NULL) {
+      perror("allocating coverage");
+      exit(1);
+    }
+    for (l = 0; l < n_lines[i]; l++)
+      hits[i][l] = -1;
+  }
+
+  for (a = 0; a < lines->n_words && a < size; a++) {
+    w = lines->words + a;
+    if (!w->code)
+      continue;
+    if (hits[w->file][w->line] == -1)
+      hits[w->file][w->line] = 0;
+    hits[w->file][w->line] += counts[a];
+    for (i = w->site; i != 0; i = lines->sites[i].caller)
+      if (counts[a] > site_counts[i])
+        site_counts[i] = counts[a];
+  }
+  for (i = 1; i <= lines->n_sites; i++) {
+    s = lines->sites + i;
+    if (!site_code[i])
+      continue;
+    if (hits[s->file][s->line] == -1)
+      hits[s->file][s->line] = 0;
+    hits[s->file][s->line] += site_counts[i];
+  }
+
+  fprintf(file, "TN:\n");
+  for (i = 1; i <= lines->n_files; i++) {
+    if (n_lines[i] == 0)
+      continue;
+    fprintf(file, "SF:%s\n", lines->files[i]);
+    for (l = 0, found = 0, hit = 0; l < n_lines[i]; l++) {
+      if (hits[i][l] == -1)
+        continue;
+      fprintf(file, "DA:%d,%" PRId64 "\n", l, hits[i][l]);
+      found++;
+      if (hits[i][l] > 0)
+        hit++;
+    }
+    fprintf(file, "LF:%d\nLH:%d\nend_of_record\n", found, hit);
+  }
+  if (ferror(file))
+    rc = EIO;
+
+  for (i = 1; i <= lines->n_files; i++)
+    free(hits[i]);
+  free(hits);
+  free(n_lines);
+  free(site_counts);
+  free(site_code);
+  fclose(file);
+  return rc;
+}
+
+/* Write the applications of macros a site was expanded from as frames,
+ * outermost first */
+static void write_frames(FILE *file, const struct lines *lines, int site) {
+  const struct lines_site *s;
+
+  if (site == 0)
+    return;
+  s = lines->sites + site;
+  write_frames(file, lines, s->caller);
+  fprintf(file, "%s (%s:%d);", s->macro, lines->files[s->file], s->line);
+}
+
+/* Write the cycles spent at each line of the store as folded stacks for
+ * flame graphs, each instruction taking one cycle. The stack of a word
+ * is the macro applications it was expanded from and then its own line,
+ * or just its address if its source is not known. */
+static int write_folded(const char *path, const struct lines *lines,
+                        const uint64_t *counts, addr_t size) {
+  const struct lines_word *w;
+  FILE *file;
+  addr_t a;
+  int rc = 0;
+
+  file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return EHANDLED;
+  }
+
+  for (a = 0; a < size; a++) {
+    if (counts[a] == 0)
+      continue;
+    w = a < lines->n_words ? lines->words + a : NULL;
+    if (w && w->file != 0) {
+      write_frames(file, lines, w->site);
+      fprintf(file, "%s:%d", lines->files[w->file], w->line);
+    } else {
+      fprintf(file, "%08x", a);
+    }
+    fprintf(file, " %" PRIu64 "\n", counts[a]);
+  }
+  if (ferror(file))
+    rc = EIO;
+
+  fclose(file);
+  return rc;
+}
+
 int usage(FILE *to, int rc, const char *prog) {
   const struct loader *loader;
 
   fprintf(to, "usage: %s [OPTIONS] OBJECT\n"
     "OPTIONS\n"
+    "  -c, --coverage FILE      write line coverage to FILE in lcov format\n"
+    "  -F, --folded FILE        write cycles by macro expansion stack to FILE\n"
     "  -h, --help               output usage and exit\n"
+    "  -L, --lines FILE         read source lines of OBJECT from FILE\n"
     "  -m, --memory WORDS       memory size in words, default: %d\n"
     "  -I, --input-format FMT   use FMT output format, default: %s\n"
     "  -v, --verbose            output verbose information\n"
@@ -195,8 +354,15 @@ int main(int argc, char *argv[]) {
   addr_t memory_size = DEFAULT_MEMORY_SIZE;
   const char *input_format = DEFAULT_INPUT_FORMAT;
   struct handshake sig_ack = { 0, 0};
+  struct lines lines = { 0 };
+  const char *lines_path = NULL;
+  const char *coverage_path = NULL;
+  const char *folded_path = NULL;
 
   const struct option options[] = {
+    { "coverage",      required_argument, 0,        'c' },
+    { "folded",        required_argument, 0,        'F' },
+    { "lines",         required_argument, 0,        'L' },
     { "memory",        required_argument, 0,        'm' },
     { "input-format",  required_argument, 0,        'I' },
     { "help",          no_argument,       0,        'h' },
@@ -204,15 +370,21 @@ int main(int argc, char *argv[]) {
     { NULL }
   };
 
-  if (loaders_init() != 0)
-    return 1;
-
   do {
-    c = getopt_long(argc, argv, "hvm:I:", options, &option_index);
+    c = getopt_long(argc, argv, "hvc:m:F:I:L:", options, &option_index);
     switch (c) {
     case 'I':
       input_format = optarg;
       break;
+    case 'L':
+      lines_path = optarg;
+      break;
+    case 'c':
+      coverage_path = optarg;
+      break;
+    case 'F':
+      folded_path = optarg;
+      break;
     case 'h':
       return usage(stdout, 0, argv[0]);
     case 'm':
@@ -249,6 +421,17 @@ int main(int argc, char *argv[]) {
     return usage(stderr, 1, argv[0]);
   exe.path = argv[optind++];
 
+  if (coverage_path && !lines_path) {
+    fprintf(stderr, "Coverage needs source lines\n");
+    rc = EHANDLED; /* EINVAL */
+    goto finish;
+  }
+  if (lines_path) {
+    rc = lines_read(lines_path, &lines);
+    if (rc != 0)
+      goto finish;
+  }
+
   rc = loader->stat(loader, &exe, &segment);
   if (rc != 0)
     return rc;
@@ -271,6 +454,14 @@ int main(int argc, char *argv[]) {
 
   memory_checks(&mc.vm);
 
+  if (coverage_path || folded_path) {
+    mc.counts = calloc(page0.size, sizeof *mc.counts);
+    if (mc.counts == NULL) {
+      perror("allocating counts");
+      exit(1);
+    }
+  }
+
   fprintf(stderr, "Mapped fully aliased page of %d words of RAM\n",
           page0.size);
 
@@ -303,18 +494,23 @@ int main(int argc, char *argv[]) {
   dump_vm(&mc.vm);
   dump_state(&mc);
 
+  if (coverage_path)
+    rc = write_coverage(coverage_path, &lines, mc.counts, page0.size);
+  if (rc == 0 && folded_path)
+    rc = write_folded(folded_path, &lines, mc.counts, page0.size);
+
 finish:
   if (rc != 0 && rc != EHANDLED)
     fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
 
   if (page0.data != NULL)
     free(page0.data);
+  free(mc.counts);
+  lines_free(&lines);
 
   if (loader != NULL)
     loader->close(loader, &exe);
 
-  loaders_finit();
-
   return rc == 0 ? 0 : 1;
 }
 
@@ -0,0 +1,942 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Superoptimizer for Manchester Baby.
+ *
+ * Finds the shortest sequences of straight-line instructions that leave
+ * the accumulator and store lines as a target sequence does. Every
+ * sequence of each length is enumerated, in parallel, and run against
+ * random machine states. Survivors are then proved equivalent: LDN, SUB
+ * and STO only add and subtract, so every result is a linear combination
+ * of the initial values and two sequences are equivalent exactly when the
+ * coefficients of the results that matter agree.
+ *
+ * The parameters of a macro may be bound to the same store line as each
+ * other or as any other location it names, so the proof is repeated for
+ * every such aliasing. Distinct names that are not parameters are taken
+ * to be distinct lines. */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "butils.h"
+#include "arch.h"
+#include "symbols.h"
+#include "asm.h"
+
+#define MAX_LOCATIONS 16
+#define MAX_LENGTH 16
+#define MAX_DEAD 32
+#define MAX_ALIASINGS 4096
+#define NUM_TESTS 16
+
+/* The accumulator, then each location */
+#define NUM_VARS (MAX_LOCATIONS + 1)
+#define VAR_AC 0
+
+/* Instructions decided before the search is split between threads */
+#define UNIT_DEPTH 2
+
+typedef num_t state_t[NUM_VARS];
+
+/* The value of each variable as coefficients of the initial values */
+typedef num_t form_t[NUM_VARS][NUM_VARS];
+
+struct location {
+  char *name;
+  bool dead;          /* value afterwards is unimportant */
+  bool param;         /* may be the same line as another location */
+  bool temp;          /* never the same line as another location */
+};
+
+/* A way for locations to share store lines: each location is mapped to
+ * the one that stands for its line, along with what is then expected. */
+struct aliasing {
+  int map[MAX_LOCATIONS];
+  unsigned long live;
+  form_t goal;
+};
+
+struct target {
+  char *name;         /* macro name, or NULL for a bare sequence */
+  char *params;       /* macro parameters as written */
+  const char *path;
+  int line;
+  struct location locations[MAX_LOCATIONS];
+  int n_locations;
+  word_t code[MAX_LENGTH];
+  int length;
+  const char *skip;   /* why the target cannot be optimized */
+};
+
+struct options {
+  const char *dead[MAX_DEAD];
+  int n_dead;
+  int temps;
+  int max_length;
+  int max_solutions;
+  long jobs;
+};
+
+struct search {
+  const struct target *target;
+  int max_solutions;
+  word_t alphabet[3 * MAX_LOCATIONS];
+  int n_alphabet;
+  unsigned long live;             /* bit for each variable that matters */
+  state_t tests[NUM_TESTS];
+  state_t expected[NUM_TESTS];
+  struct aliasing *aliasings;     /* the first is each location alone */
+  int n_aliasings;
+  int length;
+  int unit_depth;
+  long n_units;
+
+  pthread_mutex_t lock;
+  long next_unit;
+  word_t (*solutions)[MAX_LENGTH];  /* the first few, in order */
+  int n_kept;
+  unsigned long n_found;
+  unsigned long n_candidates;
+};
+
+struct worker {
+  struct search *search;
+  word_t code[MAX_LENGTH];
+  state_t states[MAX_LENGTH + 1][NUM_TESTS];
+  unsigned long n_candidates;
+};
+
+int verbose;
+
+static word_t encode(word_t opcode, int location) {
+  return ((opcode << OPCODE_POS) & OPCODE_MASK) |
+         ((location << OPERAND_POS) & OPERAND_MASK);
+}
+
+static bool straight_line(word_t opcode) {
+  return opcode == OP_LDN || opcode == OP_STO ||
+         opcode == OP_SUB || opcode == OP_SUB_ALIAS;
+}
+
+static void execute(num_t *state, word_t word) {
+  struct arch_decoded d = arch_decode(word);
+
+  switch (d.opcode) {
+  case OP_LDN:
+    state[VAR_AC] = -state[1 + d.operand];
+    break;
+  case OP_SUB:
+  case OP_SUB_ALIAS:
+    state[VAR_AC] -= state[1 + d.operand];
+    break;
+  case OP_STO:
+    state[1 + d.operand] = state[VAR_AC];
+    break;
+  }
+}
+
+/* Work out the form of each variable after some code. Each column of
+ * coefficients is a machine state in its own right, so the code is run
+ * on the columns, one for each initial value. */
+static void prove_form(form_t form, const word_t *code, int length) {
+  form_t columns = { 0 };
+  int i, v;
+
+  for (v = 0; v < NUM_VARS; v++)
+    columns[v][v] = 1;
+  for (i = 0; i < length; i++)
+    for (v = 0; v < NUM_VARS; v++)
+      execute(columns[v], code[i]);
+  for (i = 0; i < NUM_VARS; i++)
+    for (v = 0; v < NUM_VARS; v++)
+      form[v][i] = columns[i][v];
+}
+
+static bool live_equal(unsigned long live, const num_t *a, const num_t *b) {
+  int v;
+
+  for (v = 0; v < NUM_VARS; v++)
+    if (live & (1ul << v) && a[v] != b[v])
+      return false;
+  return true;
+}
+
+/* Sequences that cannot be shortest because a shorter one does the same */
+static bool redundant(word_t prev, word_t next) {
+  struct arch_decoded p = arch_decode(prev);
+  struct arch_decoded n = arch_decode(next);
+
+  /* A load whose result is overwritten before it is used */
+  if (p.opcode == OP_LDN && n.opcode == OP_LDN)
+    return true;
+
+  /* Storing the same value twice */
+  if (p.opcode == OP_STO && n.opcode == OP_STO && p.operand == n.operand)
+    return true;
+
+  return false;
+}
+
+static void record_solution(struct search *s, const word_t *code) {
+  int i;
+
+  pthread_mutex_lock(&s->lock);
+  s->n_found++;
+
+  /* Keep the first solutions in enumeration order so that the output
+   * does not depend on how the threads were scheduled. */
+  for (i = s->n_kept; i > 0 &&
+       memcmp(code, s->solutions[i - 1], s->length * sizeof *code) < 0; i--);
+  if (i < s->max_solutions) {
+    if (s->n_kept == s->max_solutions)
+      s->n_kept--;
+    memmove(s->solutions + i + 1, s->solutions + i,
+            (s->n_kept - i) * sizeof *s->solutions);
+    memcpy(s->solutions[i], code, s->length * sizeof *code);
+    s->n_kept++;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* Rewrite code for the locations sharing lines as an aliasing says. */
+static void alias_code(word_t *out, const word_t *code, int length,
+                       const struct aliasing *a) {
+  int i;
+
+  for (i = 0; i < length; i++) {
+    struct arch_decoded d = arch_decode(code[i]);
+
+    out[i] = encode(d.opcode, a->map[d.operand]);
+  }
+}
+
+static bool proved(const struct aliasing *a, const word_t *code, int length) {
+  word_t aliased[MAX_LENGTH];
+  form_t form;
+  int v;
+
+  alias_code(aliased, code, length, a);
+  prove_form(form, aliased, length);
+  for (v = 0; v < NUM_VARS; v++)
+    if (a->live & (1ul << v) &&
+        memcmp(form[v], a->goal[v], sizeof form[v]) != 0)
+      return false;
+  return true;
+}
+
+static void check(struct worker *w) {
+  struct search *s = w->search;
+  int t, i;
+
+  w->n_candidates++;
+  for (t = 0; t < NUM_TESTS; t++)
+    if (!live_equal(s->live, w->states[s->length][t], s->expected[t]))
+      return;
+
+  for (i = 0; i < s->n_aliasings; i++)
+    if (!proved(s->aliasings + i, w->code, s->length))
+      return;
+
+  record_solution(s, w->code);
+}
+
+static bool step(struct worker *w, int depth, word_t word) {
+  int t;
+
+  if (depth > 0 && redundant(w->code[depth - 1], word))
+    return false;
+
+  w->code[depth] = word;
+  for (t = 0; t < NUM_TESTS; t++) {
+    memcpy(w->states[depth + 1][t], w->states[depth][t], sizeof (state_t));
+    execute(w->states[depth + 1][t], word);
+  }
+  return true;
+}
+
+static void enumerate(struct worker *w, int depth) {
+  struct search *s = w->search;
+  int i;
+
+  if (depth == s->length) {
+    check(w);
+    return;
+  }
+
+  for (i = 0; i < s->n_alphabet; i++)
+    if (step(w, depth, s->alphabet[i]))
+      enumerate(w, depth + 1);
+}
+
+static void *search_worker(void *arg) {
+  struct search *s = (struct search *) arg;
+  struct worker *w;
+  long unit;
+  long u;
+  int i;
+
+  w = calloc(1, sizeof *w);
+  if (w == NULL) {
+    perror("allocating search state");
+    exit(1);
+  }
+  w->search = s;
+  memcpy(w->states[0], s->tests, sizeof s->tests);
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    unit = s->next_unit++;
+    pthread_mutex_unlock(&s->lock);
+
+    if (unit >= s->n_units)
+      break;
+
+    /* Each unit of work fixes the first few instructions */
+    for (i = 0, u = unit; i < s->unit_depth; i++, u /= s->n_alphabet)
+      if (!step(w, i, s->alphabet[u % s->n_alphabet]))
+        break;
+    if (i == s->unit_depth)
+      enumerate(w, i);
+  }
+
+  pthread_mutex_lock(&s->lock);
+  s->n_candidates += w->n_candidates;
+  pthread_mutex_unlock(&s->lock);
+  free(w);
+  return NULL;
+}
+
+/* Search all sequences of one length. */
+static int search_length(struct search *s, int length, long jobs) {
+  pthread_t *threads;
+  int started;
+  int i;
+
+  s->length = length;
+  s->unit_depth = length < UNIT_DEPTH ? length : UNIT_DEPTH;
+  for (i = 0, s->n_units = 1; i < s->unit_depth; i++)
+    s->n_units *= s->n_alphabet;
+  s->next_unit = 0;
+
+  if (jobs > s->n_units)
+    jobs = s->n_units;
+
+  threads = calloc(jobs, sizeof *threads);
+  if (threads == NULL)
+    return errno;
+
+  for (started = 0; started < jobs - 1; started++)
+    if (pthread_create(threads + started, NULL, search_worker, s) != 0)
+      break;
+
+  /* Work on the queue in this thread too in case no threads started */
+  search_worker(s);
+
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  return 0;
+}
+
+static uint64_t xorshift(uint64_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+static int print_code(FILE *to, const struct target *target,
+                      const word_t *code, int length, const char *indent) {
+  const struct mnemonic *m;
+  int i;
+
+  for (i = 0; i < length; i++) {
+    struct arch_decoded d = arch_decode(code[i]);
+
+    if (arch_find_opcode(d.opcode, &m, 1) != 1)
+      return EINVAL;
+    fprintf(to, "%s%s %s\n", indent, m->name, target->locations[d.operand].name);
+  }
+  return 0;
+}
+
+static void print_result(const struct target *target, const struct search *s,
+                         int length) {
+  const word_t *best = s->n_kept ? s->solutions[0] : target->code;
+  int i;
+
+  printf("; %s: %d -> %d instructions",
+         target->name ? target->name : "sequence", target->length, length);
+  if (s->n_kept == 0)
+    printf(", already shortest\n");
+  else
+    printf(", %lu equivalents found\n", s->n_found);
+
+  if (target->name) {
+    printf("%s MACRO%s%s\n", target->name, target->params ? " " : "",
+           target->params ? target->params : "");
+    print_code(stdout, target, best, length, "  ");
+    for (i = 1; i < s->n_kept; i++) {
+      printf("; or:\n");
+      print_code(stdout, target, s->solutions[i], length, ";   ");
+    }
+    printf("  ENDM\n\n");
+  } else {
+    print_code(stdout, target, best, length, "  ");
+    for (i = 1; i < s->n_kept; i++) {
+      printf("; or:\n");
+      print_code(stdout, target, s->solutions[i], length, "  ");
+    }
+  }
+}
+
+/* Add an aliasing of the target's locations and what it should compute. */
+static int add_aliasing(struct search *s, const int *map) {
+  const struct target *target = s->target;
+  struct aliasing *a;
+  word_t code[MAX_LENGTH];
+  int i;
+
+  if (s->n_aliasings == MAX_ALIASINGS)
+    return E2BIG;
+  if (s->n_aliasings % 64 == 0) {
+    a = realloc(s->aliasings, (s->n_aliasings + 64) * sizeof *a);
+    if (a == NULL)
+      return errno;
+    s->aliasings = a;
+  }
+
+  a = s->aliasings + s->n_aliasings++;
+  memcpy(a->map, map, sizeof a->map);
+  a->live = s->live & (1ul << VAR_AC);
+  for (i = 0; i < target->n_locations; i++)
+    if (!target->locations[i].dead)
+      a->live |= 1ul << (1 + map[i]);
+  alias_code(code, target->code, target->length, a);
+  prove_form(a->goal, code, target->length);
+  return 0;
+}
+
+/* Enumerate every way the parameters from the 'i'th location on may share
+ * lines. Each parameter is alone, shares the line of a location that is
+ * not a parameter, or joins an earlier parameter that is alone. */
+static int find_aliasings(struct search *s, int *map, int i) {
+  const struct target *target = s->target;
+  int rc;
+  int j;
+
+  for (; i < target->n_locations && !target->locations[i].param; i++)
+    map[i] = i;
+  if (i == target->n_locations)
+    return add_aliasing(s, map);
+
+  map[i] = i;
+  rc = find_aliasings(s, map, i + 1);
+  for (j = 0; rc == 0 && j < target->n_locations; j++) {
+    if (j == i || target->locations[j].temp ||
+        (target->locations[j].param && (j > i || map[j] != j)))
+      continue;
+    map[i] = j;
+    rc = find_aliasings(s, map, i + 1);
+  }
+  return rc;
+}
+
+/* Find and print the shortest equivalent of a target. */
+static int optimize(struct target *target, const struct options *opts) {
+  struct search s = { 0 };
+  uint64_t seed = 0x5eed5eed5eed5eedull;
+  int map[MAX_LOCATIONS];
+  int max_length;
+  int length;
+  int rc = 0;
+  int t, v, i;
+
+  s.target = target;
+  s.max_solutions = opts->max_solutions;
+  s.solutions = calloc(opts->max_solutions, sizeof *s.solutions);
+  if (s.solutions == NULL)
+    return errno;
+
+  s.live = 1ul << VAR_AC;
+  for (i = 0; i < opts->n_dead; i++)
+    if (!strcasecmp(opts->dead[i], "AC"))
+      s.live = 0;
+  for (i = 0; i < target->n_locations; i++) {
+    if (!target->locations[i].dead)
+      s.live |= 1ul << (1 + i);
+    s.alphabet[s.n_alphabet++] = encode(OP_LDN, i);
+    s.alphabet[s.n_alphabet++] = encode(OP_SUB, i);
+    s.alphabet[s.n_alphabet++] = encode(OP_STO, i);
+  }
+
+  for (t = 0; t < NUM_TESTS; t++) {
+    for (v = 0; v < NUM_VARS; v++)
+      s.tests[t][v] = s.expected[t][v] = xorshift(&seed);
+    for (i = 0; i < target->length; i++)
+      execute(s.expected[t], target->code[i]);
+  }
+  rc = find_aliasings(&s, map, 0);
+  if (rc == E2BIG) {
+    fprintf(stderr, "%s:%d: %s: parameters may alias in too many ways, skipped\n",
+            target->path, target->line, target->name ? target->name : "sequence");
+    free(s.aliasings);
+    free(s.solutions);
+    return 0;
+  } else if (rc != 0) {
+    free(s.aliasings);
+    free(s.solutions);
+    return rc;
+  }
+
+  pthread_mutex_init(&s.lock, NULL);
+  max_length = opts->max_length < target->length ? opts->max_length : target->length - 1;
+  for (length = 0; rc == 0 && length <= max_length && s.n_found == 0; length++) {
+    rc = search_length(&s, length, opts->jobs);
+    if (verbose)
+      fprintf(stderr, "%s: length %d: %lu candidates, %lu solutions\n",
+              target->name ? target->name : "sequence", length,
+              s.n_candidates, s.n_found);
+  }
+  pthread_mutex_destroy(&s.lock);
+
+  if (rc == 0)
+    print_result(target, &s, s.n_found ? length - 1 : target->length);
+
+  free(s.aliasings);
+  free(s.solutions);
+  return rc;
+}
+
+static int find_location(struct target *target, const char *name,
+                         const struct options *opts) {
+  int i, j;
+
+  for (i = 0; i < target->n_locations; i++)
+    if (!strcmp(target->locations[i].name, name))
+      return i;
+
+  if (target->n_locations == MAX_LOCATIONS)
+    return -1;
+
+  target->locations[i].name = strdup(name);
+  for (j = 0; j < opts->n_dead; j++)
+    if (!strcmp(opts->dead[j], name))
+      target->locations[i].dead = true;
+  target->n_locations++;
+  return i;
+}
+
+/* Add an instruction to a target, or say why it cannot be optimized. */
+static void add_instr(struct target *target, const char *mnem, const char *operand,
+                      const struct options *opts) {
+  const struct mnemonic *m;
+  int loc;
+
+  if (target->skip)
+    return;
+
+  m = arch_find_instr(mnem);
+  if (m == NULL) {
+    target->skip = "uses a macro";
+  } else if (m->type != M_INSTR || !straight_line(m->ins->opcode)) {
+    target->skip = "not straight-line code";
+  } else if (operand == NULL || strpbrk(operand, "+-$()") != NULL) {
+    target->skip = "operand is not a name or number";
+  } else if (target->length == MAX_LENGTH) {
+    target->skip = "too long";
+  } else if ((loc = find_location(target, operand, opts)) == -1) {
+    target->skip = "refers to too many locations";
+  } else {
+    target->code[target->length++] = encode(m->ins->opcode, loc);
+  }
+}
+
+static void add_temps(struct target *target, const struct options *opts) {
+  char name[16];
+  int i, loc;
+
+  for (i = 1; i <= opts->temps; i++) {
+    snprintf(name, sizeof name, "_t%d", i);
+    loc = find_location(target, name, opts);
+    if (loc == -1) {
+      target->skip = "refers to too many locations";
+      break;
+    }
+    target->locations[loc].dead = true;
+    target->locations[loc].temp = true;
+  }
+}
+
+static void target_free(struct target *target) {
+  int i;
+
+  for (i = 0; i < target->n_locations; i++)
+    free(target->locations[i].name);
+  free(target->name);
+  free(target->params);
+  memset(target, '\0', sizeof *target);
+}
+
+static int run(struct target *target, const struct options *opts) {
+  int rc = 0;
+
+  if (!target->skip)
+    add_temps(target, opts);
+  if (target->skip)
+    fprintf(stderr, "%s:%d: %s: %s, skipped\n", target->path, target->line,
+            target->name ? target->name : "sequence", target->skip);
+  else
+    rc = optimize(target, opts);
+  target_free(target);
+  return rc;
+}
+
+/* Optimize a sequence given as instructions separated by ';'. */
+static int run_sequence(const char *seq, const struct options *opts) {
+  struct target target = { .path = "sequence", .line = 1 };
+  char *copy = strdup(seq);
+  char *save = NULL;
+  char *instr;
+  char *mnem;
+  char *operand;
+
+  for (instr = strtok_r(copy, ";\n", &save); instr; instr = strtok_r(NULL, ";\n", &save)) {
+    mnem = strtok(instr, " \t");
+    operand = strtok(NULL, " \t");
+    if (mnem)
+      add_instr(&target, mnem, operand, opts);
+  }
+  free(copy);
+
+  return run(&target, opts);
+}
+
+#define MAX_PARAMS 8
+#define MAX_BODY 64
+#define MAX_NESTING 8
+
+struct stmt {
+  char *mnem;
+  char *args[MAX_PARAMS];
+  int n_args;
+};
+
+struct macro_def {
+  char *name;
+  char *params[MAX_PARAMS];
+  int n_params;
+  struct stmt body[MAX_BODY];
+  int n_body;
+  const char *skip;
+  int line;
+};
+
+static void macro_def_free(struct macro_def *def) {
+  int i, j;
+
+  free(def->name);
+  for (i = 0; i < def->n_params; i++)
+    free(def->params[i]);
+  for (i = 0; i < def->n_body; i++) {
+    free(def->body[i].mnem);
+    for (j = 0; j < def->body[i].n_args; j++)
+      free(def->body[i].args[j]);
+  }
+}
+
+static struct macro_def *find_macro(struct macro_def *defs, int n_defs, const char *name) {
+  int i;
+
+  for (i = 0; i < n_defs; i++)
+    if (!strcasecmp(defs[i].name, name))
+      return defs + i;
+  return NULL;
+}
+
+static bool find_param(const struct macro_def *def, const char *name) {
+  int i;
+
+  for (i = 0; i < def->n_params; i++)
+    if (!strcmp(def->params[i], name))
+      return true;
+  return false;
+}
+
+/* Add the body of a macro to a target, substituting the arguments for
+ * the parameters and expanding any macros it applies in turn. */
+static void expand(struct target *target, struct macro_def *defs, int n_defs,
+                   const struct macro_def *def, char **args, int depth,
+                   const struct options *opts) {
+  const struct macro_def *inner;
+  char *actual[MAX_PARAMS];
+  int i, j, k;
+
+  if (def->skip && !target->skip)
+    target->skip = def->skip;
+
+  for (i = 0; !target->skip && i < def->n_body; i++) {
+    const struct stmt *stmt = def->body + i;
+
+    for (j = 0; j < stmt->n_args; j++) {
+      actual[j] = stmt->args[j];
+      for (k = 0; k < def->n_params; k++)
+        if (!strcmp(stmt->args[j], def->params[k]))
+          actual[j] = args[k];
+    }
+
+    inner = find_macro(defs, n_defs, stmt->mnem);
+    if (inner == NULL) {
+      add_instr(target, stmt->mnem, stmt->n_args ? actual[0] : NULL, opts);
+    } else if (depth == MAX_NESTING) {
+      target->skip = "macros nested too deeply";
+    } else if (inner->n_params != stmt->n_args) {
+      target->skip = "applies a macro with the wrong number of arguments";
+    } else {
+      expand(target, defs, n_defs, inner, actual, depth + 1, opts);
+    }
+  }
+}
+
+/* Read the macros defined in an assembly source. Only the simple subset
+ * of the syntax found in macro definitions is understood. */
+static int read_macros(FILE *file, const char *path,
+                       struct macro_def **defs, int *n_defs) {
+  struct macro_def *def = NULL;
+  size_t linesz = 0;
+  char *line = NULL;
+  char *text = NULL;
+  size_t textsz = 0;
+  int lineno = 0;
+  int start = 0;
+  int rc = 0;
+
+  while (rc == 0 && getline(&line, &linesz, file) != -1) {
+    char *tokens[2 + MAX_PARAMS];
+    int n_tokens = 0;
+    char *comment;
+    char *save;
+    char *tok;
+    size_t len;
+
+    lineno++;
+    if ((comment = strchr(line, ';')) != NULL)
+      *comment = '\0';
+    if ((comment = strstr(line, "--")) != NULL)
+      *comment = '\0';
+
+    /* Join lines continued with a backslash */
+    len = strlen(line);
+    while (len > 0 && isspace((unsigned char) line[len - 1]))
+      line[--len] = '\0';
+    if (textsz == 0)
+      start = lineno;
+    text = realloc(text, textsz + len + 2);
+    if (text == NULL) {
+      rc = errno;
+      break;
+    }
+    memcpy(text + textsz, line, len + 1);
+    textsz += len;
+    if (len > 0 && text[textsz - 1] == '\\') {
+      text[textsz - 1] = ' ';
+      continue;
+    }
+    textsz = 0;
+
+    for (tok = strtok_r(text, " \t,", &save); tok && n_tokens < 2 + MAX_PARAMS;
+         tok = strtok_r(NULL, " \t,", &save))
+      tokens[n_tokens++] = tok;
+    if (n_tokens == 0)
+      continue;
+
+    if (def == NULL && n_tokens >= 2 && !strcasecmp(tokens[1], "MACRO")) {
+      *defs = realloc(*defs, (*n_defs + 1) * sizeof **defs);
+      if (*defs == NULL) {
+        rc = errno;
+        break;
+      }
+      def = *defs + (*n_defs)++;
+      memset(def, '\0', sizeof *def);
+      def->name = strdup(tokens[0]);
+      def->line = start;
+      for (def->n_params = 0; def->n_params < n_tokens - 2; def->n_params++)
+        def->params[def->n_params] = strdup(tokens[2 + def->n_params]);
+    } else if (def && !strcasecmp(tokens[0], "ENDM")) {
+      def = NULL;
+    } else if (def && tokens[0][strlen(tokens[0]) - 1] == ':') {
+      def->skip = "has labels";
+    } else if (def && def->n_body == MAX_BODY) {
+      def->skip = "too long";
+    } else if (def) {
+      struct stmt *stmt = def->body + def->n_body++;
+
+      stmt->mnem = strdup(tokens[0]);
+      for (stmt->n_args = 0; stmt->n_args < n_tokens - 1; stmt->n_args++)
+        stmt->args[stmt->n_args] = strdup(tokens[1 + stmt->n_args]);
+    }
+  }
+
+  if (rc == 0 && def) {
+    fprintf(stderr, "%s:%d: %s: no ENDM\n", path, def->line, def->name);
+    rc = EHANDLED;
+  }
+
+  free(line);
+  free(text);
+  return rc;
+}
+
+/* Optimize the body of each macro defined in an assembly source, with
+ * its parameters standing for locations. */
+static int run_file(const char *path, const struct options *opts) {
+  struct macro_def *defs = NULL;
+  struct target target;
+  int n_defs = 0;
+  FILE *file;
+  int rc;
+  int i;
+
+  file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return EHANDLED;
+  }
+
+  rc = read_macros(file, path, &defs, &n_defs);
+
+  for (i = 0; rc == 0 && i < n_defs; i++) {
+    char params[256] = "";
+    int j;
+
+    target = (struct target) { .path = path, .line = defs[i].line };
+    target.name = strdup(defs[i].name);
+    for (j = 0; j < defs[i].n_params; j++) {
+      strncat(params, j > 0 ? ", " : "", sizeof params - strlen(params) - 1);
+      strncat(params, defs[i].params[j], sizeof params - strlen(params) - 1);
+    }
+    if (defs[i].n_params > 0)
+      target.params = strdup(params);
+    expand(&target, defs, n_defs, defs + i, defs[i].params, 0, opts);
+    for (j = 0; j < target.n_locations; j++)
+      target.locations[j].param = find_param(defs + i, target.locations[j].name);
+    rc = run(&target, opts);
+  }
+
+  for (i = 0; i < n_defs; i++)
+    macro_def_free(defs + i);
+  free(defs);
+  if (file != stdin)
+    fclose(file);
+  return rc;
+}
+
+int usage(FILE *to, int rc, const char *prog) {
+  fprintf(to, "usage: %s [OPTIONS] -e SEQUENCE | SOURCE|-...\n"
+    "OPTIONS\n"
+    "  -d, --dead NAME          value of NAME afterwards is unimportant, or AC's\n"
+    "  -e, --sequence SEQ       optimize instructions separated by ';'\n"
+    "  -h, --help               output usage and exit\n"
+    "  -j, --jobs N             search with up to N threads\n"
+    "  -l, --max-length N       longest sequence to search, default: %d\n"
+    "  -n, --solutions N        output up to N solutions, default: 1\n"
+    "  -t, --temps N            allow N temporary locations, _t1 to _tN\n"
+    "  -v, --verbose            output verbose information\n",
+    prog, MAX_LENGTH);
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  int c;
+  int rc = 0;
+  int option_index;
+  const char *sequence = NULL;
+  struct options opts = {
+    .max_length = MAX_LENGTH,
+    .max_solutions = 1,
+  };
+
+  const struct option options[] = {
+    { "dead",          required_argument, 0,        'd' },
+    { "sequence",      required_argument, 0,        'e' },
+    { "help",          no_argument,       0,        'h' },
+    { "jobs",          required_argument, 0,        'j' },
+    { "max-length",    required_argument, 0,        'l' },
+    { "solutions",     required_argument, 0,        'n' },
+    { "temps",         required_argument, 0,        't' },
+    { "verbose",       no_argument,       &verbose, 'v' },
+    { NULL }
+  };
+
+
+  opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  do {
+    c = getopt_long(argc, argv, "hvd:e:j:l:n:t:", options, &option_index);
+    switch (c) {
+    case 'd':
+      if (opts.n_dead < MAX_DEAD)
+        opts.dead[opts.n_dead++] = optarg;
+      break;
+    case 'e':
+      sequence = optarg;
+      break;
+    case 'h':
+      return usage(stdout, 0, argv[0]);
+    case 'j':
+      opts.jobs = strtol(optarg, NULL, 10);
+      break;
+    case 'l':
+      opts.max_length = strtol(optarg, NULL, 10);
+      break;
+    case 'n':
+      opts.max_solutions = strtol(optarg, NULL, 10);
+      break;
+    case 't':
+      opts.temps = strtol(optarg, NULL, 10);
+      break;
+    case 'v':
+      verbose = c;
+      break;
+    }
+  } while (c != -1 && c != '?' && c != ':');
+
+  if (c != -1)
+    return usage(stderr, 1, argv[0]);
+
+  if (opts.jobs < 1)
+    opts.jobs = 1;
+  if (opts.max_solutions < 1)
+    opts.max_solutions = 1;
+  if (opts.max_length > MAX_LENGTH)
+    opts.max_length = MAX_LENGTH;
+
+  if (sequence == NULL && optind == argc) {
+    fprintf(stderr, "No sequence or source specified\n");
+    usage(stderr, 1, argv[0]);
+    rc = EHANDLED;
+  }
+
+  if (rc == 0 && sequence)
+    rc = run_sequence(sequence, &opts);
+
+  for (; rc == 0 && optind < argc; optind++)
+    rc = run_file(argv[optind], &opts);
+
+  if (rc != 0 && rc != EHANDLED)
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+
+  return rc == 0 ? 0 : 1;
+}
@@ -33,6 +33,7 @@ enum mnem_type {
   M_INSTR,
   M_DIRECTIVE,
   M_MACRO,
+  M_PSEUDO,
 };
 
 enum directive {
@@ -40,12 +41,18 @@ enum directive {
   D_EJA,
 };
 
+/* Instructions that the assembler expands into sequences */
+enum pseudo {
+  P_MULC,
+};
+
 struct mnemonic {
   char *name;
   enum mnem_type type;
   union {
     const struct instr *ins;
     enum directive dir;
+    enum pseudo pseudo;
     struct ast_node *ast;
   };
 };
@@ -91,8 +98,27 @@ static inline struct arch_decoded arch_decode(word_t instr)
   };
 }
 
-extern void arch_init(struct strtab *strtab);
-extern void arch_finit(void);
+/* Hash of a mnemonic ignoring case, for the table made by mkarch. Its
+ * top bits are the slot. */
+static inline uint32_t arch_mnemonic_hash(const char *name, uint32_t seed)
+{
+  uint32_t hash = seed ^ 2166136261U;
+
+  for (; *name; name++)
+    hash = (hash ^ ((unsigned char) *name | 0x20)) * 16777619U;
+
+  /* Mix the low bits, which alone tell short names apart, into the top */
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35U;
+  hash ^= hash >> 16;
+  return hash;
+}
+
 extern const struct mnemonic *arch_find_instr(const char *mnemonic);
-extern int arch_find_opcode(word_t opcode, struct mnemonic **results, size_t max_results);
+/* Find a built-in mnemonic by its name in a string table, safely while
+ * other threads insert. */
+extern const struct mnemonic *arch_resolve_instr(struct strtab *strtab, str_idx_t name);
+extern int arch_find_opcode(word_t opcode, const struct mnemonic **results, size_t max_results);
 #endif
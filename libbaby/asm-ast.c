@@ -36,9 +36,17 @@ static const char *ast_semantic_tuple_name[] = {
   [ AST_INSTR ] = "Instr",
   [ AST_MINUS ] = "Op-",
   [ AST_PLUS ] = "Op+",
+  [ AST_EQU ] = "Equ",
+  [ AST_EXPORT ] = "Export",
+  [ AST_TEMP ] = "Temp",
+  [ AST_LITERAL ] = "Literal",
+  [ AST_SECTION ] = "Section",
+  [ AST_REPT ] = "Rept",
+  [ AST_IRP ] = "Irp",
+  [ AST_IF ] = "If",
 };
 
-void ast_plot_tree(FILE *out, struct ast_node *node) {
+void ast_plot_tree(FILE *out, struct strtab *strtab, struct ast_node *node) {
   int i;
 
   switch (node->t) {
@@ -46,12 +54,20 @@ void ast_plot_tree(FILE *out, struct ast_node *node) {
   case AST_INSTR:
   case AST_MINUS:
   case AST_PLUS:
+  case AST_EQU:
+  case AST_EXPORT:
+  case AST_TEMP:
+  case AST_LITERAL:
+  case AST_SECTION:
+  case AST_REPT:
+  case AST_IRP:
+  case AST_IF:
     fprintf(out, "%s", ast_semantic_tuple_name[node->t]);
   case AST_TUPLE:
     fprintf(out, "(");
-    ast_plot_tree(out, node->v.tuple[0]);
+    ast_plot_tree(out, strtab, node->v.tuple[0]);
     fprintf(out, ", ");
-    ast_plot_tree(out, node->v.tuple[1]);
+    ast_plot_tree(out, strtab, node->v.tuple[1]);
     fprintf(out, ")");
     break;
   case AST_NIL:
@@ -65,17 +81,20 @@ void ast_plot_tree(FILE *out, struct ast_node *node) {
   case AST_LABEL:
     fprintf(out, "Label ");
   case AST_SYMBOL:
-    fprintf(out, "%s:%s", sym_type_name(node->v.nameref.type), SSTR(node->v.nameref.name));
+    fprintf(out, "%s:%s", sym_type_name(node->v.nameref.type), strtab_get(strtab, node->v.nameref.name));
     break;
   case AST_NAME:
-    fprintf(out, "%s", SSTR(node->v.str));
+    fprintf(out, "%s", strtab_get(strtab, node->v.str));
+    break;
+  case AST_MNEMONIC:
+    fprintf(out, "%s:%s", sym_type_name(SYM_T_MNEMONIC), strtab_get(strtab, node->v.mnemonic.name));
     break;
   case AST_LIST:
     fprintf(out, "[");
     for (i = 0; i < node->v.list.length; i++) {
       if (i != 0)
         fprintf(out, ",\n");
-      ast_plot_tree(out, &node->v.list.nodes[i]);
+      ast_plot_tree(out, strtab, &node->v.list.nodes[i]);
     }
     fprintf(out, "]");
     break;
@@ -92,6 +111,14 @@ void ast_free_tree(struct ast_node *node) {
   case AST_MACRO:
   case AST_MINUS:
   case AST_PLUS:
+  case AST_EQU:
+  case AST_EXPORT:
+  case AST_TEMP:
+  case AST_LITERAL:
+  case AST_SECTION:
+  case AST_REPT:
+  case AST_IRP:
+  case AST_IF:
   case AST_TUPLE:
     ast_free_tree(node->v.tuple[0]);
     ast_free_tree(node->v.tuple[1]);
@@ -107,6 +134,7 @@ void ast_free_tree(struct ast_node *node) {
   case AST_LABEL:
   case AST_NAME:
   case AST_SYMBOL:
+  case AST_MNEMONIC:
     break;
   default:
     fprintf(stderr, "ast_free_tree: <UNKNOWN-NODE-TYPE>");
@@ -139,6 +167,14 @@ struct ast_node *ast_copy_tree(struct ast_node *node, struct ast_node *copy) {
   case AST_MACRO:
   case AST_MINUS:
   case AST_PLUS:
+  case AST_EQU:
+  case AST_EXPORT:
+  case AST_TEMP:
+  case AST_LITERAL:
+  case AST_SECTION:
+  case AST_REPT:
+  case AST_IRP:
+  case AST_IF:
   case AST_TUPLE:
     copy->t = node->t;
     copy->v.tuple[0] = ast_copy_tree(node->v.tuple[0], NULL);
@@ -31,6 +31,15 @@ enum ast_node_e {
   AST_MACRO,
   AST_MINUS,
   AST_PLUS,
+  AST_EQU,
+  AST_EXPORT,
+  AST_TEMP,
+  AST_LITERAL,
+  AST_SECTION,
+  AST_MNEMONIC,
+  AST_REPT,
+  AST_IRP,
+  AST_IF,
 };
 
 struct ast_node;
@@ -38,6 +47,10 @@ struct ast_node;
 union ast_node_u {
   struct ast_node *tuple[2];
   struct symref nameref;
+  struct {
+    str_idx_t name;
+    const struct mnemonic *builtin;    /* NULL unless an instruction or directive */
+  } mnemonic;
   str_idx_t str;
   word_t number;
   struct {
@@ -53,7 +66,7 @@ struct ast_node {
   bool heap:1; /* node is heap allocated */
 };
 
-extern void ast_plot_tree(FILE *stream, struct ast_node *node);
+extern void ast_plot_tree(FILE *stream, struct strtab *strtab, struct ast_node *node);
 extern void ast_free_tree(struct ast_node *node);
 extern struct ast_node *ast_copy_tree(struct ast_node *node, struct ast_node *copy);
 extern size_t ast_count_list(struct ast_node *node);
@@ -0,0 +1,2887 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2023-2024 Andrew Bower */
+
+/* Assembly of whole programs from source.
+ *
+ * Everything an assembly touches is reached from its asm_ctx, so that
+ * programs may be assembled concurrently in different contexts. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <libgen.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "butils.h"
+#include "arch.h"
+#include "section.h"
+#include "symbols.h"
+#include "asm.h"
+#include "asm-build.h"
+#include "asm-ast.h"
+#include "asm-cache.h"
+#include "asm-peephole.h"
+#include "asm-gc.h"
+#include "asm-temps.h"
+#include "asm-mulc.h"
+#include "asm-outline.h"
+#include "layout.h"
+#include "srcbuf.h"
+#include "bobj.h"
+#include "asm-parse.h"
+
+/* Re-entrant scanner interface generated by flex */
+typedef void *yyscan_t;
+extern int yylex_init_extra(void *user_defined, yyscan_t *scanner);
+extern int yylex_destroy(yyscan_t scanner);
+extern void *yy_scan_buffer(char *base, size_t size, yyscan_t scanner);
+extern void yy_delete_buffer(void *buffer, yyscan_t scanner);
+extern void *yyget_extra(yyscan_t scanner);
+
+enum {
+  VSYM_ORG,
+};
+
+static const char *vsyms[] = {
+  [ VSYM_ORG ] = "$",
+};
+
+struct parse_pool {
+  struct asm_ctx *ctx;
+  struct asm_source *sources;
+  int num_sources;
+  int next;
+  const char *cache_dir;
+  pthread_mutex_t lock;
+};
+
+void yyerror(YYLTYPE *yylloc, yyscan_t scanner, struct ast_node **root, char const *error) {
+  struct asm_source *source = (struct asm_source *) yyget_extra(scanner);
+
+  fprintf(stderr, "yyerror: %s:%d.%d-%d.%d: %s\n",
+          source->public.path,
+          yylloc->start.line, yylloc->start.col,
+          yylloc->end.line, yylloc->end.col,
+          error);
+}
+
+struct asm_buf {
+  struct asm_abstract *records;
+  size_t sz;
+  off_t ptr;
+};
+
+/* Grow an array of '*sz' elements of 'elem' bytes to hold 'n' + 1 of
+ * them, leaving it as it was if there is no memory. */
+static int grow(void *ptr, size_t *sz, size_t n, size_t elem, size_t first) {
+  void **array = ptr;
+  size_t new_sz;
+  void *p;
+
+  if (n < *sz)
+    return 0;
+  new_sz = (*sz == 0) ? first : *sz << 1;
+  p = realloc(*array, elem * new_sz);
+  if (p == NULL)
+    return ENOMEM;
+  *array = p;
+  *sz = new_sz;
+  return 0;
+}
+
+static int asm_buf_push(struct asm_buf *buf, struct asm_abstract *record) {
+  if (grow(&buf->records, &buf->sz, buf->ptr, sizeof buf->records[0], 128) != 0)
+    return ENOMEM;
+  buf->records[buf->ptr++] = *record;
+  return 0;
+}
+
+static void asm_buf_free(struct asm_buf *buf) {
+  free(buf->records);
+  memset(buf, '\0', sizeof *buf);
+}
+
+enum eval_result {
+  EVAL_OK,
+  EVAL_PARTIAL,
+  EVAL_ERROR,
+};
+
+/* A symbol whose value is an expression that cannot be evaluated until
+ * layout is complete, such as an EQU or a macro argument referring to
+ * a label. */
+struct resolve_entry {
+  struct sym_context *context;       /* context in which symbol is defined */
+  struct sym_context *eval_context;  /* context in which to evaluate it */
+  str_idx_t name;
+  struct ast_node *ast;
+  struct source_public *source;
+  int line;
+  size_t seq;                        /* order of definition */
+  enum { RES_PENDING, RES_VISITING, RES_DONE } state;
+  size_t deps;                       /* index into dependency list */
+  size_t n_deps;
+};
+
+struct resolve_buf {
+  struct resolve_entry *entries;
+  size_t sz;
+  off_t ptr;
+};
+
+static int resolve_add(struct resolve_buf *buf,
+                        struct sym_context *context,
+                        struct sym_context *eval_context,
+                        str_idx_t name,
+                        struct ast_node *ast,
+                        struct source_public *source,
+                        int line) {
+  if (grow(&buf->entries, &buf->sz, buf->ptr, sizeof buf->entries[0], 64) != 0)
+    return ENOMEM;
+  buf->entries[buf->ptr] = (struct resolve_entry) {
+    .context = context,
+    .eval_context = eval_context,
+    .name = name,
+    .ast = ast,
+    .source = source,
+    .line = line,
+    .seq = buf->ptr,
+    .state = RES_PENDING,
+  };
+  buf->ptr++;
+  return 0;
+}
+
+static void resolve_free(struct resolve_buf *buf) {
+  off_t i;
+
+  for (i = 0; i < buf->ptr; i++)
+    ast_free_tree(buf->entries[i].ast);
+  free(buf->entries);
+  memset(buf, '\0', sizeof *buf);
+}
+
+/* The value of an expression in a relocatable object: a constant plus
+ * multiples of the section base and of one external symbol. */
+struct reloc_val {
+  num_t addend;
+  int base;
+  int n_ext;
+  str_idx_t ext;
+  bool temp;
+};
+
+/* An operand written as '=EXPR', which is the address of a line holding
+ * the value of EXPR. Literals with the same value share a line. */
+struct literal {
+  struct ast_node *node;
+  struct sym_context *context;
+  struct source_public *source;
+  int line;
+  size_t value;              /* index in the pool + 1, once evaluated */
+};
+
+struct pool_value {
+  struct reloc_val val;
+  const struct literal *first;
+};
+
+/* A temporary declared by TEMP. Each expansion of a macro that declares
+ * one has its own. */
+struct temp {
+  struct sym_context *context;
+  str_idx_t name;
+  struct source_public *source;
+  int line;
+};
+
+enum {
+  SECTION_ALIGN,
+  SECTION_AT,
+  SECTION_ABOVE,
+  SECTION_BELOW,
+  SECTION_ATTRS
+};
+
+static const char *section_attrs[SECTION_ATTRS] = {
+  [ SECTION_ALIGN ] = "ALIGN",
+  [ SECTION_AT ] = "AT",
+  [ SECTION_ABOVE ] = "ABOVE",
+  [ SECTION_BELOW ] = "BELOW",
+};
+
+/* A section named by SECTION. It is laid out from zero as it is expanded
+ * and placed in the store once the whole program is known. */
+struct named_section {
+  str_idx_t name;
+  struct section section;
+  word_t attrs[SECTION_ATTRS];
+  unsigned given;            /* attributes set, by bit */
+  addr_t base;               /* where it is placed */
+  struct source_public *source;
+  int line;
+};
+
+/* Records from 'first' on belong to 'section', or to the program if -1 */
+struct section_run {
+  size_t first;
+  int section;
+};
+
+/* Where a record falls among the sites of the sequences to be outlined */
+struct outline_ref {
+  int outline;               /* -1 if none */
+  int site;
+};
+
+/* Sequences chosen by asm_outline() in the trial, with a reference for
+ * each record of the trial. */
+struct outline_plan {
+  struct asm_outline *outlines;
+  int n;
+  struct outline_ref *refs;
+};
+
+/* Layout and encoding of records as they are expanded. Words whose
+ * operands are not known yet are listed in 'fixups' to be patched once
+ * the whole program has been expanded. */
+struct emitter {
+  struct asm_ctx *ctx;
+  struct section *section;   /* where records are laid out */
+  struct section *image;     /* the program, in which sections are placed */
+  struct bobj *obj;
+  const bool *omit;          /* records to leave out, by index */
+  const struct outline_plan *outline;
+  struct asm_abstract **copies;  /* records of the first site of each outline */
+  int n_copies;
+  size_t *outline_body;      /* record of the shared copy of each outline */
+  bool relative;             /* labels are relative to the section */
+  bool deferred;             /* define labels and encode only at the end */
+  bool stale;                /* a symbol changed after it was used */
+  struct sym_context *here;  /* defines '$' for the current record */
+  str_idx_t org_name;
+  size_t *fixups;
+  size_t n_fixups;
+  size_t fixups_sz;
+  struct literal *literals;
+  size_t n_literals;
+  size_t literals_sz;
+  struct pool_value *values;
+  size_t n_values;
+  size_t values_sz;
+  addr_t literal_base;       /* line of the first literal */
+  struct temp *temps;
+  int n_temps;
+  size_t temps_sz;
+  addr_t temp_base;          /* line of the first temporary */
+  struct asm_temp_use *uses;
+  size_t n_uses;
+  size_t uses_sz;
+  size_t pool;               /* first record allocated to temporaries */
+  struct named_section *sections;
+  int n_sections;
+  size_t sections_sz;
+  int current;               /* section being expanded, or -1 */
+  struct section_run *runs;
+  size_t n_runs;
+  size_t runs_sz;
+  addr_t memory;             /* store size to place sections in */
+};
+
+/* A macro, which is expanded as from the source defining it */
+struct macro {
+  struct mnemonic m;
+  struct asm_source *source;
+};
+
+/* The program scope and everything created while expanding the sources
+ * into it, all of which is discarded before the next build. */
+struct expansion {
+  struct asm_ctx *ctx;
+  struct sym_context *context;
+  struct asm_buf abstract;
+  struct resolve_buf resolve;
+  struct sym_context **scopes;
+  size_t n_scopes;
+  size_t scopes_sz;
+  struct macro **macros;
+  size_t n_macros;
+  size_t macros_sz;
+  struct asm_site **sites;
+  size_t n_sites;
+  size_t sites_sz;
+  struct ast_node **exports;
+  size_t n_exports;
+  size_t exports_sz;
+  struct ast_node **bodies;    /* statements made by expanding pseudo-instructions */
+  size_t n_bodies;
+  size_t bodies_sz;
+  struct emitter emit;
+};
+
+static int ptr_push(void ***ptrs, size_t *n, size_t *sz, void *ptr) {
+  if (grow(ptrs, sz, *n, sizeof **ptrs, 32) != 0)
+    return ENOMEM;
+  (*ptrs)[(*n)++] = ptr;
+  return 0;
+}
+
+/* Create a scope for labels, which is destroyed with the expansion, or
+ * return NULL if out of memory. */
+static struct sym_context *expansion_scope(struct expansion *x,
+                                           struct sym_context *parent) {
+  struct sym_context *context = sym_context_create(parent);
+
+  if (context == NULL)
+    return NULL;
+  if (sym_table_create(context, SYM_T_LABEL) != 0 ||
+      ptr_push((void ***) &x->scopes, &x->n_scopes, &x->scopes_sz, context) != 0) {
+    sym_context_destroy(context);
+    return NULL;
+  }
+  return context;
+}
+
+/* Note the application of 'macro' at 'line' of 'source' by 'caller' */
+static const struct asm_site *expansion_site(struct expansion *x, const struct asm_site *caller,
+                                             struct asm_source *source, int line,
+                                             str_idx_t macro) {
+  struct asm_site *site = malloc(sizeof *site);
+
+  if (site == NULL)
+    return NULL;
+  if (ptr_push((void ***) &x->sites, &x->n_sites, &x->sites_sz, site) != 0) {
+    free(site);
+    return NULL;
+  }
+  *site = (struct asm_site) {
+    .caller = caller, .source = &source->public, .line = line, .macro = macro,
+    .id = x->n_sites
+  };
+  return site;
+}
+
+/* The program scope sits below the root context so that the built-in
+ * mnemonics survive from one build to the next. */
+static int expansion_init(struct expansion *x, struct asm_ctx *ctx) {
+  memset(x, '\0', sizeof *x);
+  x->ctx = ctx;
+  x->emit.ctx = ctx;
+  x->emit.current = -1;
+  x->emit.org_name = SSTRP(ctx, vsyms[VSYM_ORG]);
+  x->context = expansion_scope(x, ctx->root);
+  if (x->context == NULL || sym_table_create(x->context, SYM_T_MNEMONIC) != 0)
+    return ENOMEM;
+  x->emit.here = expansion_scope(x, NULL);
+  if (x->emit.here == NULL)
+    return ENOMEM;
+  x->emit.here->strtab = ctx->strtab;
+  return 0;
+}
+
+static void expansion_free(struct expansion *x) {
+  size_t i;
+
+  for (i = x->n_scopes; i > 0; i--)
+    sym_context_destroy(x->scopes[i - 1]);
+  for (i = 0; i < x->n_macros; i++)
+    free(x->macros[i]);
+  for (i = 0; i < x->n_sites; i++)
+    free(x->sites[i]);
+  for (i = 0; i < x->n_bodies; i++)
+    ast_free_tree(x->bodies[i]);
+  free(x->scopes);
+  free(x->macros);
+  free(x->sites);
+  free(x->bodies);
+  free(x->exports);
+  for (i = 0; i < x->emit.n_copies; i++)
+    free(x->emit.copies[i]);
+  free(x->emit.copies);
+  free(x->emit.outline_body);
+  free(x->emit.fixups);
+  free(x->emit.literals);
+  free(x->emit.values);
+  free(x->emit.temps);
+  free(x->emit.uses);
+  for (i = 0; i < x->emit.n_sections; i++)
+    section_free(&x->emit.sections[i].section);
+  free(x->emit.sections);
+  free(x->emit.runs);
+  asm_buf_free(&x->abstract);
+  resolve_free(&x->resolve);
+  memset(x, '\0', sizeof *x);
+}
+
+static enum sym_subtype expr_to_symval(union symval *symval, struct ast_node *node) {
+  if (node->t == AST_NUMBER) {
+    symval->numeric = node->v.number;
+    return SYM_ST_WORD;
+  } else {
+    symval->ast = node;
+    return SYM_ST_AST;
+  }
+}
+
+static enum eval_result eval_expr(struct sym_context *context, struct ast_node *node, bool allow_partial) {
+  enum eval_result rc_a, rc_b;
+  struct symbol *sym;
+  num_t a, b;
+
+  switch (node->t) {
+  case AST_SYMBOL:
+  case AST_LABEL:
+    /* Only absolute words are folded here. Anything else is left for
+     * eval_reloc() once layout is complete. */
+    sym = sym_lookup(context, SYM_T_LABEL, node->v.nameref.name, SYM_LU_SCOPE_DEFAULT);
+    if (sym && sym->subtype == SYM_ST_WORD) {
+      sym->referenced = true;
+      node->t = AST_NUMBER;
+      node->v.number = sym->val.numeric;
+    } else if (!allow_partial) {
+      fprintf(stderr, "label undefined: %s\n", SSTR(context, node->v.nameref.name));
+      return EVAL_ERROR;
+    } else {
+      return EVAL_PARTIAL;
+    }
+  case AST_NUMBER:
+    return EVAL_OK;
+  case AST_LITERAL:
+    return allow_partial ? EVAL_PARTIAL : EVAL_ERROR;
+  case AST_MINUS:
+  case AST_PLUS:
+    rc_a = eval_expr(context, node->v.tuple[0], allow_partial);
+    rc_b = eval_expr(context, node->v.tuple[1], allow_partial);
+    if (rc_a == EVAL_OK && rc_b == EVAL_OK && node->v.tuple[0]->t == node->v.tuple[1]->t) {
+      a = node->v.tuple[0]->v.number;
+      b = node->v.tuple[1]->v.number;
+      a = node->t == AST_MINUS ? a - b : a + b;
+      node->t = node->v.tuple[0]->t;
+      ast_free_tree(node->v.tuple[0]);
+      ast_free_tree(node->v.tuple[1]);
+      node->v.number = a;
+      return EVAL_OK;
+    } else if (allow_partial && (rc_a == EVAL_PARTIAL || rc_b == EVAL_PARTIAL)) {
+      return EVAL_PARTIAL;
+    } else {
+      return EVAL_ERROR;
+    }
+  default:
+    fprintf(stderr, "eval: invalid ast node\n");
+    return EVAL_ERROR;
+  }
+}
+
+/* Check that a value can be expressed by a single relocation. */
+static bool reloc_valid(const struct reloc_val *val) {
+  return val->n_ext == 0 ? val->base == 0 || val->base == 1 :
+                           val->n_ext == 1 && val->base == 0;
+}
+
+/* Evaluate an expression without modifying it. Undefined symbols are
+ * taken to be external and defined as such in 'externs' if it is given;
+ * otherwise they are an error. If 'eager', only symbols that already have
+ * their final value are used, and they are marked as used; EAGAIN is
+ * returned if there are any others. */
+static int eval_literal(struct emitter *em, struct sym_context *context,
+                        struct ast_node *node, struct reloc_val *val,
+                        struct sym_context *externs);
+
+static int eval_reloc(struct emitter *em, struct sym_context *context,
+                      struct ast_node *node, struct reloc_val *val,
+                      struct sym_context *externs, bool eager) {
+  struct reloc_val b;
+  struct symbol *sym;
+  str_idx_t name;
+  int sign;
+  int rc;
+
+  switch (node->t) {
+  case AST_NUMBER:
+    *val = (struct reloc_val) { .addend = node->v.number };
+    return 0;
+  case AST_LITERAL:
+    return eager ? EAGAIN : eval_literal(em, context, node, val, externs);
+  case AST_SYMBOL:
+  case AST_LABEL:
+    name = node->v.nameref.name;
+    sym = sym_lookup(context, SYM_T_LABEL, name, SYM_LU_SCOPE_DEFAULT);
+    if (eager && (sym == NULL ||
+                  (sym->subtype != SYM_ST_WORD && sym->subtype != SYM_ST_REL)))
+      return EAGAIN;
+    if (eager)
+      sym->referenced = true;
+    if ((sym == NULL || sym->subtype == SYM_ST_UNDEF) && externs) {
+      sym_add(externs, SYM_T_LABEL, name, SYM_ST_EXT,
+              (union symval) { .ext = { .addend = 0, .name = name } });
+      sym = sym_lookup(externs, SYM_T_LABEL, name, SYM_LU_SCOPE_LOCAL);
+    }
+    switch (sym ? sym->subtype : SYM_ST_UNDEF) {
+    case SYM_ST_WORD:
+      *val = (struct reloc_val) { .addend = sym->val.numeric, .temp = sym->temp };
+      return 0;
+    case SYM_ST_REL:
+      *val = (struct reloc_val) { .addend = sym->val.numeric, .base = 1,
+                                  .temp = sym->temp };
+      return 0;
+    case SYM_ST_EXT:
+      *val = (struct reloc_val) { .addend = sym->val.ext.addend,
+                                  .n_ext = 1, .ext = sym->val.ext.name };
+      return 0;
+    default:
+      fprintf(stderr, "label undefined: %s\n", SSTR(context, name));
+      return EHANDLED;
+    }
+  case AST_MINUS:
+  case AST_PLUS:
+    sign = node->t == AST_MINUS ? -1 : 1;
+    rc = eval_reloc(em, context, node->v.tuple[0], val, externs, eager);
+    if (rc == 0)
+      rc = eval_reloc(em, context, node->v.tuple[1], &b, externs, eager);
+    if (rc != 0)
+      return rc;
+    if (val->temp || b.temp) {
+      fprintf(stderr, "a temporary cannot be used in an expression\n");
+      return EHANDLED;
+    }
+    if (b.n_ext != 0 && val->n_ext != 0 && b.ext != val->ext) {
+      fprintf(stderr, "expression refers to both %s and %s\n",
+              SSTR(context, val->ext), SSTR(context, b.ext));
+      return EHANDLED;
+    }
+    val->addend += sign * b.addend;
+    val->base += sign * b.base;
+    if (b.n_ext != 0) {
+      val->ext = b.ext;
+      val->n_ext += sign * b.n_ext;
+    }
+    return 0;
+  default:
+    fprintf(stderr, "eval: invalid ast node\n");
+    return EHANDLED;
+  }
+}
+
+static int literal_cmp(const void *a, const void *b) {
+  const struct literal *la = (const struct literal *) a;
+  const struct literal *lb = (const struct literal *) b;
+
+  if (la->node != lb->node)
+    return (uintptr_t) la->node < (uintptr_t) lb->node ? -1 : 1;
+  if (la->context != lb->context)
+    return (uintptr_t) la->context < (uintptr_t) lb->context ? -1 : 1;
+  return 0;
+}
+
+/* Find the line holding the value of a literal, adding the value to the
+ * pool the first time it is seen. Operands are evaluated with '$' in a
+ * scope of its own, so are looked up by the scope of their record. */
+static int eval_literal(struct emitter *em, struct sym_context *context,
+                        struct ast_node *node, struct reloc_val *val,
+                        struct sym_context *externs) {
+  struct literal key = {
+    .node = node,
+    .context = context == em->here ? context->parent : context,
+  };
+  struct literal *lit;
+  struct reloc_val v;
+  size_t i;
+  int rc;
+
+  lit = bsearch(&key, em->literals, em->n_literals, sizeof key, literal_cmp);
+  if (lit == NULL) {
+    fprintf(stderr, "literal cannot be used here\n");
+    return EHANDLED;
+  }
+
+  if (lit->value == 0) {
+    rc = eval_reloc(em, context, node->v.tuple[0], &v, externs, false);
+    if (rc == 0 && (v.temp || !reloc_valid(&v))) {
+      fprintf(stderr, "%s:%d: literal is not a constant or an address\n",
+              lit->source->path, lit->line);
+      rc = EHANDLED;
+    }
+    if (rc != 0)
+      return rc;
+
+    for (i = 0; i < em->n_values; i++)
+      if (em->values[i].val.addend == v.addend &&
+          em->values[i].val.base == v.base &&
+          em->values[i].val.n_ext == v.n_ext &&
+          (v.n_ext == 0 || em->values[i].val.ext == v.ext))
+        break;
+    if (i == em->n_values) {
+      if (grow(&em->values, &em->values_sz, em->n_values, sizeof em->values[0], 32) != 0)
+        return ENOMEM;
+      em->values[em->n_values++] = (struct pool_value) { .val = v, .first = lit };
+    }
+    lit->value = i + 1;
+  }
+
+  *val = (struct reloc_val) { .addend = em->literal_base + lit->value - 1,
+                              .base = em->relative };
+  return 0;
+}
+
+static int resolve_cmp(const void *a, const void *b) {
+  const struct resolve_entry *ea = (const struct resolve_entry *) a;
+  const struct resolve_entry *eb = (const struct resolve_entry *) b;
+
+  if (ea->context != eb->context)
+    return ea->context < eb->context ? -1 : 1;
+  if (ea->name != eb->name)
+    return ea->name < eb->name ? -1 : 1;
+  return 0;
+}
+
+/* Find the live entry defining the symbol, if it is still an expression. */
+static struct resolve_entry *resolve_find(struct resolve_buf *buf,
+                                          struct sym_context *context,
+                                          str_idx_t name) {
+  struct resolve_entry key = { .context = context, .name = name };
+  struct resolve_entry *entry;
+
+  entry = bsearch(&key, buf->entries, buf->ptr, sizeof key, resolve_cmp);
+  if (entry == NULL)
+    return NULL;
+
+  /* Several definitions of one symbol sort together; only the one whose
+   * expression is the symbol's current value is live. */
+  while (entry > buf->entries && resolve_cmp(entry - 1, &key) == 0)
+    entry--;
+  for (; entry < buf->entries + buf->ptr && resolve_cmp(entry, &key) == 0; entry++) {
+    struct symbol *sym = sym_lookup(context, SYM_T_LABEL, name, SYM_LU_SCOPE_LOCAL);
+    if (sym && sym->subtype == SYM_ST_AST && sym->val.ast == entry->ast)
+      return entry;
+  }
+  return NULL;
+}
+
+struct resolve_deps {
+  size_t *list;
+  size_t sz;
+  size_t ptr;
+};
+
+static int resolve_collect_deps(struct resolve_buf *buf,
+                                struct resolve_deps *deps,
+                                struct sym_context *context,
+                                struct ast_node *node) {
+  struct sym_context *found_context;
+  struct resolve_entry *dep;
+  struct symbol *sym;
+  int rc = 0;
+
+  switch (node->t) {
+  case AST_SYMBOL:
+  case AST_LABEL:
+    sym = sym_lookup_with_context(context, SYM_T_LABEL, node->v.nameref.name,
+                                  SYM_LU_SCOPE_DEFAULT, &found_context, NULL);
+    if (sym && sym->subtype == SYM_ST_AST &&
+        (dep = resolve_find(buf, found_context, node->v.nameref.name)) != NULL) {
+      if (grow(&deps->list, &deps->sz, deps->ptr, sizeof deps->list[0], 64) != 0)
+        return ENOMEM;
+      deps->list[deps->ptr++] = dep - buf->entries;
+    }
+    break;
+  case AST_MINUS:
+  case AST_PLUS:
+    rc = resolve_collect_deps(buf, deps, context, node->v.tuple[0]);
+    if (rc == 0)
+      rc = resolve_collect_deps(buf, deps, context, node->v.tuple[1]);
+    break;
+  case AST_LITERAL:
+    rc = resolve_collect_deps(buf, deps, context, node->v.tuple[0]);
+    break;
+  default:
+    break;
+  }
+  return rc;
+}
+
+static void resolve_report_cycle(struct emitter *em, struct resolve_buf *buf,
+                                 size_t *stack, size_t depth, size_t first) {
+  struct resolve_entry *e = buf->entries + first;
+  size_t i;
+
+  for (i = 0; stack[i] != first; i++);
+
+  fprintf(stderr, "%s:%d: ", e->source->path, e->line);
+  fprintf(stderr, "circular symbol definition: ");
+  for (; i < depth; i++)
+    fprintf(stderr, "%s -> ", SSTR(em->ctx, buf->entries[stack[i]].name));
+  fprintf(stderr, "%s\n", SSTR(em->ctx, e->name));
+}
+
+static int resolve_one(struct emitter *em, struct resolve_entry *e,
+                       struct sym_context *externs) {
+  struct reloc_val val;
+  int rc;
+
+  rc = eval_reloc(em, e->eval_context, e->ast, &val, externs, false);
+  if (rc == 0 && !reloc_valid(&val)) {
+    fprintf(stderr, "not relocatable\n");
+    rc = EHANDLED;
+  }
+  if (rc != 0) {
+    fprintf(stderr, "error evaluating %s defined at %s:%d\n", SSTR(em->ctx, e->name),
+            e->source->path, e->line);
+    return rc;
+  }
+
+  if (val.n_ext)
+    sym_add(e->context, SYM_T_LABEL, e->name, SYM_ST_EXT,
+            (union symval) { .ext = { .addend = val.addend, .name = val.ext } });
+  else
+    sym_add(e->context, SYM_T_LABEL, e->name, val.base ? SYM_ST_REL : SYM_ST_WORD,
+            (union symval) { .numeric = val.addend });
+  if (val.temp)
+    sym_lookup(e->context, SYM_T_LABEL, e->name, SYM_LU_SCOPE_LOCAL)->temp = true;
+
+  return 0;
+}
+
+/* Resolve all expression symbols to words once layout is known.
+ *
+ * Build the graph of dependencies between expression symbols and walk it
+ * depth first, evaluating each symbol after its dependencies so that every
+ * expression is evaluated exactly once. A dependency on a symbol that is
+ * still being visited is a cycle, which is reported in full.
+ *
+ * Symbols that are not defined anywhere become externals in 'externs',
+ * if given. */
+static int resolve_symbols(struct emitter *em, struct resolve_buf *buf,
+                           struct sym_context *externs) {
+  struct resolve_deps deps = { 0 };
+  size_t *stack = NULL;
+  size_t *iter = NULL;
+  size_t *order = NULL;
+  size_t depth;
+  size_t i, k;
+  int rc = 0;
+
+  if (buf->ptr == 0)
+    return 0;
+
+  qsort(buf->entries, buf->ptr, sizeof buf->entries[0], resolve_cmp);
+
+  for (i = 0; rc == 0 && i < buf->ptr; i++) {
+    struct resolve_entry *e = buf->entries + i;
+
+    e->deps = deps.ptr;
+    if (e->state == RES_DONE || resolve_find(buf, e->context, e->name) != e) {
+      e->state = RES_DONE;
+      e->n_deps = 0;
+      continue;
+    }
+    rc = resolve_collect_deps(buf, &deps, e->eval_context, e->ast);
+    e->n_deps = deps.ptr - e->deps;
+  }
+  if (rc != 0)
+    goto finish;
+
+  stack = calloc(buf->ptr, sizeof *stack);
+  iter = calloc(buf->ptr, sizeof *iter);
+  order = calloc(buf->ptr, sizeof *order);
+  if (stack == NULL || iter == NULL || order == NULL) {
+    rc = errno;
+    goto finish;
+  }
+
+  /* Visit in order of definition, not of the sorted entries, so that
+   * literals are given lines in the same order from one run to the next. */
+  for (i = 0; i < buf->ptr; i++)
+    order[buf->entries[i].seq] = i;
+
+  for (k = 0; rc == 0 && k < buf->ptr; k++) {
+    i = order[k];
+    if (buf->entries[i].state != RES_PENDING)
+      continue;
+
+    depth = 0;
+    stack[depth] = i;
+    iter[depth++] = 0;
+    buf->entries[i].state = RES_VISITING;
+
+    while (rc == 0 && depth > 0) {
+      struct resolve_entry *e = buf->entries + stack[depth - 1];
+
+      if (iter[depth - 1] < e->n_deps) {
+        size_t next = deps.list[e->deps + iter[depth - 1]++];
+        struct resolve_entry *d = buf->entries + next;
+
+        if (d->state == RES_VISITING) {
+          resolve_report_cycle(em, buf, stack, depth, next);
+          rc = EHANDLED;
+        } else if (d->state == RES_PENDING) {
+          d->state = RES_VISITING;
+          stack[depth] = next;
+          iter[depth++] = 0;
+        }
+      } else {
+        rc = resolve_one(em, e, externs);
+        e->state = RES_DONE;
+        depth--;
+      }
+    }
+  }
+
+finish:
+  free(stack);
+  free(iter);
+  free(order);
+  free(deps.list);
+  return rc;
+}
+
+const char *asm_phase_names[ASM_PHASE_MAX] = {
+  [ ASM_PHASE_PARSE ] = "parse",
+  [ ASM_PHASE_OPTIMIZE ] = "optimize",
+  [ ASM_PHASE_EXPAND ] = "expand",
+  [ ASM_PHASE_RESOLVE ] = "resolve",
+  [ ASM_PHASE_ENCODE ] = "encode",
+  [ ASM_PHASE_OUTPUT ] = "output",
+};
+
+double asm_lap(struct timespec *since) {
+  struct timespec now;
+  double ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (now.tv_sec - since->tv_sec) * 1e3 +
+       (now.tv_nsec - since->tv_nsec) / 1e6;
+  *since = now;
+  return ms;
+}
+
+/* Set '$' to the address of a record for evaluating its operands. */
+static void emit_locate(struct emitter *e, const struct asm_abstract *a) {
+  sym_add(e->here, SYM_T_LABEL, e->org_name,
+          e->relative ? SYM_ST_REL : SYM_ST_WORD,
+          (union symval) { .numeric = a->addr });
+  e->here->parent = a->context;
+}
+
+/* Evaluate the operand of a laid out record and encode its word. When
+ * 'eager', the word is added to the section if every symbol it refers to
+ * is already final, or EAGAIN returned if not. Otherwise the word is
+ * patched in place and undefined symbols are external if writing a
+ * relocatable object. */
+static int encode_record(struct emitter *e, struct asm_abstract *a,
+                         struct sym_context *externs, bool eager) {
+  const struct mnemonic *m = a->mnemonic;
+  struct reloc_val opr = { 0 };
+  struct ast_node *node;
+  word_t word = 0;
+  int rc = 0;
+
+  if (a->n_operands > 1) {
+    fprintf(stderr, "too many operands\n");
+    return EHANDLED;
+  }
+
+  /* The operands may belong to a macro body that is applied elsewhere
+   * or to a tree that is assembled again later, so are not modified. */
+  for (node = a->operands; node->t != AST_NIL; node = node->v.tuple[1]) {
+    assert(node->t == AST_TUPLE);
+    emit_locate(e, a);
+    rc = eval_reloc(e, e->here, node->v.tuple[0], &opr, externs, eager);
+    if (rc == 0 && !reloc_valid(&opr)) {
+      fprintf(stderr, "%s:%d: operand is not relocatable\n",
+              a->source->path, a->line);
+      rc = EHANDLED;
+    }
+    if (rc != 0)
+      return rc;
+  }
+  a->opr_effective = opr.addend;
+
+  /* Temporaries are at provisional lines until they are allocated */
+  if (opr.temp) {
+    if (grow(&e->uses, &e->uses_sz, e->n_uses, sizeof e->uses[0], 64) != 0)
+      return ENOMEM;
+    e->uses[e->n_uses++] = (struct asm_temp_use) {
+      .addr = a->addr, .temp = opr.addend - e->temp_base
+    };
+  }
+
+  if (e->obj && (opr.base || opr.n_ext) &&
+      (m->type != M_INSTR || m->ins->operands == 1))
+    rc = bobj_add_reloc(e->obj, a->addr - e->section->org,
+                        m->type == M_INSTR ? BOBJ_FIELD_OPERAND : BOBJ_FIELD_WORD,
+                        opr.n_ext ? SSTR(e->ctx, opr.ext) : NULL);
+
+  if (m->type == M_INSTR) {
+    word = (m->ins->opcode << OPCODE_POS) & OPCODE_MASK;
+    if (m->ins->operands == 1)
+      word |= (a->opr_effective << OPERAND_POS) & OPERAND_MASK;
+  } else if (m->type == M_DIRECTIVE && m->dir == D_NUM) {
+    word = a->opr_effective;
+  } else if (m->type == M_DIRECTIVE && m->dir == D_EJA) {
+    word = a->opr_effective - 1;
+  }
+
+  if (rc == 0 && eager)
+    rc = put_word(e->section, word, a);
+  else if (rc == 0)
+    section_set(e->section, a->addr, word);
+  return rc;
+}
+
+/* Note a literal, which is evaluated in 'context' once layout is done. */
+static int note_literal(struct emitter *e, struct sym_context *context,
+                        struct ast_node *node, struct source_public *source,
+                        int line) {
+  if (node->t != AST_LITERAL)
+    return 0;
+  if (grow(&e->literals, &e->literals_sz, e->n_literals, sizeof e->literals[0], 32) != 0)
+    return ENOMEM;
+  e->literals[e->n_literals++] = (struct literal) {
+    .node = node, .context = context, .source = source, .line = line
+  };
+  return 0;
+}
+
+/* Lay out the records that follow in a named section, or in the program
+ * if 'section' is -1. */
+static int enter_section(struct expansion *x, int section) {
+  struct emitter *e = &x->emit;
+
+  if (grow(&e->runs, &e->runs_sz, e->n_runs, sizeof e->runs[0], 16) != 0)
+    return ENOMEM;
+  e->current = section;
+  e->section = section == -1 ? e->image : &e->sections[section].section;
+  e->runs[e->n_runs++] = (struct section_run) { x->abstract.ptr, section };
+  return 0;
+}
+
+/* Switch to the section a SECTION statement names, creating it the first
+ * time. Its constraints may be given at any mention but not changed. */
+static int switch_section(struct expansion *x, struct ast_node *stmt,
+                          struct source_public *source, int line) {
+  struct emitter *e = &x->emit;
+  str_idx_t name = stmt->v.tuple[0]->v.str;
+  struct named_section *ns;
+  struct ast_node *attr;
+  const char *key;
+  word_t value;
+  int i, k;
+
+  for (i = 0; i < e->n_sections && e->sections[i].name != name; i++);
+  if (i == e->n_sections) {
+    if (grow(&e->sections, &e->sections_sz, e->n_sections, sizeof e->sections[0], 8) != 0)
+      return ENOMEM;
+    e->sections[e->n_sections++] = (struct named_section) {
+      .name = name, .source = source, .line = line
+    };
+  }
+  ns = e->sections + i;
+
+  for (attr = stmt->v.tuple[1]; attr->t == AST_TUPLE; attr = attr->v.tuple[1]) {
+    key = SSTR(x->ctx, attr->v.tuple[0]->v.tuple[0]->v.str);
+    value = attr->v.tuple[0]->v.tuple[1]->v.number;
+    for (k = 0; k < SECTION_ATTRS && strcasecmp(key, section_attrs[k]); k++);
+    if (k == SECTION_ATTRS) {
+      fprintf(stderr, "%s:%d: unknown section attribute %s\n", source->path, line, key);
+      return EHANDLED;
+    }
+    if (value < 0 || (k == SECTION_ALIGN && value == 0)) {
+      fprintf(stderr, "%s:%d: invalid %s %d\n", source->path, line,
+              section_attrs[k], value);
+      return EHANDLED;
+    }
+    if (ns->given & (1 << k) && ns->attrs[k] != value) {
+      fprintf(stderr, "%s:%d: section %s already has a different %s\n",
+              source->path, line, SSTR(x->ctx, name), section_attrs[k]);
+      return EHANDLED;
+    }
+    ns->given |= 1 << k;
+    ns->attrs[k] = value;
+  }
+
+  /* The section array may have moved */
+  return enter_section(x, i);
+}
+
+/* Note the definition of a symbol. If code has already been encoded with
+ * a value the name had then, the program must be assembled again with
+ * every word encoded once all the symbols are final. */
+static void emit_define(struct emitter *e, struct sym_context *context, str_idx_t name) {
+  struct symbol *sym = sym_lookup(context, SYM_T_LABEL, name, SYM_LU_SCOPE_DEFAULT);
+
+  if (sym && sym->referenced)
+    e->stale = true;
+}
+
+static void define_label(struct emitter *e, struct asm_abstract *a) {
+  sym_add(a->context, SYM_T_LABEL, a->label.name,
+          e->relative ? SYM_ST_REL : SYM_ST_WORD,
+          (union symval) { .numeric = a->addr });
+}
+
+/* Add a record to the program, laying it out at the cursor and defining
+ * its label. Its word is encoded at once if its operands are known, or
+ * else left as a placeholder and patched by emit_finish(). */
+static int emit_record(struct expansion *x, struct asm_abstract *record) {
+  struct emitter *e = &x->emit;
+  struct asm_abstract *a;
+  struct ast_node *node;
+  int rc = 0;
+
+  if (asm_buf_push(&x->abstract, record) != 0)
+    return ENOMEM;
+  a = x->abstract.records + x->abstract.ptr - 1;
+
+  /* An origin is an address in the program, not in a named section */
+  if (a->flags & HAS_ORG && e->current != -1 && enter_section(x, -1) != 0)
+    return ENOMEM;
+  if (a->flags & HAS_ORG)
+    e->section->cursor = a->org;
+  a->addr = e->section->cursor;
+
+  /* Labels in named sections are only known once they are placed, so
+   * any use of one until then must wait. */
+  if (a->flags & HAS_LABEL && !e->deferred) {
+    emit_define(e, a->context, a->label.name);
+    if (e->current == -1)
+      define_label(e, a);
+    else
+      sym_add(a->context, SYM_T_LABEL, a->label.name, SYM_ST_UNDEF, SYM_VAL_NUL);
+  }
+
+  if (!(a->flags & HAS_INSTR))
+    return 0;
+
+  for (node = a->operands; node->t == AST_TUPLE; node = node->v.tuple[1])
+    if (note_literal(e, a->context, node->v.tuple[0], a->source, a->line) != 0)
+      return ENOMEM;
+
+  if (a->mnemonic == NULL) {
+    fprintf(stderr, "no such mnemonic %s\n", SSTR(x->ctx, a->instr.name));
+    rc = EINVAL;
+  }
+
+  /* The debug pointer only marks the word as used until emit_finish()
+   * points it at the record's final place. Words in named sections are
+   * encoded once the sections are placed. */
+  if (rc == 0)
+    rc = e->deferred || e->current != -1 ? EAGAIN : encode_record(e, a, NULL, true);
+  if (rc == EAGAIN) {
+    rc = put_word(e->section, 0, a);
+    if (rc == 0 && grow(&e->fixups, &e->fixups_sz, e->n_fixups, sizeof e->fixups[0], 64) != 0)
+      rc = ENOMEM;
+    if (rc == 0)
+      e->fixups[e->n_fixups++] = x->abstract.ptr - 1;
+  }
+
+  if (rc != 0 && rc != ENOMEM) {
+    fprintf(stderr, "error at %s:%d\n", a->source->path, a->line);
+    rc = EHANDLED;
+  }
+  return rc;
+}
+
+/* Names made up for outlining, which cannot be written in a source */
+static str_idx_t outline_name(struct asm_ctx *ctx, const char *format, int outline, int site) {
+  char name[64];
+
+  snprintf(name, sizeof name, format, outline, site);
+  return SSTRP(ctx, name);
+}
+
+static struct ast_node *outline_operand(struct expansion *x, str_idx_t name, bool negated) {
+  struct ast_node *operands = asm_outline_operand(name, negated);
+
+  if (ptr_push((void ***) &x->bodies, &x->n_bodies, &x->bodies_sz, operands) != 0) {
+    ast_free_tree(operands);
+    return NULL;
+  }
+  return operands;
+}
+
+/* Turn the first records of a site of an outlined sequence into a call
+ * of its shared copy, keeping the records of the first site to copy. */
+static int outline_site(struct expansion *x, struct asm_abstract *record) {
+  static const char *const call[OUTLINE_CALL] = { "LDN", "STO", "JMP" };
+  struct emitter *e = &x->emit;
+  const struct outline_ref *ref = e->outline->refs + x->abstract.ptr;
+  const struct asm_outline *ol = e->outline->outlines + ref->outline;
+  size_t pos = x->abstract.ptr - ol->sites[ref->site];
+
+  if (ref->site == 0)
+    e->copies[ref->outline][pos] = *record;
+  if (pos >= OUTLINE_CALL)
+    return 0;
+
+  record->instr = (struct symref) { SYM_T_MNEMONIC, SSTRP(x->ctx, call[pos]) };
+  record->mnemonic = arch_find_instr(call[pos]);
+  record->n_operands = 1;
+  switch (pos) {
+  case 0:
+    record->operands = outline_operand(x, outline_name(x->ctx, "%%outline%d.%d", ref->outline,
+                                                       ref->site), true);
+    break;
+  case 1:
+    record->operands = outline_operand(x, outline_name(x->ctx, "%%outline%d.link", ref->outline, 0),
+                                       false);
+    break;
+  case 2:
+    record->operands = outline_operand(x, outline_name(x->ctx, "%%outline%d.entry", ref->outline, 0),
+                                       false);
+    record->context = x->context;
+    record->flags |= HAS_LABEL;
+    record->label = (struct symref) {
+      SYM_T_LABEL, outline_name(x->ctx, "%%outline%d.%d", ref->outline, ref->site)
+    };
+    break;
+  }
+  return record->operands ? 0 : ENOMEM;
+}
+
+/* Add a record of the program as expanded, leaving it out or making it
+ * part of a call as planned. */
+static int emit(struct expansion *x, struct asm_abstract *record) {
+  struct emitter *e = &x->emit;
+
+  if (e->outline && e->outline->refs[x->abstract.ptr].outline != -1 &&
+      outline_site(x, record) != 0)
+    return ENOMEM;
+  if (e->omit && e->omit[x->abstract.ptr])
+    record->flags &= ~HAS_INSTR;
+  return emit_record(x, record);
+}
+
+/* Add the shared copy of each outlined sequence to the end of the
+ * program, followed by a jump back through the link line, the link line
+ * and the entry line. */
+static int emit_outlines(struct expansion *x) {
+  struct emitter *e = &x->emit;
+  const struct asm_outline *ol;
+  struct asm_abstract a;
+  size_t k;
+  int rc = 0;
+  int o;
+
+  if (e->outline == NULL || e->outline->n == 0)
+    return 0;
+  if (e->current != -1 && enter_section(x, -1) != 0)
+    return ENOMEM;
+
+  for (o = 0; rc == 0 && o < e->outline->n; o++) {
+    ol = e->outline->outlines + o;
+    a = (struct asm_abstract) {
+      .context = x->context,
+      .flags = HAS_LABEL,
+      .label = { SYM_T_LABEL, outline_name(x->ctx, "%%outline%d", o, 0) },
+      .source = e->copies[o][0].source,
+      .line = e->copies[o][0].line,
+    };
+    rc = emit_record(x, &a);
+    e->outline_body[o] = x->abstract.ptr;
+    for (k = 0; rc == 0 && k < ol->length; k++) {
+      a = e->copies[o][k];
+      a.flags = HAS_INSTR;
+      rc = emit_record(x, &a);
+    }
+
+    a = (struct asm_abstract) {
+      .context = x->context,
+      .flags = HAS_INSTR,
+      .instr = { SYM_T_MNEMONIC, SSTRP(x->ctx, "JMP") },
+      .mnemonic = arch_find_instr("JMP"),
+      .n_operands = 1,
+      .operands = outline_operand(x, outline_name(x->ctx, "%%outline%d.link", o, 0), false),
+      .source = e->copies[o][0].source,
+      .line = e->copies[o][0].line,
+    };
+    if (rc == 0 && a.operands == NULL)
+      rc = ENOMEM;
+    if (rc == 0)
+      rc = emit_record(x, &a);
+    a.flags = HAS_LABEL | HAS_INSTR;
+    a.label = (struct symref) { SYM_T_LABEL, outline_name(x->ctx, "%%outline%d.link", o, 0) };
+    a.instr = (struct symref) { SYM_T_MNEMONIC, SSTRP(x->ctx, "NUM") };
+    a.mnemonic = arch_find_instr("NUM");
+    a.n_operands = 0;
+    a.operands = AST_NIL_NODE;
+    if (rc == 0)
+      rc = emit_record(x, &a);
+    a.label = (struct symref) { SYM_T_LABEL, outline_name(x->ctx, "%%outline%d.entry", o, 0) };
+    a.instr = (struct symref) { SYM_T_MNEMONIC, SSTRP(x->ctx, "EJA") };
+    a.mnemonic = arch_find_instr("EJA");
+    a.n_operands = 1;
+    a.operands = outline_operand(x, outline_name(x->ctx, "%%outline%d", o, 0), false);
+    if (rc == 0 && a.operands == NULL)
+      rc = ENOMEM;
+    if (rc == 0)
+      rc = emit_record(x, &a);
+  }
+  return rc;
+}
+
+/* Give the temporaries provisional lines after the end of the program
+ * and room for every literal, one each, so that the words referring to
+ * them can be found. */
+static void place_temps(struct emitter *e) {
+  int k;
+
+  e->temp_base = e->literal_base + e->n_literals;
+  for (k = 0; k < e->n_temps; k++)
+    sym_add(e->temps[k].context, SYM_T_LABEL, e->temps[k].name,
+            e->relative ? SYM_ST_REL : SYM_ST_WORD,
+            (union symval) { .numeric = e->temp_base + k });
+}
+
+/* Add the pool of literal values after the program. Each line is listed
+ * against the first literal with its value. */
+static int emit_literals(struct expansion *x) {
+  struct emitter *e = &x->emit;
+  const struct pool_value *pv;
+  struct asm_abstract *a;
+  size_t i;
+  int rc = 0;
+
+  if (x->ctx->verbose && e->n_literals > 0)
+    fprintf(stderr, "literals: %zu in %zu lines\n", e->n_literals, e->n_values);
+
+  e->section->cursor = e->literal_base;
+  for (i = 0; rc == 0 && i < e->n_values; i++) {
+    pv = e->values + i;
+    if (asm_buf_push(&x->abstract, &(struct asm_abstract) {
+        .context = pv->first->context,
+        .flags = HAS_INSTR,
+        .addr = e->section->cursor,
+        .instr = { .type = SYM_T_MNEMONIC, .name = SSTRP(x->ctx, "num") },
+        .mnemonic = arch_find_instr("num"),
+        .operands = AST_NIL_NODE,
+        .opr_effective = pv->val.addend,
+        .source = pv->first->source,
+        .line = pv->first->line,
+      }) != 0)
+      return ENOMEM;
+    a = x->abstract.records + x->abstract.ptr - 1;
+    if (e->obj && (pv->val.base || pv->val.n_ext))
+      rc = bobj_add_reloc(e->obj, a->addr - e->section->org, BOBJ_FIELD_WORD,
+                          pv->val.n_ext ? SSTR(x->ctx, pv->val.ext) : NULL);
+    if (rc == 0)
+      rc = put_word(e->section, pv->val.addend, a);
+  }
+  if (rc != 0 && rc != ENOMEM) {
+    fprintf(stderr, "error placing literals at 0x%x\n", e->literal_base);
+    rc = EHANDLED;
+  }
+  return rc;
+}
+
+/* Share lines between temporaries that are not live at the same time,
+ * move the words that refer to them to their final lines and add the
+ * lines to the program. */
+static int emit_temps(struct expansion *x) {
+  struct emitter *e = &x->emit;
+  addr_t base = e->section->cursor;
+  struct asm_abstract *a;
+  struct temp *temp;
+  int *slot;
+  int lines;
+  size_t i;
+  int k, l;
+  int rc = 0;
+
+  if (e->n_temps == 0)
+    return 0;
+
+  slot = calloc(e->n_temps, sizeof *slot);
+  if (slot == NULL)
+    return errno;
+  lines = asm_alloc_temps(e->section, x->abstract.records, x->abstract.ptr,
+                          e->uses, e->n_uses, e->n_temps, slot);
+  if (lines == -1) {
+    free(slot);
+    return ENOMEM;
+  }
+  if (x->ctx->verbose)
+    fprintf(stderr, "temporaries: %d in %d lines\n", e->n_temps, lines);
+
+  /* Operands and addresses alike move by the same amount */
+  for (i = 0; i < e->n_uses; i++) {
+    k = e->uses[i].temp;
+    section_set(e->section, e->uses[i].addr, section_get(e->section, e->uses[i].addr) +
+                base + slot[k] - (e->temp_base + k));
+  }
+
+  for (k = 0; k < e->n_temps; k++) {
+    temp = e->temps + k;
+    if (slot[k] != -1)
+      sym_add(temp->context, SYM_T_LABEL, temp->name,
+              e->relative ? SYM_ST_REL : SYM_ST_WORD,
+              (union symval) { .numeric = base + slot[k] });
+  }
+
+  /* Each line is listed against the first temporary given it */
+  for (l = 0; rc == 0 && l < lines; l++) {
+    for (k = 0; slot[k] != l; k++);
+    temp = e->temps + k;
+    if (asm_buf_push(&x->abstract, &(struct asm_abstract) {
+        .context = temp->context,
+        .flags = HAS_INSTR,
+        .addr = base + l,
+        .instr = { .type = SYM_T_MNEMONIC, .name = SSTRP(x->ctx, "num") },
+        .mnemonic = arch_find_instr("num"),
+        .operands = AST_NIL_NODE,
+        .source = temp->source,
+        .line = temp->line,
+      }) != 0) {
+      rc = ENOMEM;
+      break;
+    }
+    a = x->abstract.records + x->abstract.ptr - 1;
+    rc = put_word(e->section, 0, a);
+  }
+  if (rc != 0 && rc != ENOMEM) {
+    fprintf(stderr, "error placing temporaries at 0x%x\n", base);
+    rc = EHANDLED;
+  }
+
+  free(slot);
+  return rc;
+}
+
+/* The store the sections are placed in: the size asked for or, if the
+ * program is bigger, the smallest power of two that holds it. */
+static addr_t store_size(addr_t memory, addr_t end) {
+  addr_t size;
+
+  for (size = memory; size < end; size <<= 1);
+  return size;
+}
+
+static const char *layout_owner(struct emitter *e, int owner) {
+  if (owner == -1)
+    return "the program";
+  else if (owner == -2)
+    return "literals and temporaries";
+  else
+    return SSTR(e->ctx, e->sections[owner].name);
+}
+
+/* Place the named sections in the lines the program leaves free, apart
+ * from room after its end for its literals and temporaries, then move
+ * their words into the program and their records and labels with them. */
+static int place_sections(struct expansion *x) {
+  struct emitter *e = &x->emit;
+  struct section *image = e->image;
+  addr_t end = image->cursor;
+  addr_t reserve = end + e->n_literals + e->n_temps;
+  struct layout_region *regions;
+  struct named_section *ns;
+  struct asm_abstract *a;
+  struct layout store;
+  addr_t pos, next;
+  addr_t lines;
+  size_t r, run;
+  int clash;
+  int rc = 0;
+  int i;
+
+  if (e->n_sections == 0)
+    return 0;
+  if (e->current != -1 && enter_section(x, -1) != 0)
+    return ENOMEM;
+
+  regions = calloc(e->n_sections, sizeof *regions);
+  if (regions == NULL)
+    return errno;
+
+  layout_init(&store, store_size(e->memory, image->org + image->length > reserve ?
+                                            image->org + image->length : reserve));
+  for (pos = 0; rc == 0 && section_next_range(image, pos, &pos, &next); pos = next)
+    rc = layout_reserve(&store, pos, next, -1, &clash);
+  if (rc == 0)
+    rc = layout_reserve(&store, end, reserve, -2, &clash);
+  if (rc != 0) {
+    fprintf(stderr, "no room for %zu literals and temporaries at 0x%x\n",
+            e->n_literals + e->n_temps, end);
+    goto finish;
+  }
+
+  for (i = 0; i < e->n_sections; i++) {
+    ns = e->sections + i;
+    regions[i] = (struct layout_region) {
+      .length = ns->section.length,
+      .align = ns->attrs[SECTION_ALIGN],
+      .low = ns->attrs[SECTION_ABOVE],
+      .high = ns->attrs[SECTION_BELOW],
+      .fixed = ns->given & (1 << SECTION_AT),
+      .start = ns->attrs[SECTION_AT],
+    };
+    if (regions[i].fixed &&
+        ((regions[i].align && regions[i].start % regions[i].align) ||
+         regions[i].start < regions[i].low ||
+         (regions[i].high && regions[i].start + regions[i].length > regions[i].high))) {
+      fprintf(stderr, "%s:%d: section %s at 0x%x breaks its own constraints\n",
+              ns->source->path, ns->line, SSTR(x->ctx, ns->name), regions[i].start);
+      rc = EHANDLED;
+    }
+  }
+  if (rc != 0)
+    goto finish;
+
+  rc = layout_place(&store, regions, e->n_sections, &clash);
+  if (rc == EEXIST) {
+    for (i = 0; regions[i].placed || !regions[i].fixed; i++);
+    ns = e->sections + i;
+    fprintf(stderr, "%s:%d: section %s at 0x%x overlaps %s\n", ns->source->path,
+            ns->line, SSTR(x->ctx, ns->name), regions[i].start, layout_owner(e, clash));
+  } else if (rc == ENOSPC) {
+    for (lines = 0, pos = 0; layout_next_free(&store, pos, &pos, &next); pos = next)
+      lines += next - pos;
+    for (i = 0; i < e->n_sections; i++) {
+      ns = e->sections + i;
+      if (!regions[i].placed)
+        fprintf(stderr, "%s:%d: no room for section %s of %u lines, "
+                "%u lines free in a store of %u\n",
+                ns->source->path, ns->line, SSTR(x->ctx, ns->name),
+                regions[i].length, lines, store.size);
+    }
+  }
+  if (rc != 0) {
+    rc = EHANDLED;
+    goto finish;
+  }
+
+  for (i = 0; rc == 0 && i < e->n_sections; i++) {
+    ns = e->sections + i;
+    ns->base = regions[i].start;
+    if (x->ctx->verbose)
+      fprintf(stderr, "section %s: %u lines at 0x%x\n", SSTR(x->ctx, ns->name),
+              regions[i].length, ns->base);
+    for (pos = 0; rc == 0 && section_next_range(&ns->section, pos, &pos, &next); ) {
+      image->cursor = ns->base + pos - ns->section.org;
+      for (; rc == 0 && pos < next; pos++)
+        rc = put_word(image, section_get(&ns->section, pos), section_debug(&ns->section, pos));
+    }
+  }
+  image->cursor = end;
+
+  for (run = 0; rc == 0 && run < e->n_runs; run++) {
+    if (e->runs[run].section == -1)
+      continue;
+    ns = e->sections + e->runs[run].section;
+    for (r = e->runs[run].first;
+         r < (run + 1 < e->n_runs ? e->runs[run + 1].first : x->abstract.ptr); r++) {
+      a = x->abstract.records + r;
+      a->addr += ns->base;
+      if (a->flags & HAS_LABEL && !e->deferred)
+        define_label(e, a);
+    }
+  }
+
+finish:
+  layout_free(&store);
+  free(regions);
+  return rc;
+}
+
+static int reloc_cmp(const void *a, const void *b) {
+  const struct bobj_reloc *ra = (const struct bobj_reloc *) a;
+  const struct bobj_reloc *rb = (const struct bobj_reloc *) b;
+
+  return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+/* Complete the program once it is expanded: add the shared copies of
+ * outlined sequences, define the labels if that was deferred, resolve the expression symbols and patch the words whose
+ * operands were not known when they were laid out. */
+static int emit_finish(struct expansion *x, struct sym_context *externs,
+                       double *ms, struct timespec *t) {
+  struct emitter *e = &x->emit;
+  struct asm_abstract *a;
+  size_t i;
+  int rc;
+
+  rc = emit_outlines(x);
+  if (rc == 0)
+    rc = place_sections(x);
+  if (rc != 0)
+    return rc;
+  for (i = 0; e->deferred && i < x->abstract.ptr; i++)
+    if (x->abstract.records[i].flags & HAS_LABEL)
+      define_label(e, x->abstract.records + i);
+  if (e->n_literals > 0)
+    qsort(e->literals, e->n_literals, sizeof *e->literals, literal_cmp);
+  e->literal_base = e->section->cursor;
+  place_temps(e);
+  e->pool = x->abstract.ptr;
+
+  rc = resolve_symbols(e, &x->resolve, externs);
+  ms[ASM_PHASE_RESOLVE] += asm_lap(t);
+
+  if (rc == 0 && x->ctx->verbose) {
+    for (i = 0; i < SYM_T_MAX; i++)
+      sym_print_table(x->ctx->root, i);
+    for (i = 0; i < SYM_T_MAX; i++)
+      sym_print_table(x->context, i);
+  }
+
+  for (i = 0; rc == 0 && i < e->n_fixups; i++) {
+    a = x->abstract.records + e->fixups[i];
+    rc = encode_record(e, a, externs, false);
+    if (rc != 0) {
+      fprintf(stderr, "error at %s:%d\n", a->source->path, a->line);
+      rc = EHANDLED;
+    }
+  }
+
+  if (rc == 0)
+    rc = emit_literals(x);
+  if (rc == 0)
+    rc = emit_temps(x);
+
+  /* Relocations were added as words were encoded, not in order */
+  if (rc == 0 && e->obj && e->obj->n_relocs > 0)
+    qsort(e->obj->relocs, e->obj->n_relocs, sizeof *e->obj->relocs, reloc_cmp);
+
+  if (rc == 0 && x->ctx->verbose)
+    fprintf(stderr, "Abstract assembly source:\n");
+  for (i = 0; rc == 0 && i < x->abstract.ptr; i++) {
+    a = x->abstract.records + i;
+    if (a->flags & HAS_INSTR)
+      section_set_debug(e->section, a->addr, a);
+    if (x->ctx->verbose)
+      asm_log_abstract(x->ctx->strtab, a);
+  }
+
+  ms[ASM_PHASE_ENCODE] += asm_lap(t);
+  return rc;
+}
+
+/* Define a name in a new scope as an expression evaluated in the scope
+ * enclosing it, as for the arguments of a macro. */
+static int bind_argument(struct expansion *x, struct sym_context *context,
+                         struct sym_context *scope, str_idx_t name,
+                         struct ast_node *expr, struct asm_source *source, int line) {
+  struct ast_node *copy = ast_copy_tree(expr, NULL);
+  enum sym_subtype subtype;
+  union symval sv;
+
+  if (eval_expr(context, copy, true) == EVAL_ERROR) {
+    ast_free_tree(copy);
+    return EINVAL;
+  }
+  subtype = expr_to_symval(&sv, copy);
+  if (note_literal(&x->emit, context, copy, &source->public, line) != 0) {
+    ast_free_tree(copy);
+    return ENOMEM;
+  }
+  sym_add(scope, SYM_T_LABEL, name, subtype, sv);
+  if (subtype != SYM_ST_AST)
+    ast_free_tree(copy);
+  else if (resolve_add(&x->resolve, scope, context, name, copy, &source->public, line) != 0)
+    return ENOMEM;
+  return 0;
+}
+
+/* Evaluate an expression that must be known where it is expanded, such
+ * as the count of a REPT or the condition of an IF. */
+static int eval_now(struct sym_context *context, struct ast_node *expr,
+                    struct asm_source *source, int line, word_t *value) {
+  struct ast_node *copy = ast_copy_tree(expr, NULL);
+  int rc = 0;
+
+  if (eval_expr(context, copy, true) == EVAL_OK && copy->t == AST_NUMBER) {
+    *value = copy->v.number;
+  } else {
+    fprintf(stderr, "%s:%d: value must be known where it is expanded\n",
+            source->public.path, line);
+    rc = EHANDLED;
+  }
+  ast_free_tree(copy);
+  return rc;
+}
+
+static int parse_stmts(struct expansion *x, struct sym_context *context,
+                       struct ast_node *list, struct asm_source *source,
+                       const struct asm_site *site);
+
+/* Expand MULC dst, src, k like the application of a macro whose body
+ * multiplies by the constant k. The body is kept with the expansion,
+ * since its records refer to it. */
+static int expand_mulc(struct expansion *x, struct sym_context *context,
+                       struct ast_node *stmt, struct asm_source *source,
+                       const struct asm_site *site) {
+  struct ast_node *operands = stmt->v.tuple[1];
+  int line = stmt->debug.loc.start.line;
+  struct sym_context *scope;
+  struct ast_node *body;
+  int cycles;
+  word_t k;
+  int rc;
+
+  if (ast_count_list(operands) != 3) {
+    fprintf(stderr, "%s:%d: MULC takes a destination, a source and a constant\n",
+            source->public.path, line);
+    return EHANDLED;
+  }
+  rc = eval_now(context, operands->v.tuple[1]->v.tuple[1]->v.tuple[0], source, line, &k);
+  if (rc != 0)
+    return rc;
+
+  scope = expansion_scope(x, context);
+  if (scope == NULL)
+    return ENOMEM;
+  rc = bind_argument(x, context, scope, SSTRP(x->ctx, "dst"), operands->v.tuple[0], source, line);
+  if (rc == 0)
+    rc = bind_argument(x, context, scope, SSTRP(x->ctx, "src"), operands->v.tuple[1]->v.tuple[0],
+                       source, line);
+  if (rc != 0)
+    return rc;
+
+  body = asm_mulc_expand(x->ctx->strtab, k, SSTRP(x->ctx, "dst"), SSTRP(x->ctx, "src"),
+                         SSTRP(x->ctx, "tmp"), &stmt->debug, &cycles);
+  if (ptr_push((void ***) &x->bodies, &x->n_bodies, &x->bodies_sz, body) != 0) {
+    ast_free_tree(body);
+    return ENOMEM;
+  }
+  if (x->ctx->verbose)
+    fprintf(stderr, "%s:%d: MULC by %d takes %d cycles\n",
+            source->public.path, line, k, cycles);
+  site = expansion_site(x, site, source, line, stmt->v.tuple[0]->v.mnemonic.name);
+  if (site == NULL)
+    return ENOMEM;
+  return parse_stmts(x, scope, body, source, site);
+}
+
+static int parse_stmts(struct expansion *x,
+                       struct sym_context *context,
+                       struct ast_node *list,
+                       struct asm_source *source,
+                       const struct asm_site *site) {
+  struct resolve_buf *resolve = &x->resolve;
+  struct ast_node *stmt;
+  struct asm_abstract a;
+  int stmt_i;
+  int rc;
+
+  assert(list->t == AST_LIST);
+
+  for (stmt_i = 0; stmt_i < list->v.list.length; stmt_i++) {
+    struct asm_abstract new_a = { 0 };
+
+    stmt = &list->v.list.nodes[stmt_i];
+    new_a.source = &source->public;
+    new_a.line = stmt->debug.loc.start.line;
+    new_a.site = site;
+    new_a.context = context;
+
+    if (stmt_i == 0)
+      a = new_a;
+
+    switch (stmt->t) {
+    case AST_LABEL:
+      if (a.flags & (HAS_ORG | HAS_LABEL) && (rc = emit(x, &a)) != 0)
+        return rc;
+      a = new_a;
+      a.flags |= HAS_LABEL;
+      a.label = stmt->v.nameref;
+      break;
+    case AST_ORG:
+      if (a.flags & (HAS_ORG | HAS_LABEL) && (rc = emit(x, &a)) != 0)
+        return rc;
+      a = new_a;
+      a.flags |= HAS_ORG;
+      a.org = stmt->v.number;
+      break;
+    case AST_SECTION:
+      if (a.flags & (HAS_ORG | HAS_LABEL) && (rc = emit(x, &a)) != 0)
+        return rc;
+      a = new_a;
+      rc = switch_section(x, stmt, &source->public, new_a.line);
+      if (rc != 0)
+        return rc;
+      break;
+    case AST_EQU:
+      {
+        struct ast_node *copy = ast_copy_tree(stmt->v.tuple[1], NULL);
+        enum sym_subtype subtype;
+        union symval sv;
+
+        assert(stmt->v.tuple[0]->t == AST_NAME);
+        /* Fold what is known already, so that it may count a REPT */
+        eval_expr(context, copy, true);
+        subtype = expr_to_symval(&sv, copy);
+        if (note_literal(&x->emit, context, copy, &source->public, new_a.line) != 0) {
+          ast_free_tree(copy);
+          return ENOMEM;
+        }
+        emit_define(&x->emit, context, stmt->v.tuple[0]->v.str);
+        sym_add(context, SYM_T_LABEL, stmt->v.tuple[0]->v.str, subtype, sv);
+        if (subtype != SYM_ST_AST)
+          ast_free_tree(copy);
+        else if (resolve_add(resolve, context, context, stmt->v.tuple[0]->v.str, copy,
+                             &source->public, new_a.line) != 0)
+          return ENOMEM;
+      }
+      break;
+    case AST_EXPORT:
+      {
+        struct ast_node *name;
+
+        for (name = stmt->v.tuple[0]; name->t == AST_TUPLE; name = name->v.tuple[1])
+          if (ptr_push((void ***) &x->exports, &x->n_exports, &x->exports_sz,
+                       name->v.tuple[0]) != 0)
+            return ENOMEM;
+      }
+      break;
+    case AST_TEMP:
+      {
+        struct ast_node *name;
+        struct emitter *e = &x->emit;
+        str_idx_t str;
+
+        for (name = stmt->v.tuple[0]; name->t == AST_TUPLE; name = name->v.tuple[1]) {
+          str = name->v.tuple[0]->v.str;
+          emit_define(e, context, str);
+          sym_add(context, SYM_T_LABEL, str, SYM_ST_UNDEF, SYM_VAL_NUL);
+          sym_lookup(context, SYM_T_LABEL, str, SYM_LU_SCOPE_LOCAL)->temp = true;
+          if (grow(&e->temps, &e->temps_sz, e->n_temps, sizeof e->temps[0], 32) != 0)
+            return ENOMEM;
+          e->temps[e->n_temps++] = (struct temp) {
+            .context = context, .name = str,
+            .source = &source->public, .line = new_a.line
+          };
+        }
+      }
+      break;
+    case AST_MACRO:
+      {
+        struct macro *macro = calloc(1, sizeof *macro);
+        struct mnemonic *m;
+        union symval sv;
+
+        if (macro == NULL ||
+            ptr_push((void ***) &x->macros, &x->n_macros, &x->macros_sz, macro) != 0) {
+          free(macro);
+          return ENOMEM;
+        }
+        m = &macro->m;
+        macro->source = source;
+        assert(stmt->v.tuple[0]->t == AST_NAME);
+        assert(stmt->v.tuple[1]->t == AST_TUPLE);
+
+        /* TODO: lose the cast! */
+        m->name = (char *) SSTR(x->ctx, stmt->v.tuple[0]->v.str);
+        m->type = M_MACRO;
+        m->ast = stmt->v.tuple[1];
+        sv.internal = m;
+
+        sym_add(context, SYM_T_MNEMONIC,
+                stmt->v.tuple[0]->v.str, true, sv);
+      }
+      break;
+    case AST_REPT:
+      {
+        struct sym_context *scope;
+        word_t count, i;
+
+        if (a.flags && (rc = emit(x, &a)) != 0)
+          return rc;
+        a = new_a;
+        rc = eval_now(context, stmt->v.tuple[0], source, new_a.line, &count);
+        if (rc == 0 && count < 0) {
+          fprintf(stderr, "%s:%d: negative repeat count %d\n",
+                  source->public.path, new_a.line, count);
+          rc = EHANDLED;
+        }
+        for (i = 0; rc == 0 && i < count; i++) {
+          scope = expansion_scope(x, context);
+          rc = scope ? parse_stmts(x, scope, stmt->v.tuple[1], source, site) : ENOMEM;
+        }
+        if (rc != 0)
+          return rc;
+      }
+      break;
+    case AST_IRP:
+      {
+        struct ast_node *value;
+        struct sym_context *scope;
+
+        if (a.flags && (rc = emit(x, &a)) != 0)
+          return rc;
+        a = new_a;
+        for (value = stmt->v.tuple[1]->v.tuple[0]; value->t == AST_TUPLE; value = value->v.tuple[1]) {
+          scope = expansion_scope(x, context);
+          if (scope == NULL)
+            return ENOMEM;
+          rc = bind_argument(x, context, scope, stmt->v.tuple[0]->v.str,
+                             value->v.tuple[0], source, new_a.line);
+          if (rc == 0)
+            rc = parse_stmts(x, scope, stmt->v.tuple[1]->v.tuple[1], source, site);
+          if (rc != 0)
+            return rc;
+        }
+      }
+      break;
+    case AST_IF:
+      {
+        word_t cond;
+
+        if (a.flags && (rc = emit(x, &a)) != 0)
+          return rc;
+        a = new_a;
+        rc = eval_now(context, stmt->v.tuple[0], source, new_a.line, &cond);
+        if (rc == 0)
+          rc = parse_stmts(x, context, stmt->v.tuple[1]->v.tuple[cond ? 0 : 1], source, site);
+        if (rc != 0)
+          return rc;
+      }
+      break;
+    case AST_INSTR:
+      assert(stmt->v.tuple[0]->t == AST_MNEMONIC);
+      {
+        /* Handle macro application */
+        struct symbol *msym = sym_lookup(context, SYM_T_MNEMONIC,
+                                         stmt->v.tuple[0]->v.mnemonic.name,
+                                         SYM_LU_SCOPE_DEFAULT);
+        struct mnemonic *m = msym ? (struct mnemonic *) msym->val.internal : NULL;
+        if (m) {
+          struct sym_context *new_context;
+          const struct asm_site *new_site;
+          struct ast_node *macro = m->ast;
+          struct ast_node *actual_args;
+          struct ast_node *formal_args;
+
+          if (m->type == M_MACRO) {
+            if (a.flags) {
+              /* Flush out any old stuff first */
+              rc = emit(x, &a);
+              if (rc != 0)
+                return rc;
+              a = new_a;
+            }
+            new_context = expansion_scope(x, context);
+            if (new_context == NULL)
+              return ENOMEM;
+
+            for (actual_args = stmt->v.tuple[1],
+                 formal_args = macro->v.tuple[0];
+                 actual_args->t == AST_TUPLE ||
+                 formal_args->t == AST_TUPLE;
+                 actual_args = actual_args->v.tuple[1],
+                 formal_args = formal_args->v.tuple[1]) {
+              if (formal_args->t == AST_NIL) {
+                fprintf(stderr, "too many arguments to macro %s\n", m->name);
+                return EINVAL;
+              } else if (actual_args->t == AST_NIL) {
+                fprintf(stderr, "insuficient arugments to macro %s\n", m->name);
+                return EINVAL;
+              }
+              /* Actual arguments are expressions in the caller's context. */
+              rc = bind_argument(x, context, new_context, formal_args->v.tuple[0]->v.str,
+                                 actual_args->v.tuple[0], source, new_a.line);
+              if (rc != 0)
+                return rc;
+            }
+            if (x->ctx->verbose) {
+              fprintf(stderr, "local symbol table for application of macro %s\n", m->name);
+              sym_print_table(new_context, SYM_T_LABEL);
+            }
+
+            new_site = expansion_site(x, site, source, new_a.line, SSTRP(x->ctx, m->name));
+            if (new_site == NULL)
+              return ENOMEM;
+            rc = parse_stmts(x, new_context, macro->v.tuple[1],
+                             ((struct macro *) m)->source, new_site);
+            if (rc != 0) return rc;
+            continue;
+          }
+        } else if (stmt->v.tuple[0]->v.mnemonic.builtin &&
+                   stmt->v.tuple[0]->v.mnemonic.builtin->type == M_PSEUDO) {
+          if (a.flags && (rc = emit(x, &a)) != 0)
+            return rc;
+          a = new_a;
+          rc = expand_mulc(x, context, stmt, source, site);
+          if (rc != 0)
+            return rc;
+          continue;
+        }
+      }
+
+      a.flags |= HAS_INSTR;
+      a.line = new_a.line;
+      a.instr = (struct symref) { SYM_T_MNEMONIC, stmt->v.tuple[0]->v.mnemonic.name };
+      a.mnemonic = stmt->v.tuple[0]->v.mnemonic.builtin;
+
+      a.n_operands = ast_count_list(stmt->v.tuple[1]);
+      a.operands = stmt->v.tuple[1];
+
+      rc = emit(x, &a);
+      if (rc != 0)
+        return rc;
+      a = new_a;
+      break;
+    default:
+      assert(!"unexpected AST node type in statement list");
+    }
+  }
+
+  /* Flush a trailing label or origin so it is defined at the end */
+  if (list->v.list.length > 0 && a.flags)
+    return emit(x, &a);
+
+  return 0;
+}
+
+/* Lex and parse one source into its AST. This touches no symbol tables
+ * and so may be run concurrently for different sources.
+ *
+ * If a cache directory is given, look for the AST under a hash of the
+ * source text first and flag it to be stored there otherwise. */
+static int parse_source(struct asm_ctx *ctx, struct asm_source *source, const char *cache_dir) {
+  yyscan_t scanner;
+  void *buffer;
+  int rc = 0;
+
+  if (!strcmp(source->public.path, "-")) {
+    free(source->public.leaf);
+    source->public.leaf = strdup("stdin");
+  }
+
+  /* Text given in memory is there already */
+  if (source->text.text == NULL)
+    rc = srcbuf_open(&source->text, source->public.path);
+  if (rc != 0) {
+    fprintf(stderr, "%s: %s\n", source->public.path, strerror(rc));
+    return EHANDLED;
+  }
+
+  if (cache_dir) {
+    source->cache_key = asm_cache_hash(source->text.text, source->text.len);
+    if (asm_cache_load(cache_dir, source->cache_key, source->public.strtab, &source->ast) == 0) {
+      if (ctx->verbose)
+        fprintf(stderr, "%s: loaded from cache\n", source->public.path);
+      return 0;
+    }
+  }
+
+  if (yylex_init_extra(source, &scanner) != 0)
+    return errno;
+
+  /* Scan the text in place, including the NUL bytes that follow it. */
+  buffer = yy_scan_buffer(source->text.text, source->text.len + 2, scanner);
+  if (buffer == NULL) {
+    yylex_destroy(scanner);
+    return ENOMEM;
+  }
+
+  rc = yyparse(scanner, &source->ast);
+  if (rc != 0)
+    rc = EHANDLED;
+
+  yy_delete_buffer(buffer, scanner);
+  yylex_destroy(scanner);
+
+  /* Storing reads the string table, which other threads may be growing */
+  source->uncached = rc == 0 && cache_dir;
+
+  return rc;
+}
+
+static void *parse_worker(void *arg) {
+  struct parse_pool *pool = (struct parse_pool *) arg;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (i >= pool->num_sources)
+      break;
+    if (pool->sources[i].stale)
+      pool->sources[i].rc = parse_source(pool->ctx, pool->sources + i, pool->cache_dir);
+  }
+
+  return NULL;
+}
+
+/* Parse all the stale sources, using up to 'jobs' threads. */
+static int parse_sources(struct asm_ctx *ctx, struct asm_source *sources,
+                         int num_sources, int jobs, const char *cache_dir) {
+  struct parse_pool pool = {
+    .ctx = ctx,
+    .sources = sources,
+    .num_sources = num_sources,
+    .next = 0,
+    .cache_dir = cache_dir,
+  };
+  pthread_t *threads;
+  int started;
+  int stale;
+  int rc = 0;
+  int i;
+
+  for (i = 0, stale = 0; i < num_sources; i++)
+    if (sources[i].stale)
+      stale++;
+  if (jobs > stale)
+    jobs = stale;
+
+  pthread_mutex_init(&pool.lock, NULL);
+
+  /* Standard input is not shared between threads, but there is no
+   * point starting threads for a single source either. */
+  if (jobs <= 1) {
+    parse_worker(&pool);
+  } else {
+    threads = calloc(jobs, sizeof *threads);
+    if (threads == NULL) {
+      pthread_mutex_destroy(&pool.lock);
+      return errno;
+    }
+
+    for (started = 0; started < jobs; started++)
+      if (pthread_create(threads + started, NULL, parse_worker, &pool) != 0)
+        break;
+
+    /* Work on the queue in this thread too in case no threads started */
+    parse_worker(&pool);
+
+    for (i = 0; i < started; i++)
+      pthread_join(threads[i], NULL);
+    free(threads);
+  }
+  pthread_mutex_destroy(&pool.lock);
+
+  for (i = 0; i < num_sources; i++) {
+    if (!sources[i].stale)
+      continue;
+    if (sources[i].rc != 0 && rc == 0)
+      rc = sources[i].rc;
+    if (sources[i].rc == 0)
+      sources[i].stale = false;
+    if (sources[i].uncached) {
+      int cache_rc = asm_cache_store(cache_dir, sources[i].cache_key,
+                                     ctx->strtab, sources[i].ast);
+      if (cache_rc != 0)
+        fprintf(stderr, "%s: not cached: %s\n",
+                sources[i].public.path, strerror(cache_rc));
+      sources[i].uncached = false;
+    }
+    if (sources[i].rc == 0 && ctx->verbose) {
+      fprintf(stderr, "Abstract Syntax Tree (%s):\n", sources[i].public.path);
+      ast_plot_tree(stderr, ctx->strtab, sources[i].ast);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return rc;
+}
+
+void asm_source_release(struct asm_source *source) {
+  if (source->ast)
+    ast_free_tree(source->ast);
+  srcbuf_close(&source->text);
+  source->ast = NULL;
+  source->stale = true;
+}
+
+struct export_walk {
+  struct expansion *x;
+  struct bobj *obj;
+};
+
+/* Add the labels at the top level of a relocatable object to it. Only
+ * those named by EXPORT are visible to other objects. */
+static void export_symbol(struct symbol *sym, void *arg) {
+  struct export_walk *walk = (struct export_walk *) arg;
+  bool global = false;
+  size_t i;
+
+  for (i = 0; i < walk->x->n_exports; i++)
+    if (walk->x->exports[i]->v.str == sym->ref.name)
+      global = true;
+
+  if (sym->subtype == SYM_ST_WORD || sym->subtype == SYM_ST_REL)
+    bobj_add_symbol(walk->obj, SSTR(walk->x->ctx, sym->ref.name), sym->subtype == SYM_ST_REL,
+                    global, sym->val.numeric);
+}
+
+/* Check that every exported name is defined in the program scope. */
+static int check_exports(struct expansion *x) {
+  struct symbol *sym;
+  size_t i;
+  int rc = 0;
+
+  for (i = 0; i < x->n_exports; i++) {
+    sym = sym_lookup(x->context, SYM_T_LABEL, x->exports[i]->v.str,
+                     SYM_LU_SCOPE_LOCAL);
+    if (sym == NULL ||
+        (sym->subtype != SYM_ST_WORD && sym->subtype != SYM_ST_REL)) {
+      fprintf(stderr, "exported symbol %s is not defined\n",
+              SSTR(x->ctx, x->exports[i]->v.str));
+      rc = EHANDLED;
+    }
+  }
+  return rc;
+}
+
+/* Whether a statement list, or a macro or block in it, sets the origin. */
+static bool sets_origin(struct ast_node *list) {
+  size_t i;
+
+  for (i = 0; i < list->v.list.length; i++) {
+    struct ast_node *stmt = list->v.list.nodes + i;
+
+    if (stmt->t == AST_ORG ||
+        (stmt->t == AST_MACRO && sets_origin(stmt->v.tuple[1]->v.tuple[1])) ||
+        (stmt->t == AST_REPT && sets_origin(stmt->v.tuple[1])) ||
+        (stmt->t == AST_IRP && sets_origin(stmt->v.tuple[1]->v.tuple[1])) ||
+        (stmt->t == AST_IF && (sets_origin(stmt->v.tuple[1]->v.tuple[0]) ||
+                               sets_origin(stmt->v.tuple[1]->v.tuple[1]))))
+      return true;
+  }
+  return false;
+}
+
+/* Expand the parsed sources into one program, laying out and encoding
+ * each record as it is expanded, then resolve the remaining symbols and
+ * patch the words that depend on them. Returns EAGAIN if the program
+ * must be assembled again with 'deferred' set. */
+static int assemble_program(struct asm_ctx *ctx, struct expansion *x,
+                            struct asm_source *sources, int num_sources,
+                            const bool *omit, const struct outline_plan *outline,
+                            struct section *section, struct bobj *obj,
+                            addr_t memory, bool trace, bool deferred,
+                            double *ms, struct timespec *t) {
+  struct sym_context *externs = NULL;
+  bool absolute = false;
+  int rc = 0;
+  int i;
+
+  rc = expansion_init(x, ctx);
+  if (rc != 0)
+    return rc;
+  x->emit.section = section;
+  x->emit.image = section;
+  x->emit.memory = memory;
+  x->emit.obj = obj;
+  x->emit.omit = omit;
+  x->emit.deferred = deferred;
+
+  if (outline && outline->n > 0) {
+    x->emit.outline = outline;
+    x->emit.n_copies = outline->n;
+    x->emit.copies = calloc(outline->n, sizeof *x->emit.copies);
+    x->emit.outline_body = calloc(outline->n, sizeof *x->emit.outline_body);
+    if (x->emit.copies == NULL || x->emit.outline_body == NULL)
+      return ENOMEM;
+    for (i = 0; i < outline->n; i++) {
+      x->emit.copies[i] = calloc(outline->outlines[i].length, sizeof **x->emit.copies);
+      if (x->emit.copies[i] == NULL)
+        return ENOMEM;
+    }
+  }
+
+  /* A relocatable object is laid out from zero unless it sets its origin */
+  if (obj) {
+    externs = x->context;
+    for (i = 0; !trace && i < num_sources; i++)
+      if (sets_origin(sources[i].ast))
+        obj->absolute = true;
+    x->emit.relative = !obj->absolute;
+  }
+
+  for (i = 0; rc == 0 && i < num_sources; i++)
+    rc = parse_stmts(x, x->context, sources[i].ast, sources + i, NULL);
+  ms[ASM_PHASE_EXPAND] += asm_lap(t);
+
+  /* Only an origin in a macro that is never applied can spoil the guess */
+  for (i = 0; obj && !trace && i < x->abstract.ptr; i++)
+    if (x->abstract.records[i].flags & HAS_ORG)
+      absolute = true;
+  if (rc == 0 && !deferred && (x->emit.stale || (obj && absolute != obj->absolute)))
+    return EAGAIN;
+  if (obj) {
+    obj->absolute = absolute;
+    x->emit.relative = !absolute;
+  }
+
+  if (rc == 0)
+    rc = emit_finish(x, externs, ms, t);
+  if (rc == 0 && obj)
+    rc = check_exports(x);
+  if (rc == 0 && obj)
+    sym_iterate(x->context, SYM_T_LABEL, export_symbol,
+                &(struct export_walk) { x, obj });
+
+  return rc;
+}
+
+/* Assemble the program from the parsed sources into 'section', leaving
+ * out the records marked in 'omit' and calling a shared copy of each
+ * sequence in 'outline' from its sites. If 'obj' is given, the program is
+ * assembled as a relocatable object. With 'trace', it is treated as
+ * relocatable even if it sets its origin, so that there is a relocation
+ * for every word that holds an address.
+ *
+ * Words are encoded as soon as their operands are known. If a symbol is
+ * defined again or shadowed after its value has been used, the program
+ * is assembled again with every word encoded after layout instead. */
+static int assemble_sources(struct asm_ctx *ctx, struct expansion *x,
+                            struct asm_source *sources, int num_sources,
+                            const bool *omit, const struct outline_plan *outline,
+                            struct section *section, struct bobj *obj,
+                            addr_t memory, bool trace, double *ms, struct timespec *t) {
+  int rc;
+
+  rc = assemble_program(ctx, x, sources, num_sources, omit, outline, section, obj, memory,
+                        trace, false, ms, t);
+  if (rc == EAGAIN) {
+    if (ctx->verbose)
+      fprintf(stderr, "symbol changed after use, assembling again\n");
+    expansion_free(x);
+    if (obj)
+      bobj_free(obj);
+    else
+      section_free(section);
+    memset(section, '\0', sizeof *section);
+    rc = assemble_program(ctx, x, sources, num_sources, omit, outline, section, obj, memory,
+                          trace, true, ms, t);
+  }
+  return rc;
+}
+
+/* A first assembly of the program, from which the optimizers choose the
+ * records to leave out, kept to check the final one by. */
+struct trial {
+  struct section section;
+  int *record_at;     /* record assembled into each word, or -1 */
+  unsigned char *word_flags;
+  bool *omit;
+  struct outline_plan outline;
+  size_t n_records;
+  size_t pool;        /* first record allocated to temporaries */
+  size_t n_peephole;
+  size_t n_gc;
+  size_t n_outlined;
+  size_t n_omitted;
+};
+
+static void trial_free(struct trial *trial) {
+  section_free(&trial->section);
+  free(trial->record_at);
+  free(trial->word_flags);
+  free(trial->omit);
+  asm_outline_free(trial->outline.outlines, trial->outline.n);
+  free(trial->outline.refs);
+  memset(trial, '\0', sizeof *trial);
+}
+
+/* The addresses from which --gc-sections follows the program: line 1,
+ * where the machine starts, line 0 so that line 1 stays put, '_start'
+ * and any label exported to other objects. */
+static int gc_roots(struct expansion *x, addr_t **roots) {
+  struct symbol *sym;
+  int n = 0;
+  size_t i;
+
+  *roots = calloc(x->n_exports + 3, sizeof **roots);
+  if (*roots == NULL)
+    return -1;
+  (*roots)[n++] = 0;
+  (*roots)[n++] = 1;
+  sym = sym_lookup(x->context, SYM_T_LABEL, SSTRP(x->ctx, "_start"), SYM_LU_SCOPE_LOCAL);
+  if (sym && (sym->subtype == SYM_ST_WORD || sym->subtype == SYM_ST_REL))
+    (*roots)[n++] = sym->val.numeric;
+  for (i = 0; i < x->n_exports; i++) {
+    sym = sym_lookup(x->context, SYM_T_LABEL, x->exports[i]->v.str, SYM_LU_SCOPE_LOCAL);
+    if (sym && (sym->subtype == SYM_ST_WORD || sym->subtype == SYM_ST_REL))
+      (*roots)[n++] = sym->val.numeric;
+  }
+  return n;
+}
+
+/* Choose sequences to outline and note where each record falls */
+static int trial_outline(struct trial *trial, struct expansion *x, struct section *section) {
+  const struct asm_outline *ol;
+  const struct asm_abstract *a;
+  size_t i, k;
+  int o;
+
+  trial->outline.n = asm_outline(section, x->abstract.records, trial->pool,
+                                 trial->pool + x->emit.n_values, trial->word_flags,
+                                 trial->omit, &trial->outline.outlines);
+  if (trial->outline.n == -1) {
+    trial->outline.n = 0;
+    return ENOMEM;
+  }
+  trial->outline.refs = calloc(trial->n_records + 1, sizeof *trial->outline.refs);
+  if (trial->outline.refs == NULL)
+    return errno;
+  for (i = 0; i <= trial->n_records; i++)
+    trial->outline.refs[i].outline = -1;
+
+  for (o = 0; o < trial->outline.n; o++) {
+    ol = trial->outline.outlines + o;
+    for (i = 0; i < ol->n_sites; i++)
+      for (k = 0; k < ol->length; k++)
+        trial->outline.refs[ol->sites[i] + k] = (struct outline_ref) { o, i };
+    trial->n_outlined += ol->n_sites * (ol->length - OUTLINE_CALL);
+    if (x->ctx->verbose) {
+      a = x->abstract.records + ol->sites[0];
+      fprintf(stderr, "%s:%d: outlined %zu instructions from %zu sites, "
+              "saving %ld lines for %d cycles a call\n",
+              a->source->path, a->line, ol->length, ol->n_sites,
+              asm_outline_saving(ol), OUTLINE_CYCLES);
+    }
+  }
+  return 0;
+}
+
+static int trial_plan(struct asm_ctx *ctx, struct trial *trial,
+                      struct asm_source *sources, int num_sources,
+                      const struct asm_options *opts) {
+  double ms[ASM_PHASE_MAX] = { 0 };
+  struct bobj obj = { 0 };
+  struct section *section = &obj.section;
+  struct expansion x;
+  struct timespec t;
+  addr_t *roots;
+  int n_roots;
+  addr_t pos;
+  size_t i;
+  int rc;
+
+  /* A program may only fit once outlined, so it is tried in the largest store */
+  memset(trial, '\0', sizeof *trial);
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  rc = assemble_sources(ctx, &x, sources, num_sources, NULL, NULL, section, &obj,
+                        opts->outline ? MAX_MEMORY_SIZE : opts->memory, true, ms, &t);
+
+  if (rc == 0) {
+    trial->n_records = x.abstract.ptr;
+    trial->pool = x.emit.pool;
+    trial->omit = calloc(trial->n_records + 1, sizeof *trial->omit);
+    trial->record_at = calloc(section->length + 1, sizeof *trial->record_at);
+    trial->word_flags = calloc(section->length + 1, sizeof *trial->word_flags);
+    if (trial->omit == NULL || trial->record_at == NULL || trial->word_flags == NULL)
+      rc = errno;
+  }
+
+  if (rc == 0) {
+    for (pos = 0; pos < section->length; pos++)
+      trial->record_at[pos] = section_debug(section, section->org + pos) ?
+                              section_debug(section, section->org + pos) -
+                              x.abstract.records : -1;
+    for (i = 0; i < obj.n_relocs; i++)
+      trial->word_flags[obj.relocs[i].offset] |=
+        obj.relocs[i].target ? PEEPHOLE_BARRIER : PEEPHOLE_ADDRESS;
+    if (opts->peephole) {
+      trial->n_peephole = asm_peephole(section, x.abstract.records, trial->n_records,
+                                       trial->word_flags, trial->omit);
+      if (ctx->verbose)
+        fprintf(stderr, "peephole: %zu instructions removed\n", trial->n_peephole);
+    }
+    if (opts->gc) {
+      n_roots = gc_roots(&x, &roots);
+      if (n_roots == -1) {
+        rc = errno;
+      } else {
+        trial->n_gc = asm_gc(section, x.abstract.records, trial->word_flags,
+                             roots, n_roots, trial->omit);
+        free(roots);
+      }
+      if (ctx->verbose)
+        fprintf(stderr, "gc: %zu words removed\n", trial->n_gc);
+    }
+    if (rc == 0 && opts->outline)
+      rc = trial_outline(trial, &x, section);
+    trial->n_omitted = trial->n_peephole + trial->n_gc + trial->n_outlined;
+
+    /* Keep the words but not the debug pointers into the expansion */
+    trial->section = *section;
+    memset(section, '\0', sizeof *section);
+    for (pos = 0; pos < trial->section.length; pos++)
+      if (section_used(&trial->section, trial->section.org + pos))
+        section_set_debug(&trial->section, trial->section.org + pos, NULL);
+  }
+
+  bobj_free(&obj);
+  expansion_free(&x);
+  if (rc != 0)
+    trial_free(trial);
+  return rc;
+}
+
+/* Whether an operand of the final program names the same word as it
+ * did in the trial. */
+static bool operand_follows(const struct trial *trial, const addr_t *where,
+                            struct arch_decoded was, struct arch_decoded now) {
+  const struct section *before = &trial->section;
+  int r;
+
+  if (was.operand >= before->org && was.operand - before->org < before->length &&
+      trial->record_at[was.operand - before->org] != -1) {
+    r = trial->record_at[was.operand - before->org];
+    /* Temporaries are allocated again for the final program */
+    return r >= trial->pool ||
+           (!trial->omit[r] && now.operand == where[r] &&
+            (trial->outline.refs == NULL || trial->outline.refs[r].outline == -1));
+  }
+  return now.operand == was.operand;
+}
+
+/* Check that every instruction still refers to the same word as in the
+ * trial, and that the shared copy of each outlined sequence refers to
+ * the same words as its first site did. This fails if an operand is a
+ * literal address of a word that has moved, or an expression whose
+ * meaning depends on the layout. */
+static bool trial_check(const struct trial *trial,
+                        const struct section *section,
+                        const struct expansion *x) {
+  const struct section *before = &trial->section;
+  const struct asm_outline *ol;
+  addr_t *where, *at;
+  addr_t pos;
+  bool ok = true;
+  size_t k;
+  int r, o;
+
+  where = calloc(x->abstract.ptr + 1, sizeof *where);
+  at = calloc(trial->n_records + 1, sizeof *at);
+  if (where == NULL || at == NULL) {
+    free(where);
+    free(at);
+    return false;
+  }
+  for (pos = 0; pos < section->length; pos++)
+    if (section_debug(section, section->org + pos))
+      where[section_debug(section, section->org + pos) - x->abstract.records] =
+        section->org + pos;
+  for (pos = 0; pos < before->length; pos++)
+    if (trial->record_at[pos] != -1)
+      at[trial->record_at[pos]] = before->org + pos;
+
+  for (pos = 0; ok && pos < before->length; pos++) {
+    struct arch_decoded was = arch_decode(section_get(before, before->org + pos));
+    const struct mnemonic *m;
+    const struct asm_abstract *a;
+
+    r = trial->record_at[pos];
+    if (r == -1 || trial->omit[r] || trial->word_flags[pos] & PEEPHOLE_BARRIER ||
+        (trial->outline.refs && trial->outline.refs[r].outline != -1))
+      continue;
+    a = x->abstract.records + r;
+    m = a->mnemonic;
+    if (m == NULL || m->type != M_INSTR || m->ins->operands == 0)
+      continue;
+
+    ok = operand_follows(trial, where, was, arch_decode(section_get(section, where[r])));
+    if (!ok)
+      fprintf(stderr, "%s:%d: operand does not follow layout, not optimizing\n",
+              a->source->path, a->line);
+  }
+
+  for (o = 0; ok && o < trial->outline.n; o++) {
+    ol = trial->outline.outlines + o;
+    for (k = 0; ok && k < ol->length; k++) {
+      r = ol->sites[0] + k;
+      ok = operand_follows(trial, where, arch_decode(section_get(before, at[r])),
+                           arch_decode(section_get(section,
+                                                   where[x->emit.outline_body[o] + k])));
+      if (!ok)
+        fprintf(stderr, "%s:%d: outlined operand does not follow layout, not optimizing\n",
+                x->abstract.records[r].source->path, x->abstract.records[r].line);
+    }
+  }
+
+  free(where);
+  free(at);
+  return ok;
+}
+
+
+int asm_source_init(struct asm_ctx *ctx, struct asm_source *source, const char *path) {
+  char *str;
+
+  memset(source, '\0', sizeof *source);
+  source->public.strtab = ctx->strtab;
+  source->stale = true;
+  source->public.path = strdup(path);
+  str = strdup(path);
+  if (source->public.path == NULL || str == NULL) {
+    free(str);
+    asm_source_free(source);
+    return ENOMEM;
+  }
+  source->public.leaf = strdup(basename(str));
+  free(str);
+  if (source->public.leaf == NULL) {
+    asm_source_free(source);
+    return ENOMEM;
+  }
+  return 0;
+}
+
+void asm_source_free(struct asm_source *source) {
+  asm_source_release(source);
+  free(source->public.path);
+  free(source->public.leaf);
+  memset(source, '\0', sizeof *source);
+}
+
+/* Note where each named section was placed, for the map. */
+static int note_sections(struct expansion *x, struct asm_program *program, addr_t memory) {
+  int i;
+
+  program->store = store_size(memory, program->section->org + program->section->length);
+  if (x->emit.n_sections == 0)
+    return 0;
+  program->sections = calloc(x->emit.n_sections, sizeof *program->sections);
+  if (program->sections == NULL)
+    return errno;
+  for (i = 0; i < x->emit.n_sections; i++)
+    program->sections[i] = (struct asm_placed) {
+      .name = x->emit.sections[i].name,
+      .base = x->emit.sections[i].base,
+      .length = x->emit.sections[i].section.length,
+    };
+  program->n_sections = x->emit.n_sections;
+  return 0;
+}
+
+/* Parse the stale sources and assemble them all into *program. */
+static int assemble(struct asm_ctx *ctx, struct asm_source *sources, int num_sources,
+                    const struct asm_options *opts, struct asm_program *program) {
+  struct trial trial = { 0 };
+  struct bobj *obj = NULL;
+  struct expansion *x;
+  double *ms = program->ms;
+  struct timespec t;
+  int rc = 0;
+
+  memset(program, '\0', sizeof *program);
+  program->section = &program->image;
+  x = calloc(1, sizeof *x);
+  if (x == NULL)
+    return errno;
+  program->expansion = x;
+
+  /* Lex and parse the sources concurrently, then expand them in order
+   * into one symbol space for a single layout and encoding pass. */
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  rc = parse_sources(ctx, sources, num_sources, opts->jobs, opts->cache_dir);
+  ms[ASM_PHASE_PARSE] = asm_lap(&t);
+
+  if (rc == 0 && (opts->peephole || opts->gc || opts->outline)) {
+    rc = trial_plan(ctx, &trial, sources, num_sources, opts);
+    ms[ASM_PHASE_OPTIMIZE] = asm_lap(&t);
+  }
+
+  if (opts->relocatable) {
+    obj = &program->obj;
+    program->section = &obj->section;
+  }
+
+  rc = rc ? rc : assemble_sources(ctx, x, sources, num_sources,
+                                  trial.n_omitted ? trial.omit : NULL,
+                                  &trial.outline, program->section, obj,
+                                  opts->memory, false, ms, &t);
+
+  /* Fall back to the program as written if the optimizer was wrong */
+  if (rc == 0 && trial.n_omitted && !trial_check(&trial, program->section, x)) {
+    section_free(program->section);
+    memset(program->section, '\0', sizeof *program->section);
+    bobj_free(&program->obj);
+    expansion_free(x);
+    rc = assemble_sources(ctx, x, sources, num_sources, NULL, NULL, program->section,
+                          obj, opts->memory, false, ms, &t);
+  }
+
+  if (rc == 0)
+    rc = note_sections(x, program, opts->memory);
+
+  trial_free(&trial);
+  return rc;
+}
+
+int asm_build(struct asm_ctx *ctx, struct asm_source *sources, int num_sources,
+              const struct asm_options *opts, struct asm_program *program) {
+  int i;
+
+  for (i = 0; i < num_sources; i++)
+    if (sources[i].stale)
+      asm_source_release(sources + i);
+  return assemble(ctx, sources, num_sources, opts, program);
+}
+
+void asm_program_free(struct asm_program *program) {
+  section_free(&program->image);
+  bobj_free(&program->obj);
+  if (program->expansion) {
+    expansion_free(program->expansion);
+    free(program->expansion);
+  }
+  free(program->sections);
+  memset(program, '\0', sizeof *program);
+}
+
+/* Keep the words but not the debug pointers into the expansion */
+static void take_image(struct section *from, struct section *image) {
+  addr_t a;
+
+  *image = *from;
+  memset(from, '\0', sizeof *from);
+  for (a = image->org; a < image->org + image->length; a++)
+    if (section_used(image, a))
+      section_set_debug(image, a, NULL);
+}
+
+int asm_assemble(struct asm_ctx *ctx, const char *name,
+                 const char *text, size_t len,
+                 const struct asm_options *opts, struct section *image) {
+  struct asm_options single = *opts;
+  struct asm_program program;
+  struct asm_source source;
+  int rc;
+
+  memset(image, '\0', sizeof *image);
+  if (opts->relocatable)
+    return EINVAL;
+
+  rc = asm_source_init(ctx, &source, name);
+  if (rc != 0)
+    return rc;
+  rc = srcbuf_copy(&source.text, text, len);
+  if (rc != 0) {
+    asm_source_free(&source);
+    return rc;
+  }
+
+  /* One source is parsed in this thread */
+  single.jobs = 1;
+  rc = assemble(ctx, &source, 1, &single, &program);
+
+  if (rc == 0)
+    take_image(&program.image, image);
+
+  asm_program_free(&program);
+  asm_source_free(&source);
+  return rc;
+}
+
+struct asm_emitter {
+  struct expansion x;
+  struct section image;
+  struct source_public source;
+  struct asm_abstract pending;   /* label or origin for the next word */
+  int line;                      /* calls so far, for reporting errors */
+  int n_labels;
+  int rc;                        /* first error, after which calls do nothing */
+};
+
+static struct ast_node *mk_node(struct ast_node contents) {
+  struct ast_node *node = malloc(sizeof *node);
+
+  if (node == NULL)
+    return NULL;
+  *node = contents;
+  node->heap = true;
+  return node;
+}
+
+/* An operand list of one expression, or NULL if out of memory */
+static struct ast_node *mk_operands(struct asm_operand opr) {
+  struct ast_node *expr, *sym, *node;
+
+  expr = mk_node((struct ast_node) { .t = AST_NUMBER, .v.number = opr.addend });
+  if (expr && opr.symbolic) {
+    sym = mk_node((struct ast_node) { .t = AST_SYMBOL, .v.nameref = {
+      .type = SYM_T_LABEL, .name = opr.label
+    } });
+    node = sym ? mk_node((struct ast_node) { .t = AST_PLUS, .v.tuple = { sym, expr } }) : NULL;
+    if (node == NULL) {
+      free(sym);
+      free(expr);
+    }
+    expr = node;
+  }
+  if (expr && opr.literal) {
+    node = mk_node((struct ast_node) { .t = AST_LITERAL, .v.tuple = { expr, AST_NIL_NODE } });
+    if (node == NULL)
+      ast_free_tree(expr);
+    expr = node;
+  }
+  if (expr == NULL)
+    return NULL;
+  node = mk_node((struct ast_node) { .t = AST_TUPLE, .v.tuple = { expr, AST_NIL_NODE } });
+  if (node == NULL)
+    ast_free_tree(expr);
+  return node;
+}
+
+/* The record for the next call, with the label or origin waiting for it */
+static struct asm_abstract *emit_next(struct asm_emitter *em) {
+  struct asm_abstract *a = &em->pending;
+
+  if (!a->flags)
+    *a = (struct asm_abstract) { .context = em->x.context, .source = &em->source };
+  a->line = ++em->line;
+  return a;
+}
+
+static int emit_flush(struct asm_emitter *em) {
+  int rc = 0;
+
+  if (em->pending.flags)
+    rc = emit_record(&em->x, &em->pending);
+  em->pending.flags = 0;
+  return rc;
+}
+
+struct asm_emitter *asm_emit_begin(struct asm_ctx *ctx, const char *name, addr_t memory) {
+  struct asm_emitter *em = calloc(1, sizeof *em);
+
+  if (em == NULL)
+    return NULL;
+  em->source = (struct source_public) {
+    .path = strdup(name), .leaf = strdup(name), .strtab = ctx->strtab
+  };
+  if (em->source.path == NULL || em->source.leaf == NULL) {
+    free(em->source.path);
+    free(em->source.leaf);
+    free(em);
+    return NULL;
+  }
+
+  /* Every word is encoded at the end, once every label is placed */
+  if (expansion_init(&em->x, ctx) != 0) {
+    expansion_free(&em->x);
+    free(em->source.path);
+    free(em->source.leaf);
+    free(em);
+    return NULL;
+  }
+  em->x.emit.section = &em->image;
+  em->x.emit.image = &em->image;
+  em->x.emit.memory = memory;
+  em->x.emit.deferred = true;
+  return em;
+}
+
+str_idx_t asm_emit_label(struct asm_emitter *em, const char *name) {
+  char made[32];
+
+  if (name == NULL) {
+    snprintf(made, sizeof made, "%%label%d", em->n_labels++);
+    name = made;
+  }
+  return SSTRP(em->x.ctx, name);
+}
+
+/* Labels are only defined once the program is encoded, so a placed label
+ * is marked in the program scope until then. */
+int asm_emit_place(struct asm_emitter *em, str_idx_t label) {
+  struct asm_abstract *a;
+
+  if (em->rc != 0)
+    return em->rc;
+  a = emit_next(em);
+  if (sym_lookup(em->x.context, SYM_T_LABEL, label, SYM_LU_SCOPE_LOCAL)) {
+    fprintf(stderr, "%s:%d: label %s placed again\n",
+            em->source.path, a->line, SSTR(em->x.ctx, label));
+    return em->rc = EHANDLED;
+  }
+  if (a->flags & (HAS_ORG | HAS_LABEL)) {
+    em->rc = emit_flush(em);
+    if (em->rc != 0)
+      return em->rc;
+    a = emit_next(em);
+  }
+  sym_add(em->x.context, SYM_T_LABEL, label, SYM_ST_UNDEF, SYM_VAL_NUL);
+  a->flags |= HAS_LABEL;
+  a->label = (struct symref) { SYM_T_LABEL, label };
+  return 0;
+}
+
+int asm_emit_org(struct asm_emitter *em, addr_t org) {
+  struct asm_abstract *a;
+
+  if (em->rc != 0)
+    return em->rc;
+  a = emit_next(em);
+  if (a->flags & (HAS_ORG | HAS_LABEL)) {
+    em->rc = emit_flush(em);
+    if (em->rc != 0)
+      return em->rc;
+    a = emit_next(em);
+  }
+  a->flags |= HAS_ORG;
+  a->org = org;
+  return 0;
+}
+
+int asm_emit_instr(struct asm_emitter *em, const char *mnemonic, struct asm_operand opr) {
+  const struct mnemonic *m = arch_find_instr(mnemonic);
+  struct asm_abstract *a;
+
+  if (em->rc != 0)
+    return em->rc;
+  a = emit_next(em);
+  if (m == NULL) {
+    fprintf(stderr, "%s:%d: no such mnemonic %s\n", em->source.path, a->line, mnemonic);
+    return em->rc = EHANDLED;
+  }
+
+  a->flags |= HAS_INSTR;
+  a->instr = (struct symref) { SYM_T_MNEMONIC, SSTRP(em->x.ctx, mnemonic) };
+  a->mnemonic = m;
+  a->operands = AST_NIL_NODE;
+  a->n_operands = 0;
+
+  if (m->type != M_INSTR || m->ins->operands > 0) {
+    a->operands = mk_operands(opr);
+    if (a->operands == NULL ||
+        ptr_push((void ***) &em->x.bodies, &em->x.n_bodies, &em->x.bodies_sz, a->operands) != 0) {
+      if (a->operands)
+        ast_free_tree(a->operands);
+      return em->rc = ENOMEM;
+    }
+    a->n_operands = 1;
+  }
+  return em->rc = emit_flush(em);
+}
+
+int asm_emit_word(struct asm_emitter *em, word_t word) {
+  return asm_emit_instr(em, "NUM", ASM_NUM(word));
+}
+
+int asm_emit_end(struct asm_emitter *em, struct section *image) {
+  double ms[ASM_PHASE_MAX] = { 0 };
+  struct timespec t;
+  int rc;
+
+  memset(image, '\0', sizeof *image);
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  rc = em->rc;
+  if (rc == 0)
+    rc = emit_flush(em);
+  if (rc == 0)
+    rc = emit_finish(&em->x, NULL, ms, &t);
+  if (rc == 0)
+    take_image(&em->image, image);
+
+  section_free(&em->image);
+  expansion_free(&em->x);
+  free(em->source.path);
+  free(em->source.leaf);
+  free(em);
+  return rc;
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Assembly of whole programs from source. */
+
+#ifndef LIBBABY_ASM_BUILD_H
+#define LIBBABY_ASM_BUILD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "arch.h"
+#include "section.h"
+#include "srcbuf.h"
+#include "strtab.h"
+#include "bobj.h"
+#include "asm.h"
+
+struct ast_node;
+struct expansion;
+struct asm_emitter;
+
+/* Constants */
+
+#define MAX_MEMORY_SIZE 0x2000
+
+enum asm_phase {
+  ASM_PHASE_PARSE,
+  ASM_PHASE_OPTIMIZE,
+  ASM_PHASE_EXPAND,
+  ASM_PHASE_RESOLVE,
+  ASM_PHASE_ENCODE,
+  ASM_PHASE_OUTPUT,
+  ASM_PHASE_MAX
+};
+
+extern const char *asm_phase_names[ASM_PHASE_MAX];
+
+/* Types */
+
+/* A source and what is derived from its text, which is kept from one
+ * build to the next until the source is marked stale. */
+struct asm_source {
+  struct source_public public;
+  struct srcbuf text;
+  struct ast_node *ast;
+  uint64_t cache_key;
+  bool uncached;
+  bool stale;
+  int rc;
+};
+
+struct asm_options {
+  const char *cache_dir;     /* cache parsed sources here, or NULL */
+  long jobs;                 /* threads to parse sources with */
+  addr_t memory;             /* store size to place sections in */
+  bool peephole;
+  bool gc;
+  bool outline;
+  bool relocatable;
+};
+
+/* A named section as placed in the store */
+struct asm_placed {
+  str_idx_t name;
+  addr_t base;
+  addr_t length;
+};
+
+/* An operand of an emitted record: a number or, if 'symbolic', the
+ * address of 'label' plus the number. If 'literal', it is the address of
+ * a word in the literal pool holding that value instead. */
+struct asm_operand {
+  bool symbolic;
+  bool literal;
+  str_idx_t label;
+  num_t addend;
+};
+
+#define ASM_NUM(n) ((struct asm_operand) { .addend = (n) })
+#define ASM_REF(l, n) ((struct asm_operand) { .symbolic = true, .label = (l), .addend = (n) })
+#define ASM_LIT(n) ((struct asm_operand) { .literal = true, .addend = (n) })
+
+/* An assembled program. The debug pointers of 'section' lead to the
+ * records it was assembled from, whose sources are asm_sources. */
+struct asm_program {
+  struct section *section;   /* 'image', or the section of 'obj' */
+  struct section image;
+  struct bobj obj;
+  struct asm_placed *sections;
+  int n_sections;
+  addr_t store;              /* size of the store the sections are in */
+  double ms[ASM_PHASE_MAX];  /* milliseconds spent in each phase */
+  struct expansion *expansion;
+};
+
+/* Public functions */
+
+/* Set up a source to be read from 'path', or standard input if "-". */
+extern int asm_source_init(struct asm_ctx *ctx, struct asm_source *source, const char *path);
+
+/* Release everything derived from a source's text so that it is read
+ * and parsed again by the next build. */
+extern void asm_source_release(struct asm_source *source);
+extern void asm_source_free(struct asm_source *source);
+
+/* Assemble the sources into *program, parsing only those that are stale.
+ * The program is freed with asm_program_free(), even on failure. */
+extern int asm_build(struct asm_ctx *ctx, struct asm_source *sources, int num_sources,
+                     const struct asm_options *opts, struct asm_program *program);
+extern void asm_program_free(struct asm_program *program);
+
+/* Return milliseconds elapsed since *since and restart the clock. */
+extern double asm_lap(struct timespec *since);
+
+/* Assemble 'len' bytes of source text, reported as 'name', into *image,
+ * which is freed with section_free(). The image holds no debug pointers.
+ * Programs may be assembled concurrently in different contexts. */
+extern int asm_assemble(struct asm_ctx *ctx, const char *name,
+                        const char *text, size_t len,
+                        const struct asm_options *opts, struct section *image);
+
+/* Emitting a program record by record, as the assembler would expand it
+ * from source, for code generators that would otherwise write text for
+ * bas to parse. Records are laid out as they are emitted and encoded by
+ * asm_emit_end(), so labels may be used before they are placed. Errors
+ * are reported against 'name' and the number of the call, and once a call
+ * fails every later one returns its error without doing anything. */
+extern struct asm_emitter *asm_emit_begin(struct asm_ctx *ctx, const char *name,
+                                          addr_t memory);
+
+/* A label called 'name' or, if NULL, one that no source can name */
+extern str_idx_t asm_emit_label(struct asm_emitter *em, const char *name);
+
+/* Place a label, which is an error if it is already placed, or an origin
+ * at the next word */
+extern int asm_emit_place(struct asm_emitter *em, str_idx_t label);
+extern int asm_emit_org(struct asm_emitter *em, addr_t org);
+
+/* Emit an instruction or directive, which takes 'opr' if it has an operand */
+extern int asm_emit_instr(struct asm_emitter *em, const char *mnemonic,
+                          struct asm_operand opr);
+extern int asm_emit_word(struct asm_emitter *em, word_t word);
+
+/* Encode the program into *image, as for asm_assemble(), unless a call
+ * has failed, and free the emitter, whether or not it succeeds. */
+extern int asm_emit_end(struct asm_emitter *em, struct section *image);
+
+#endif
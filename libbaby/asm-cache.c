@@ -0,0 +1,457 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Cache of parsed assembly sources.
+ *
+ * Each cache file holds the AST for one source as a flat array of fixed
+ * size nodes that refer to each other by index, followed by the strings
+ * they name. The file is mapped and converted back into a heap allocated
+ * AST without any parsing. */
+
+#include <assert.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <search.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "arch.h"
+#include "asm.h"
+#include "asm-ast.h"
+#include "asm-cache.h"
+
+#define CACHE_MAGIC "BABYAC8"
+#define CACHE_SUFFIX ".bac"
+#define CACHE_NIL -1
+
+struct cache_header {
+  char magic[8];
+  uint64_t key;
+  uint32_t n_nodes;
+  uint32_t strings_size;
+};
+
+struct cache_pos {
+  int32_t line;
+  int32_t col;
+  int32_t offset;
+};
+
+struct cache_node {
+  uint16_t t;
+  uint16_t debug_present;
+  int32_t a;
+  int32_t b;
+  struct cache_pos start;
+  struct cache_pos end;
+};
+
+struct cache_writer {
+  struct strtab *strtab;
+  struct cache_node *nodes;
+  size_t n_nodes;
+  size_t nodes_sz;
+  char *strings;
+  size_t strings_size;
+  size_t strings_sz;
+  void *string_index;
+};
+
+struct cache_string {
+  str_idx_t idx;
+  int32_t offset;
+};
+
+uint64_t asm_cache_hash(const void *buf, size_t len) {
+  const unsigned char *ptr = (const unsigned char *) buf;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  /* FNV-1a */
+  for (i = 0; i < len; i++) {
+    hash ^= ptr[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static char *cache_path(const char *dir, uint64_t key) {
+  char *path;
+
+  if (asprintf(&path, "%s/%016llx" CACHE_SUFFIX, dir, (unsigned long long) key) == -1)
+    return NULL;
+  return path;
+}
+
+static int string_cmp(const void *a, const void *b) {
+  const struct cache_string *sa = (const struct cache_string *) a;
+  const struct cache_string *sb = (const struct cache_string *) b;
+  return sa->idx < sb->idx ? -1 : sa->idx > sb->idx;
+}
+
+static int32_t put_string(struct cache_writer *w, str_idx_t idx) {
+  struct cache_string key = { .idx = idx };
+  struct cache_string *entry;
+  struct cache_string **found;
+  const char *str;
+  size_t len;
+
+  found = tfind(&key, &w->string_index, string_cmp);
+  if (found)
+    return (*found)->offset;
+
+  str = strtab_get(w->strtab, idx);
+  len = strlen(str) + 1;
+  if (w->strings_size + len > w->strings_sz) {
+    w->strings_sz = (w->strings_sz == 0) ? 1024 : w->strings_sz << 1;
+    if (w->strings_sz < w->strings_size + len)
+      w->strings_sz = w->strings_size + len;
+    w->strings = realloc(w->strings, w->strings_sz);
+    if (w->strings == NULL) {
+      perror("allocating cache strings");
+      exit(1);
+    }
+  }
+
+  entry = malloc(sizeof *entry);
+  if (entry == NULL) {
+    perror("allocating cache string index");
+    exit(1);
+  }
+  entry->idx = idx;
+  entry->offset = w->strings_size;
+  tsearch(entry, &w->string_index, string_cmp);
+
+  memcpy(w->strings + w->strings_size, str, len);
+  w->strings_size += len;
+
+  return entry->offset;
+}
+
+static int32_t reserve_nodes(struct cache_writer *w, size_t n) {
+  int32_t first = w->n_nodes;
+
+  while (w->n_nodes + n > w->nodes_sz) {
+    w->nodes_sz = (w->nodes_sz == 0) ? 256 : w->nodes_sz << 1;
+    w->nodes = realloc(w->nodes, sizeof *w->nodes * w->nodes_sz);
+    if (w->nodes == NULL) {
+      perror("allocating cache nodes");
+      exit(1);
+    }
+  }
+  memset(w->nodes + first, '\0', sizeof *w->nodes * n);
+  w->n_nodes += n;
+
+  return first;
+}
+
+static int32_t emit_node(struct cache_writer *w, struct ast_node *node);
+
+/* Fill in a reserved slot. Slots are addressed by index because emitting
+ * children may move the node array. */
+static void fill_node(struct cache_writer *w, int32_t slot, struct ast_node *node) {
+  struct cache_node out = {
+    .t = node->t,
+    .debug_present = node->debug.present,
+    .start = { node->debug.loc.start.line, node->debug.loc.start.col, node->debug.loc.start.offset },
+    .end = { node->debug.loc.end.line, node->debug.loc.end.col, node->debug.loc.end.offset },
+  };
+  int32_t base;
+  int i;
+
+  switch (node->t) {
+  case AST_TUPLE:
+  case AST_INSTR:
+  case AST_MACRO:
+  case AST_MINUS:
+  case AST_PLUS:
+  case AST_EQU:
+  case AST_EXPORT:
+  case AST_TEMP:
+  case AST_LITERAL:
+  case AST_SECTION:
+  case AST_REPT:
+  case AST_IRP:
+  case AST_IF:
+    out.a = emit_node(w, node->v.tuple[0]);
+    out.b = emit_node(w, node->v.tuple[1]);
+    break;
+  case AST_ORG:
+  case AST_NUMBER:
+    out.a = node->v.number;
+    break;
+  case AST_NAME:
+    out.a = put_string(w, node->v.str);
+    break;
+  case AST_MNEMONIC:
+    out.a = put_string(w, node->v.mnemonic.name);
+    break;
+  case AST_LABEL:
+  case AST_SYMBOL:
+    out.a = node->v.nameref.type;
+    out.b = put_string(w, node->v.nameref.name);
+    break;
+  case AST_LIST:
+    base = reserve_nodes(w, node->v.list.length);
+    for (i = 0; i < node->v.list.length; i++)
+      fill_node(w, base + i, node->v.list.nodes + i);
+    out.a = base;
+    out.b = node->v.list.length;
+    break;
+  case AST_NIL:
+    break;
+  }
+
+  w->nodes[slot] = out;
+}
+
+static int32_t emit_node(struct cache_writer *w, struct ast_node *node) {
+  int32_t slot;
+
+  if (node->t == AST_NIL)
+    return CACHE_NIL;
+
+  slot = reserve_nodes(w, 1);
+  fill_node(w, slot, node);
+  return slot;
+}
+
+int asm_cache_store(const char *dir, uint64_t key, struct strtab *strtab, struct ast_node *root) {
+  struct cache_writer w = { .strtab = strtab };
+  struct cache_header header = { .magic = CACHE_MAGIC, .key = key };
+  char *path = NULL;
+  char *tmp = NULL;
+  FILE *file = NULL;
+  int fd;
+  int rc = 0;
+
+  emit_node(&w, root);
+  header.n_nodes = w.n_nodes;
+  header.strings_size = w.strings_size;
+
+  path = cache_path(dir, key);
+  if (path == NULL || asprintf(&tmp, "%s.XXXXXX", path) == -1) {
+    rc = ENOMEM;
+    tmp = NULL;
+    goto finish;
+  }
+
+  /* Write under a unique temporary name so readers never see a partial
+   * file and concurrent writers never share one */
+  fd = mkstemp(tmp);
+  if (fd == -1) {
+    rc = errno;
+    goto finish;
+  }
+  file = fdopen(fd, "wb");
+  if (file == NULL) {
+    rc = errno;
+    close(fd);
+    unlink(tmp);
+    goto finish;
+  }
+  if (fwrite(&header, sizeof header, 1, file) != 1 ||
+      fwrite(w.nodes, sizeof *w.nodes, w.n_nodes, file) != w.n_nodes ||
+      fwrite(w.strings, 1, w.strings_size, file) != w.strings_size)
+    rc = errno;
+  if (fclose(file) != 0 && rc == 0)
+    rc = errno;
+  if (rc == 0 && rename(tmp, path) == -1)
+    rc = errno;
+  if (rc != 0)
+    unlink(tmp);
+
+finish:
+  tdestroy(w.string_index, free);
+  free(w.nodes);
+  free(w.strings);
+  free(path);
+  free(tmp);
+  return rc;
+}
+
+struct cache_reader {
+  struct strtab *strtab;
+  const struct cache_node *nodes;
+  uint32_t n_nodes;
+  const char *strings;
+  uint32_t strings_size;
+};
+
+static bool valid_string(const struct cache_reader *r, int32_t offset) {
+  return offset >= 0 && offset < r->strings_size &&
+         memchr(r->strings + offset, '\0', r->strings_size - offset) != NULL;
+}
+
+static int load_node(const struct cache_reader *r, int32_t index, struct ast_node *node, int depth);
+
+static int load_child(const struct cache_reader *r, int32_t index, struct ast_node **child, int depth) {
+  int rc;
+
+  if (index == CACHE_NIL) {
+    *child = AST_NIL_NODE;
+    return 0;
+  }
+
+  *child = (struct ast_node *) calloc(1, sizeof **child);
+  if (*child == NULL)
+    return errno;
+  (*child)->heap = true;
+
+  rc = load_node(r, index, *child, depth);
+  if (rc != 0) {
+    free(*child);
+    *child = AST_NIL_NODE;
+  }
+  return rc;
+}
+
+static int load_node(const struct cache_reader *r, int32_t index, struct ast_node *node, int depth) {
+  const struct cache_node *in;
+  int rc = 0;
+  int i = 0;
+
+  if (index < 0 || index >= r->n_nodes || depth > r->n_nodes)
+    return EINVAL;
+  in = r->nodes + index;
+
+  node->t = in->t;
+  node->debug.present = in->debug_present;
+  node->debug.loc.start = (src_pos_t) { in->start.line, in->start.col, in->start.offset };
+  node->debug.loc.end = (src_pos_t) { in->end.line, in->end.col, in->end.offset };
+
+  switch (node->t) {
+  case AST_TUPLE:
+  case AST_INSTR:
+  case AST_MACRO:
+  case AST_MINUS:
+  case AST_PLUS:
+  case AST_EQU:
+  case AST_EXPORT:
+  case AST_TEMP:
+  case AST_LITERAL:
+  case AST_SECTION:
+  case AST_REPT:
+  case AST_IRP:
+  case AST_IF:
+    node->v.tuple[0] = node->v.tuple[1] = AST_NIL_NODE;
+    rc = load_child(r, in->a, &node->v.tuple[0], depth + 1);
+    if (rc == 0)
+      rc = load_child(r, in->b, &node->v.tuple[1], depth + 1);
+    break;
+  case AST_ORG:
+  case AST_NUMBER:
+    node->v.number = in->a;
+    break;
+  case AST_NAME:
+    if (!valid_string(r, in->a))
+      return EINVAL;
+    node->v.str = strtab_put(r->strtab, r->strings + in->a);
+    break;
+  case AST_MNEMONIC:
+    if (!valid_string(r, in->a))
+      return EINVAL;
+    node->v.mnemonic.name = strtab_put(r->strtab, r->strings + in->a);
+    node->v.mnemonic.builtin = arch_find_instr(r->strings + in->a);
+    break;
+  case AST_LABEL:
+  case AST_SYMBOL:
+    if (!valid_string(r, in->b) || in->a < 0 || in->a >= SYM_T_MAX)
+      return EINVAL;
+    node->v.nameref.type = in->a;
+    node->v.nameref.name = strtab_put(r->strtab, r->strings + in->b);
+    break;
+  case AST_LIST:
+    if (in->a < 0 || in->b < 0 || in->a + in->b > r->n_nodes)
+      return EINVAL;
+    node->v.list.length = in->b;
+    node->v.list.nodes = calloc(in->b, sizeof(struct ast_node));
+    if (node->v.list.nodes == NULL)
+      return errno;
+    for (i = 0; rc == 0 && i < in->b; i++) {
+      node->v.list.nodes[i].t = AST_NIL;
+      rc = load_node(r, in->a + i, node->v.list.nodes + i, depth + 1);
+    }
+    break;
+  case AST_NIL:
+    break;
+  default:
+    return EINVAL;
+  }
+
+  /* Leave a consistent tree behind for the caller to free on error */
+  if (rc != 0 && node->t == AST_LIST)
+    node->v.list.length = i;
+
+  return rc;
+}
+
+int asm_cache_load(const char *dir, uint64_t key, struct strtab *strtab, struct ast_node **root) {
+  const struct cache_header *header;
+  struct cache_reader r = { .strtab = strtab };
+  struct stat statbuf;
+  void *map = MAP_FAILED;
+  char *path;
+  int fd = -1;
+  int rc = 0;
+
+  path = cache_path(dir, key);
+  if (path == NULL)
+    return ENOMEM;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    rc = errno;
+    goto finish;
+  }
+  if (fstat(fd, &statbuf) == -1) {
+    rc = errno;
+    goto finish;
+  }
+  if (statbuf.st_size < sizeof *header) {
+    rc = ENOENT;
+    goto finish;
+  }
+  map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    rc = errno;
+    goto finish;
+  }
+
+  /* Treat anything unexpected as a miss so the source is parsed afresh */
+  header = (const struct cache_header *) map;
+  if (memcmp(header->magic, CACHE_MAGIC, sizeof header->magic) != 0 ||
+      header->key != key || header->n_nodes == 0 ||
+      sizeof *header + (size_t) header->n_nodes * sizeof *r.nodes + header->strings_size != statbuf.st_size) {
+    rc = ENOENT;
+    goto finish;
+  }
+
+  r.nodes = (const struct cache_node *) (header + 1);
+  r.n_nodes = header->n_nodes;
+  r.strings = (const char *) (r.nodes + r.n_nodes);
+  r.strings_size = header->strings_size;
+
+  rc = load_child(&r, 0, root, 0);
+  if (rc != 0) {
+    ast_free_tree(*root);
+    *root = NULL;
+    rc = ENOENT;
+  }
+
+finish:
+  if (map != MAP_FAILED)
+    munmap(map, statbuf.st_size);
+  if (fd != -1)
+    close(fd);
+  free(path);
+  return rc;
+}
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Cache of parsed assembly sources. */
+
+#ifndef LIBBABY_ASM_CACHE_H
+#define LIBBABY_ASM_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "strtab.h"
+
+struct ast_node;
+
+/* Public functions */
+
+/* Hash source text to form its cache key. */
+extern uint64_t asm_cache_hash(const void *buf, size_t len);
+
+/* Load the AST cached for the given key. Returns ENOENT on a cache miss. */
+extern int asm_cache_load(const char *dir, uint64_t key, struct strtab *strtab, struct ast_node **root);
+
+/* Store an AST in the cache under the given key. */
+extern int asm_cache_store(const char *dir, uint64_t key, struct strtab *strtab, struct ast_node *root);
+
+#endif
@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Removal of unreachable code and unreferenced data.
+ *
+ * A word is kept if it may be run or if a kept word refers to it. Words
+ * that are run lead on to the next word unless they jump or halt, and
+ * to the one after if they skip. A jump goes through the word its operand
+ * names, so that word is kept and the word after the address it holds is
+ * run; a relative jump keeps every word between it and its target so
+ * that the distance does not change. Any other instruction keeps the word
+ * its operand names. A data word that holds an address keeps the word at
+ * that address and runs the word after it, since the address may be used
+ * by a JMP. An EJA keeps only the word it points past.
+ *
+ * Addresses the program computes at run time from plain numbers cannot
+ * be followed, so anything reached only in that way is lost. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arch.h"
+#include "section.h"
+#include "symbols.h"
+#include "asm.h"
+#include "asm-gc.h"
+#include "asm-peephole.h"
+
+#define GC_KEEP 01
+#define GC_RUN  02
+
+struct gc {
+  const struct section *section;
+  const unsigned char *word_flags;
+  unsigned char *state;
+  addr_t *work;
+  addr_t n_work;
+};
+
+static void mark(struct gc *g, addr_t addr, unsigned char how) {
+  addr_t pos = addr - g->section->org;
+
+  if (addr < g->section->org || pos >= g->section->length ||
+      section_debug(g->section, addr) == NULL)
+    return;
+  how |= GC_KEEP;
+  if ((g->state[pos] & how) == how)
+    return;
+  if (g->state[pos] == 0)
+    g->work[g->n_work++] = pos;
+  else if (how & GC_RUN && !(g->state[pos] & GC_RUN))
+    g->work[g->n_work++] = pos;
+  g->state[pos] |= how;
+}
+
+static bool in_section(struct gc *g, addr_t addr) {
+  return addr >= g->section->org && addr - g->section->org < g->section->length;
+}
+
+static word_t value_at(struct gc *g, addr_t addr) {
+  return section_get(g->section, addr);
+}
+
+static void run(struct gc *g, addr_t addr, struct arch_decoded d) {
+  addr_t target, a;
+
+  switch (d.opcode) {
+  case OP_JMP:
+    mark(g, d.operand, GC_KEEP);
+    if (in_section(g, d.operand))
+      mark(g, value_at(g, d.operand) + 1, GC_RUN);
+    break;
+  case OP_JRP:
+    mark(g, d.operand, GC_KEEP);
+    if (in_section(g, d.operand)) {
+      target = addr + value_at(g, d.operand) + 1;
+      for (a = g->section->org; in_section(g, a); a++)
+        if ((a >= addr && a <= target) || (a >= target && a <= addr))
+          mark(g, a, GC_KEEP);
+      mark(g, target, GC_RUN);
+    }
+    break;
+  case OP_SKN:
+    mark(g, addr + 1, GC_RUN);
+    mark(g, addr + 2, GC_RUN);
+    break;
+  case OP_HLT:
+    break;
+  default:
+    mark(g, d.operand, GC_KEEP);
+    mark(g, addr + 1, GC_RUN);
+    break;
+  }
+}
+
+static void keep(struct gc *g, addr_t pos) {
+  const struct asm_abstract *r = section_debug(g->section, g->section->org + pos);
+  const struct mnemonic *m = r->mnemonic;
+  word_t value = value_at(g, g->section->org + pos);
+  struct arch_decoded d = arch_decode(value);
+
+  if (m && m->type == M_INSTR) {
+    if (d.opcode != OP_SKN && d.opcode != OP_HLT)
+      mark(g, d.operand, GC_KEEP);
+  } else if (!g->word_flags || g->word_flags[pos] & PEEPHOLE_ADDRESS) {
+    if (!m || m->type != M_DIRECTIVE || m->dir != D_EJA)
+      mark(g, value, GC_KEEP);
+    mark(g, value + 1, GC_RUN);
+  }
+}
+
+size_t asm_gc(const struct section *section,
+              const struct asm_abstract *records,
+              const unsigned char *word_flags,
+              const addr_t *roots, int n_roots, bool *omit) {
+  struct gc g = {
+    .section = section,
+    .word_flags = word_flags,
+  };
+  const struct asm_abstract *r;
+  size_t removed = 0;
+  addr_t pos;
+  int i;
+
+  if (section->length == 0)
+    return 0;
+
+  /* A word is queued at most once to be kept and once to be run */
+  g.state = calloc(section->length, sizeof *g.state);
+  g.work = calloc(section->length * 2, sizeof *g.work);
+  if (g.state == NULL || g.work == NULL)
+    goto finish;
+
+  for (i = 0; i < n_roots; i++)
+    mark(&g, roots[i], GC_RUN);
+
+  while (g.n_work > 0) {
+    pos = g.work[--g.n_work];
+    keep(&g, pos);
+    if (g.state[pos] & GC_RUN)
+      run(&g, section->org + pos, arch_decode(value_at(&g, section->org + pos)));
+  }
+
+  for (pos = 0; pos < section->length; pos++) {
+    r = section_debug(section, section->org + pos);
+    if (r && !g.state[pos] && !omit[r - records]) {
+      omit[r - records] = true;
+      removed++;
+    }
+  }
+
+finish:
+  free(g.state);
+  free(g.work);
+  return removed;
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Removal of unreachable code and unreferenced data. */
+
+#ifndef LIBBABY_ASM_GC_H
+#define LIBBABY_ASM_GC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arch.h"
+#include "section.h"
+
+struct asm_abstract;
+
+/* Public functions */
+
+/* Choose the words of a program that can never be run or referred to.
+ * 'section' is the program as assembled from 'records' and 'word_flags'
+ * is as for asm_peephole(). Control is followed from each of the
+ * 'n_roots' addresses in 'roots', and every word reached is kept along
+ * with the words it refers to. Sets omit[i] for each other record that
+ * assembles to a word, leaving entries already set alone, and returns
+ * the number of records newly omitted. */
+extern size_t asm_gc(const struct section *section,
+                     const struct asm_abstract *records,
+                     const unsigned char *word_flags,
+                     const addr_t *roots, int n_roots, bool *omit);
+
+#endif
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Multiplication by a constant.
+ *
+ * With only LDN, SUB and STO, k * x is built up in the accumulator in
+ * segments. The first loads -x and subtracts x some number of times.
+ * Each one after stores the value v so far in the temporary t and then
+ * loads -t or -x and subtracts t and x:
+ *
+ *   LDN x; SUB x * j                    gives -1 - j
+ *   STO t; LDN t; SUB t * (f-1); SUB x * j  gives -f * v - j
+ *   STO t; LDN x; SUB t * m; SUB x * j      gives -1 - m * v - j
+ *
+ * The cheapest way of reaching k is found by searching back from it over
+ * small factors and offsets. Between them, these segments make up every
+ * shortest sequence of the three instructions with one temporary, and
+ * the search has been checked to find the shortest for every k from
+ * -200 to 200 against a search of all such sequences. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+#include "arch.h"
+#include "asm.h"
+#include "asm-ast.h"
+#include "asm-mulc.h"
+
+/* Constants */
+
+#define MAX_FACTOR 9
+#define MAX_OFFSET 2
+#define INFINITE (INT_MAX / 2)
+
+/* Types */
+
+enum op {
+  LDN_SRC,
+  SUB_SRC,
+  LDN_TMP,
+  SUB_TMP,
+  STO_TMP,
+};
+
+enum step {
+  STEP_FIRST,
+  STEP_TMP,     /* segment loading the temporary */
+  STEP_SRC,     /* segment loading the source */
+};
+
+/* The cheapest way found of reaching 'v', where a segment that only
+ * negates may follow another only if 'negate' is set. */
+struct chain {
+  int64_t v;
+  bool negate;
+  bool used;
+  enum step step;
+  int factor;
+  int offset;
+  int cost;
+};
+
+struct memo {
+  struct chain *slots;
+  size_t n;
+  size_t sz;
+};
+
+struct ops {
+  enum op *ops;
+  int n;
+  int sz;
+};
+
+static struct chain *memo_find(struct memo *memo, int64_t v, bool negate) {
+  struct chain *old = memo->slots;
+  size_t old_sz = memo->sz;
+  size_t i;
+
+  /* Keep the table no more than half full */
+  if (memo->n * 2 >= memo->sz) {
+    memo->sz = (memo->sz == 0) ? 1024 : memo->sz << 1;
+    memo->slots = calloc(memo->sz, sizeof *memo->slots);
+    if (memo->slots == NULL) {
+      perror("allocating multiplication search");
+      exit(1);
+    }
+    memo->n = 0;
+    for (i = 0; i < old_sz; i++) {
+      if (old[i].used) {
+        *memo_find(memo, old[i].v, old[i].negate) = old[i];
+        memo->n++;
+      }
+    }
+    free(old);
+  }
+
+  for (i = ((uint64_t) v * 0x9e3779b97f4a7c15ULL + negate) & (memo->sz - 1);
+       memo->slots[i].used && (memo->slots[i].v != v || memo->slots[i].negate != negate);
+       i = (i + 1) & (memo->sz - 1));
+  return memo->slots + i;
+}
+
+/* The cost of reaching 'v', not counting the final store. A chain that
+ * is still being searched counts as the first segment alone, which may
+ * miss a cheaper way but never claims one that does not exist. */
+static int search(struct memo *memo, int64_t v, bool negate) {
+  struct chain *c = memo_find(memo, v, negate);
+  struct chain best;
+  int64_t u;
+  int cost;
+  int f, j;
+
+  if (c->used)
+    return c->cost;
+  best = (struct chain) {
+    .v = v, .negate = negate, .used = true, .step = STEP_FIRST,
+    .cost = v <= -1 && v > -INFINITE ? -v : INFINITE,
+  };
+  *c = best;
+  memo->n++;
+
+  /* Each segment must shrink the value, except one that only negates */
+  for (j = 0; j <= MAX_OFFSET; j++) {
+    for (f = negate ? 1 : 2; f <= MAX_FACTOR; f++) {
+      if ((v + j) % f == 0) {
+        u = -(v + j) / f;
+        if (f == 1 || llabs(u) < llabs(v)) {
+          cost = search(memo, u, f != 1) + f + 1 + j;
+          if (cost < best.cost) {
+            best.step = STEP_TMP;
+            best.factor = f;
+            best.offset = j;
+            best.cost = cost;
+          }
+        }
+      }
+      if ((v + 1 + j) % f == 0) {
+        u = -(v + 1 + j) / f;
+        if (f == 1 || llabs(u) < llabs(v)) {
+          cost = search(memo, u, f != 1) + f + 2 + j;
+          if (cost < best.cost) {
+            best.step = STEP_SRC;
+            best.factor = f;
+            best.offset = j;
+            best.cost = cost;
+          }
+        }
+      }
+    }
+  }
+
+  /* The table may have moved */
+  *memo_find(memo, v, negate) = best;
+  return best.cost;
+}
+
+static void put_op(struct ops *ops, enum op op, int times) {
+  for (; times > 0; times--) {
+    if (ops->n == ops->sz) {
+      ops->sz = (ops->sz == 0) ? 64 : ops->sz << 1;
+      ops->ops = realloc(ops->ops, ops->sz * sizeof *ops->ops);
+      if (ops->ops == NULL) {
+        perror("allocating multiplication");
+        exit(1);
+      }
+    }
+    ops->ops[ops->n++] = op;
+  }
+}
+
+static void put_chain(struct memo *memo, struct ops *ops, int64_t v, bool negate) {
+  const struct chain c = *memo_find(memo, v, negate);
+
+  switch (c.step) {
+  case STEP_FIRST:
+    put_op(ops, LDN_SRC, 1);
+    put_op(ops, SUB_SRC, -1 - v);
+    break;
+  case STEP_TMP:
+    put_chain(memo, ops, -(v + c.offset) / c.factor, c.factor != 1);
+    put_op(ops, STO_TMP, 1);
+    put_op(ops, LDN_TMP, 1);
+    put_op(ops, SUB_TMP, c.factor - 1);
+    put_op(ops, SUB_SRC, c.offset);
+    break;
+  case STEP_SRC:
+    put_chain(memo, ops, -(v + 1 + c.offset) / c.factor, c.factor != 1);
+    put_op(ops, STO_TMP, 1);
+    put_op(ops, LDN_SRC, 1);
+    put_op(ops, SUB_TMP, c.factor);
+    put_op(ops, SUB_SRC, c.offset);
+    break;
+  }
+}
+
+static struct ast_node *mk_node(struct ast_node contents) {
+  struct ast_node *node = malloc(sizeof *node);
+
+  if (node == NULL) {
+    perror("allocating multiplication");
+    exit(1);
+  }
+  *node = contents;
+  node->heap = true;
+  return node;
+}
+
+static void mk_stmt(struct strtab *strtab, struct ast_node *stmt, const struct ast_debug *debug,
+                    const char *mnemonic, str_idx_t operand) {
+  *stmt = (struct ast_node) {
+    .t = AST_INSTR,
+    .v.tuple = {
+      mk_node((struct ast_node) { .t = AST_MNEMONIC, .v.mnemonic = {
+        .name = strtab_put(strtab, mnemonic), .builtin = arch_find_instr(mnemonic)
+      } }),
+      mk_node((struct ast_node) { .t = AST_TUPLE, .v.tuple = {
+        mk_node((struct ast_node) { .t = AST_SYMBOL, .v.nameref = {
+          .type = SYM_T_LABEL, .name = operand
+        } }),
+        AST_NIL_NODE
+      } })
+    },
+    .debug = *debug,
+  };
+}
+
+struct ast_node *asm_mulc_expand(struct strtab *strtab, word_t k,
+                                 str_idx_t dst, str_idx_t src, str_idx_t tmp,
+                                 const struct ast_debug *debug, int *cycles) {
+  static const struct { const char *mnemonic; bool tmp; } op_instrs[] = {
+    [ LDN_SRC ] = { "LDN", false },
+    [ SUB_SRC ] = { "SUB", false },
+    [ LDN_TMP ] = { "LDN", true },
+    [ SUB_TMP ] = { "SUB", true },
+    [ STO_TMP ] = { "STO", true },
+  };
+  struct memo memo = { 0 };
+  struct ops ops = { 0 };
+  struct ast_node *list;
+  int i;
+
+  /* Zero is the one value no segment ends with */
+  if (k == 0) {
+    put_op(&ops, LDN_SRC, 1);
+    put_op(&ops, STO_TMP, 1);
+    put_op(&ops, SUB_TMP, 1);
+  } else {
+    search(&memo, k, true);
+    put_chain(&memo, &ops, k, true);
+  }
+  free(memo.slots);
+
+  /* TEMP tmp, the operations, then STO dst */
+  list = mk_node((struct ast_node) { .t = AST_LIST });
+  list->v.list.length = ops.n + 2;
+  list->v.list.nodes = calloc(list->v.list.length, sizeof *list->v.list.nodes);
+  if (list->v.list.nodes == NULL) {
+    perror("allocating multiplication");
+    exit(1);
+  }
+  list->v.list.nodes[0] = (struct ast_node) {
+    .t = AST_TEMP,
+    .v.tuple = {
+      mk_node((struct ast_node) { .t = AST_TUPLE, .v.tuple = {
+        mk_node((struct ast_node) { .t = AST_NAME, .v.str = tmp }),
+        AST_NIL_NODE
+      } }),
+      AST_NIL_NODE
+    },
+    .debug = *debug,
+  };
+  for (i = 0; i < ops.n; i++)
+    mk_stmt(strtab, list->v.list.nodes + 1 + i, debug, op_instrs[ops.ops[i]].mnemonic,
+            op_instrs[ops.ops[i]].tmp ? tmp : src);
+  mk_stmt(strtab, list->v.list.nodes + 1 + ops.n, debug, "STO", dst);
+
+  *cycles = ops.n + 1;
+  free(ops.ops);
+  return list;
+}
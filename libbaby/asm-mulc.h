@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Multiplication by a constant. */
+
+#ifndef LIBBABY_ASM_MULC_H
+#define LIBBABY_ASM_MULC_H
+
+#include "arch.h"
+#include "strtab.h"
+
+struct ast_node;
+struct ast_debug;
+
+/* Public functions */
+
+/* Make the statements that multiply the word 'src' by 'k', leaving the
+ * product in the accumulator and in 'dst', as a list to be expanded in a
+ * scope in which those names are defined. The statements declare 'tmp'
+ * as a temporary. Each statement has the location 'debug' and *cycles is
+ * set to the number of instructions, each taking one cycle. The mnemonics
+ * are named in 'strtab'. */
+extern struct ast_node *asm_mulc_expand(struct strtab *strtab, word_t k,
+                                        str_idx_t dst, str_idx_t src, str_idx_t tmp,
+                                        const struct ast_debug *debug, int *cycles);
+
+#endif
@@ -0,0 +1,344 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Outlining of repeated instruction sequences into shared subroutines.
+ *
+ * Macros are expanded afresh at every use, so a program often holds the
+ * same run of words many times. A run of L words at n sites costs nL
+ * lines; shared, each site costs a call and a literal and the copy costs
+ * L lines and three more, so it is worth sharing when
+ *
+ *   (n - 1) * L > 4 * n + 3
+ *
+ * Runs are chosen greedily, the one saving most first, until none saves
+ * anything. Only LDN, SUB and STO are shared: they always lead on to the
+ * next word, so the copy returns to the word after the site, and a site
+ * starting with LDN does not need the accumulator kept across the call.
+ *
+ * A word inside a site must not be named by a label or by a word that
+ * holds an address, since it is no longer there once outlined, and no
+ * word of a site may be an instruction's operand, since the call takes
+ * its place. A relative jump pins every word it spans. Operands that are
+ * temporaries are not shared because temporaries are allocated by where
+ * they are used and the copy is used from every site. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arch.h"
+#include "section.h"
+#include "asm.h"
+#include "asm-ast.h"
+#include "asm-outline.h"
+#include "asm-peephole.h"
+
+#define OUTLINE_OK     01   /* may be part of a sequence */
+#define OUTLINE_START  02   /* may start a sequence */
+#define OUTLINE_TARGET 04   /* may be jumped to or named */
+#define OUTLINE_PINNED 010  /* referred to as data or spanned */
+
+struct outliner {
+  const struct section *section;
+  const struct asm_abstract *records;
+  size_t pool;
+  size_t temps;
+  const unsigned char *word_flags;
+  unsigned char *state;
+  size_t *reach;            /* words a sequence from here may span */
+  size_t *match;            /* words in common with the candidate */
+  addr_t *starts;
+  size_t n_starts;
+};
+
+static bool in_section(const struct outliner *o, addr_t addr) {
+  return addr >= o->section->org && addr - o->section->org < o->section->length;
+}
+
+static void mark(struct outliner *o, addr_t addr, unsigned char how) {
+  if (in_section(o, addr))
+    o->state[addr - o->section->org] |= how;
+}
+
+/* The record assembled at 'pos', if any */
+static const struct asm_abstract *record_at(const struct outliner *o, addr_t pos) {
+  return section_debug(o->section, o->section->org + pos);
+}
+
+static bool is_instr(const struct asm_abstract *r) {
+  return r && r->mnemonic && r->mnemonic->type == M_INSTR;
+}
+
+/* Note the words the program refers to and whether each may be shared */
+static bool survey(struct outliner *o, const bool *omit) {
+  const struct section *s = o->section;
+  const struct asm_abstract *r;
+  struct arch_decoded d;
+  addr_t pos, target, a;
+  word_t value;
+
+  for (pos = 0; pos < s->length; pos++) {
+    r = record_at(o, pos);
+    value = section_get(s, s->org + pos);
+    d = arch_decode(value);
+    if (r == NULL)
+      continue;
+    if (r->flags & (HAS_LABEL | HAS_ORG))
+      o->state[pos] |= OUTLINE_TARGET;
+    if (is_instr(r)) {
+      if (d.opcode == OP_JRP) {
+        if (!in_section(o, d.operand))
+          return false;
+        target = s->org + pos + section_get(s, d.operand) + 1;
+        for (a = s->org; in_section(o, a); a++)
+          if ((a >= s->org + pos && a <= target) || (a >= target && a <= s->org + pos))
+            mark(o, a, OUTLINE_PINNED);
+      }
+      if (d.opcode != OP_SKN && d.opcode != OP_HLT)
+        mark(o, d.operand, OUTLINE_PINNED);
+    } else if (!o->word_flags || o->word_flags[pos] & PEEPHOLE_ADDRESS) {
+      mark(o, value, OUTLINE_TARGET);
+      mark(o, value + 1, OUTLINE_TARGET);
+    }
+  }
+
+  for (pos = 0; pos < s->length; pos++) {
+    r = record_at(o, pos);
+    d = arch_decode(section_get(s, s->org + pos));
+    if (!is_instr(r) || r - o->records >= o->pool || omit[r - o->records] ||
+        o->state[pos] & OUTLINE_PINNED ||
+        (o->word_flags && o->word_flags[pos] & PEEPHOLE_BARRIER))
+      continue;
+    if (d.opcode != OP_LDN && d.opcode != OP_SUB && d.opcode != OP_SUB_ALIAS &&
+        d.opcode != OP_STO)
+      continue;
+    if (in_section(o, d.operand) && record_at(o, d.operand - s->org) &&
+        record_at(o, d.operand - s->org) - o->records >= o->temps)
+      continue;
+    o->state[pos] |= OUTLINE_OK;
+
+    /* A skip before the call would skip only its first instruction */
+    if (d.opcode == OP_LDN &&
+        !(pos > 0 && is_instr(record_at(o, pos - 1)) &&
+          arch_decode(section_get(s, s->org + pos - 1)).opcode == OP_SKN))
+      o->state[pos] |= OUTLINE_START;
+  }
+  return true;
+}
+
+/* How far a sequence may run from each word, following records that are
+ * laid out one after another with nothing naming the words between. */
+static void measure(struct outliner *o) {
+  addr_t pos;
+
+  for (pos = o->section->length; pos > 0; pos--) {
+    if (!(o->state[pos - 1] & OUTLINE_OK))
+      o->reach[pos - 1] = 0;
+    else if (pos < o->section->length && o->state[pos] & OUTLINE_OK &&
+             !(o->state[pos] & OUTLINE_TARGET) &&
+             record_at(o, pos) == record_at(o, pos - 1) + 1)
+      o->reach[pos - 1] = o->reach[pos] + 1;
+    else
+      o->reach[pos - 1] = 1;
+  }
+}
+
+static long saving(size_t length, size_t n_sites) {
+  return (long) ((n_sites - 1) * length) -
+         (long) (n_sites * OUTLINE_SITE_LINES + OUTLINE_BODY_LINES);
+}
+
+long asm_outline_saving(const struct asm_outline *outline) {
+  return saving(outline->length, outline->n_sites);
+}
+
+/* Take sites of the sequence of 'length' words at starts[first] in order,
+ * counting them or, given 'sites', listing their positions. */
+static size_t take_sites(struct outliner *o, size_t first, size_t length, addr_t *sites) {
+  addr_t end = 0;
+  size_t n = 0;
+  size_t i;
+
+  for (i = first; i < o->n_starts; i++) {
+    if (o->match[i] >= length && o->starts[i] >= end) {
+      if (sites)
+        sites[n] = o->starts[i];
+      n++;
+      end = o->starts[i] + length;
+    }
+  }
+  return n;
+}
+
+/* Find the sequence that saves most, starting it at starts[*first] */
+static size_t best_sequence(struct outliner *o, size_t *first, long *best) {
+  const struct section *s = o->section;
+  size_t best_length = 0;
+  size_t i, j, m, n;
+  long gain;
+
+  *best = 0;
+  for (i = 0; i < o->n_starts; i++) {
+    if (o->reach[o->starts[i]] == 0)
+      continue;
+    for (j = i; j < o->n_starts; j++) {
+      for (m = 0;
+           m < o->reach[o->starts[i]] && m < o->reach[o->starts[j]] &&
+           (j == i || o->starts[i] + m < o->starts[j]) &&
+           section_get(s, s->org + o->starts[i] + m) ==
+           section_get(s, s->org + o->starts[j] + m);
+           m++);
+      o->match[j] = m;
+    }
+
+    /* Only the lengths some other site matches to can be best */
+    for (j = i + 1; j < o->n_starts; j++) {
+      if (o->match[j] == 0)
+        continue;
+      n = take_sites(o, i, o->match[j], NULL);
+      gain = saving(o->match[j], n);
+      if (gain > *best) {
+        *best = gain;
+        *first = i;
+        best_length = o->match[j];
+      }
+    }
+  }
+  return best_length;
+}
+
+int asm_outline(const struct section *section,
+                const struct asm_abstract *records,
+                size_t pool, size_t temps,
+                const unsigned char *word_flags, bool *omit,
+                struct asm_outline **outlines) {
+  struct outliner o = {
+    .section = section,
+    .records = records,
+    .pool = pool,
+    .temps = temps,
+    .word_flags = word_flags,
+  };
+  struct asm_outline *ol;
+  addr_t *sites = NULL;
+  size_t first, length, n, i, k;
+  size_t n_outlines = 0;
+  size_t outlines_sz = 0;
+  addr_t pos;
+  long best;
+  int rc = -1;
+
+  *outlines = NULL;
+  if (section->length == 0)
+    return 0;
+
+  o.state = calloc(section->length, sizeof *o.state);
+  o.reach = calloc(section->length, sizeof *o.reach);
+  o.match = calloc(section->length, sizeof *o.match);
+  o.starts = calloc(section->length, sizeof *o.starts);
+  sites = calloc(section->length, sizeof *sites);
+  if (o.state == NULL || o.reach == NULL || o.match == NULL ||
+      o.starts == NULL || sites == NULL)
+    goto finish;
+
+  rc = 0;
+  if (!survey(&o, omit))
+    goto finish;
+  for (pos = 0; pos < section->length; pos++)
+    if (o.state[pos] & OUTLINE_START)
+      o.starts[o.n_starts++] = pos;
+
+  for (;;) {
+    measure(&o);
+    length = best_sequence(&o, &first, &best);
+    if (best <= 0)
+      break;
+    for (i = first; i < o.n_starts; i++)
+      o.match[i] = 0;
+    for (i = first; i < o.n_starts; i++) {
+      for (k = 0;
+           k < length && k < o.reach[o.starts[i]] &&
+           section_get(section, section->org + o.starts[first] + k) ==
+           section_get(section, section->org + o.starts[i] + k);
+           k++);
+      o.match[i] = k;
+    }
+    n = take_sites(&o, first, length, sites);
+
+    if (n_outlines == outlines_sz) {
+      outlines_sz = (outlines_sz == 0) ? 8 : outlines_sz << 1;
+      ol = realloc(*outlines, outlines_sz * sizeof **outlines);
+      if (ol == NULL) {
+        rc = -1;
+        goto finish;
+      }
+      *outlines = ol;
+    }
+    ol = *outlines + n_outlines++;
+    *ol = (struct asm_outline) { .length = length, .n_sites = n };
+    ol->sites = calloc(n, sizeof *ol->sites);
+    if (ol->sites == NULL) {
+      rc = -1;
+      goto finish;
+    }
+
+    /* The words of each site are used up and all but the call left out */
+    for (i = 0; i < n; i++) {
+      ol->sites[i] = record_at(&o, sites[i]) - records;
+      for (k = 0; k < length; k++) {
+        o.state[sites[i] + k] &= ~(OUTLINE_OK | OUTLINE_START);
+        if (k >= OUTLINE_CALL)
+          omit[ol->sites[i] + k] = true;
+      }
+    }
+  }
+  rc = n_outlines;
+
+finish:
+  if (rc == -1) {
+    asm_outline_free(*outlines, n_outlines);
+    *outlines = NULL;
+  }
+  free(o.state);
+  free(o.reach);
+  free(o.match);
+  free(o.starts);
+  free(sites);
+  return rc;
+}
+
+static struct ast_node *mk_node(struct ast_node contents) {
+  struct ast_node *node = malloc(sizeof *node);
+
+  if (node == NULL) {
+    perror("allocating outline");
+    exit(1);
+  }
+  *node = contents;
+  node->heap = true;
+  return node;
+}
+
+struct ast_node *asm_outline_operand(str_idx_t name, bool negated) {
+  struct ast_node *node;
+
+  node = mk_node((struct ast_node) { .t = AST_SYMBOL, .v.nameref = {
+    .type = SYM_T_LABEL, .name = name
+  } });
+  if (negated)
+    node = mk_node((struct ast_node) { .t = AST_LITERAL, .v.tuple = {
+      mk_node((struct ast_node) { .t = AST_MINUS, .v.tuple = {
+        mk_node((struct ast_node) { .t = AST_NUMBER }), node
+      } }),
+      AST_NIL_NODE
+    } });
+  return mk_node((struct ast_node) { .t = AST_TUPLE, .v.tuple = { node, AST_NIL_NODE } });
+}
+
+void asm_outline_free(struct asm_outline *outlines, int n) {
+  int i;
+
+  for (i = 0; outlines && i < n; i++)
+    free(outlines[i].sites);
+  free(outlines);
+}
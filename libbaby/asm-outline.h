@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Outlining of repeated instruction sequences into shared subroutines. */
+
+#ifndef LIBBABY_ASM_OUTLINE_H
+#define LIBBABY_ASM_OUTLINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "section.h"
+#include "strtab.h"
+
+struct asm_abstract;
+struct ast_node;
+
+/* Constants */
+
+/* Each site becomes a call of three instructions, LDN of a literal
+ * holding minus the address of the third, STO to the link line and JMP
+ * through the entry line. The shared copy ends with JMP through the link
+ * line and is followed by the link and entry lines. */
+#define OUTLINE_CALL 3
+#define OUTLINE_SITE_LINES (OUTLINE_CALL + 1)
+#define OUTLINE_BODY_LINES 3
+#define OUTLINE_CYCLES 4
+
+/* Types */
+
+/* A sequence of instructions found at several sites */
+struct asm_outline {
+  size_t length;      /* instructions in the sequence */
+  size_t n_sites;
+  size_t *sites;      /* record of the first instruction at each site */
+};
+
+/* Public functions */
+
+/* Choose sequences of loads, subtractions and stores that appear at more
+ * than one site in a program and that would take fewer lines as one copy
+ * called from each site. 'section' is the program as assembled from
+ * 'records', of which those from 'pool' on are literals and those from
+ * 'temps' on temporaries, and 'word_flags' is as for asm_peephole().
+ * A sequence starts with LDN, so that a call may use the accumulator,
+ * and nothing refers into it or to it as data. Records already set in
+ * 'omit' are not used and each record of a site after the call is set.
+ * Returns the number of sequences, stored in *outlines, or -1. */
+extern int asm_outline(const struct section *section,
+                       const struct asm_abstract *records,
+                       size_t pool, size_t temps,
+                       const unsigned char *word_flags, bool *omit,
+                       struct asm_outline **outlines);
+
+/* Make the operand of an instruction added by outlining: the address
+ * 'name' or, if 'negated', a literal holding minus that address. */
+extern struct ast_node *asm_outline_operand(str_idx_t name, bool negated);
+
+/* The lines saved by sharing 'outline' */
+extern long asm_outline_saving(const struct asm_outline *outline);
+
+extern void asm_outline_free(struct asm_outline *outlines, int n);
+
+#endif
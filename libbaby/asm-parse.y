@@ -15,8 +15,9 @@
 #include "asm-ast.h"
 #include "asm-parse.h"
 
-int yylex(YYSTYPE *yylval, void *scanner);
-void yyerror(YYLTYPE *yylval, struct ast_node **root, char const *);
+int yylex(YYSTYPE *yylval, YYLTYPE *yylloc, void *scanner);
+void *yyget_extra(void *scanner);
+void yyerror(YYLTYPE *yylloc, void *scanner, struct ast_node **root, char const *);
 
 static struct ast_node *ast_alloc(void) {
   struct ast_node *node = (struct ast_node *) calloc(1, sizeof *node);
@@ -34,6 +35,7 @@ static struct ast_node *ast_alloc(void) {
 static struct ast_node *mk_node(struct ast_node contents) {
   struct ast_node *node = ast_alloc();
   *node = contents;
+  node->heap = true;
   return node;
 }
 
@@ -76,6 +78,10 @@ static struct ast_node *mk_list(struct ast_node *head) {
   return node;
 }
 
+static struct ast_node *mk_empty_list(void) {
+  return mk_node((struct ast_node) { .t = AST_LIST });
+}
+
 static struct ast_node *mk_tuple (struct ast_node *l, struct ast_node *r) {
   return mk_node((struct ast_node) { .t = AST_TUPLE, .v.tuple = { l, r } });
 }
@@ -97,12 +103,26 @@ static struct ast_node *mk_name(str_idx_t str) {
   return node;
 }
 
+/* Symbols are only referenced by name here; they are bound to a symbol
+ * context when the statements are processed, so that parsing does not
+ * touch shared symbol tables. */
 static struct ast_node *mk_symbol(enum sym_type sym_type, str_idx_t str) {
   struct ast_node *node;
-  node = mk_node((struct ast_node) { .t = AST_SYMBOL, .v.nameref = *sym_getref(sym_root_context(), sym_type, str) });
+  node = mk_node((struct ast_node) { .t = AST_SYMBOL, .v.nameref = { .type = sym_type, .name = str } });
   return node;
 }
 
+/* Built-in mnemonics are resolved here, once, rather than by name for
+ * every statement expanded. */
+static struct ast_node *mk_mnemonic(void *scanner, str_idx_t str) {
+  struct source_public *source = (struct source_public *) yyget_extra(scanner);
+
+  return mk_node((struct ast_node) { .t = AST_MNEMONIC, .v.mnemonic = {
+    .name = str,
+    .builtin = arch_resolve_instr(source->strtab, str),
+  } });
+}
+
 static struct ast_node *mk_label(str_idx_t str) {
   struct ast_node *node = mk_symbol(SYM_T_LABEL, str);
   node->t = AST_LABEL;
@@ -150,7 +170,21 @@ static struct ast_node *maybe_tuple(struct ast_node *l, struct ast_node *r) {
 }
 */
 
-#define SAVE_DEBUG(x) (x)->debug.present = true; (x)->debug.loc = yylloc;
+#define SAVE_DEBUG(x, l) (x)->debug.present = true; (x)->debug.loc = (l);
+
+/* A rule spans from the start of its first symbol to the end of its last.
+ * The default would use the lookahead, which may be on the next line. */
+#define YYLLOC_DEFAULT(Current, Rhs, N)                 \
+  do {                                                  \
+    if (N) {                                            \
+      (Current).start = YYRHSLOC(Rhs, 1).start;         \
+      (Current).end = YYRHSLOC(Rhs, N).end;             \
+    } else {                                            \
+      (Current).start = YYRHSLOC(Rhs, 0).end;           \
+      (Current).end = YYRHSLOC(Rhs, 0).end;             \
+    }                                                   \
+    (Current).last_char_was_newline = false;            \
+  } while (0)
 
 %}
 
@@ -184,18 +218,23 @@ typedef struct {
                          .last_char_was_newline = false };
 }
 
-%parse-param {struct ast_node **root}
+%lex-param {void *scanner}
+%parse-param {void *scanner} {struct ast_node **root}
 %define api.location.type {src_loc_t}
 %define api.value.type union
-%token <char *> HEX OCTAL DECIMAL BINARY COLON EOL COMMA
-%token <char *> MACRO ENDM CONTINUATION
+%token <char *> HEX OCTAL DECIMAL BINARY COLON EOL COMMA EQUALS
+%token <char *> MACRO ENDM EQU EXPORT TEMP SECTION CONTINUATION
+%token <char *> REPT IRP IF ELSE ENDIF
 %token <char *> MINUS PLUS
 %token <str_idx_t> NAME
 %nterm <struct ast_node *> file stmts stmt location instr
 %nterm <struct ast_node *> number number_not_octal
-%nterm <struct ast_node *> mnemonic operands expr eol
-%nterm <struct ast_node *> macro arguments
+%nterm <struct ast_node *> mnemonic operands operand expr eol
+%nterm <struct ast_node *> macro arguments equ export temp
+%nterm <struct ast_node *> section attributes
+%nterm <struct ast_node *> rept irp cond block
 
+%precedence NEGATED
 %left MINUS PLUS
 
 %%
@@ -208,13 +247,48 @@ eol: eol EOL { }
 stmts: stmts stmt { $$ = mk_tuple($2, $1); }
      | stmt { $$ = mk_tuple($1, AST_NIL_NODE); };
 
-stmt: location COLON eol { $$ = $1; SAVE_DEBUG($$); }
-    | location COLON { $$ = $1; SAVE_DEBUG($$); }
-    | instr eol { $$ = $1; SAVE_DEBUG($$); }
-    | macro eol { $$ = $1; SAVE_DEBUG($$); };
+stmt: location COLON eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | location COLON { $$ = $1; SAVE_DEBUG($$, @1); }
+    | instr eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | macro eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | equ eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | export eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | temp eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | section eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | rept eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | irp eol { $$ = $1; SAVE_DEBUG($$, @1); }
+    | cond eol { $$ = $1; SAVE_DEBUG($$, @1); };
 
 macro: NAME MACRO arguments eol stmts ENDM { $$ = mk_macro($1, $3, $5); }
 
+/* Repeated and conditional blocks are expanded where they appear, each
+ * repetition in a scope of its own. */
+rept: REPT expr eol block ENDM { $$ = mk_semantic(AST_REPT, $2, $4); }
+
+irp: IRP NAME COMMA operands eol block ENDM {
+       $$ = mk_semantic(AST_IRP, mk_name($2), mk_tuple($4, $6));
+     }
+
+cond: IF expr eol block ENDIF { $$ = mk_semantic(AST_IF, $2, mk_tuple($4, mk_empty_list())); }
+    | IF expr eol block ELSE eol block ENDIF {
+        $$ = mk_semantic(AST_IF, $2, mk_tuple($4, $7));
+      }
+
+block: stmts { $$ = mk_list($1); }
+     | %empty { $$ = mk_empty_list(); };
+
+equ: NAME EQU expr { $$ = mk_semantic(AST_EQU, mk_name($1), $3); }
+
+export: EXPORT arguments { $$ = mk_semantic(AST_EXPORT, $2, AST_NIL_NODE); }
+
+temp: TEMP arguments { $$ = mk_semantic(AST_TEMP, $2, AST_NIL_NODE); }
+
+section: SECTION NAME attributes { $$ = mk_semantic(AST_SECTION, mk_name($2), $3); }
+
+/* Placement constraints on a section, each a keyword and a number */
+attributes: COMMA NAME number attributes { $$ = mk_tuple(mk_tuple(mk_name($2), $3), $4); }
+          | %empty { $$ = mk_nil(); };
+
 arguments: NAME COMMA arguments { $$ = mk_tuple(mk_name($1), $3); }
          | NAME { $$ = mk_tuple(mk_name($1), AST_NIL_NODE); }
          | %empty { $$ = mk_nil(); };
@@ -225,10 +299,22 @@ location: number_not_octal { $$ = mk_org($1); }
 instr: mnemonic operands { $$ = mk_instr($1, $2); }
      | mnemonic { $$ = mk_instr($1, AST_NIL_NODE); };
 
-mnemonic: NAME { $$ = mk_symbol(SYM_T_MNEMONIC, $1); }
-
-operands: expr COMMA operands { $$ = mk_tuple($1, $3); }
-        | expr { $$ = mk_tuple($1, AST_NIL_NODE); };
+mnemonic: NAME { $$ = mk_mnemonic(scanner, $1); }
+
+operands: operand COMMA operands { $$ = mk_tuple($1, $3); }
+        | operand { $$ = mk_tuple($1, AST_NIL_NODE); };
+
+/* A literal is the address of a word holding its value. A negated one
+ * is negated as a whole, for loading the value with LDN. */
+operand: expr { $$ = $1; }
+       | EQUALS expr { $$ = mk_semantic(AST_LITERAL, $2, AST_NIL_NODE); }
+       | EQUALS MINUS expr %prec NEGATED {
+           $$ = mk_semantic(AST_LITERAL,
+                            mk_semantic(AST_MINUS,
+                                        mk_node((struct ast_node) { .t = AST_NUMBER }),
+                                        $3),
+                            AST_NIL_NODE);
+         };
 
 expr: expr MINUS expr { $$ = mk_semantic(AST_MINUS, $1, $3); }
     | expr PLUS expr { $$ = mk_semantic(AST_PLUS, $1, $3); }
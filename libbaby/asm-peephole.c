@@ -0,0 +1,303 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Peephole optimizer for assembled programs.
+ *
+ * The program is split into basic blocks: runs of instructions that are
+ * entered only at the top and left only at the bottom. A word is a block
+ * boundary if anything might refer to it: a label, the operand of any
+ * instruction, a data word that could be a jump target or the target of
+ * a relative jump. Such words are never removed either, which keeps jump
+ * targets and any word the program reads or writes at run time.
+ *
+ * Within a block, a short window of loads, stores and subtractions is
+ * removed if doing so changes neither the accumulator nor any store line
+ * that is read before it is next written in that block. The effect of
+ * the window is worked out symbolically: every value the Baby can compute
+ * is a linear combination of the values in the accumulator and the store
+ * lines it reads. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "arch.h"
+#include "section.h"
+#include "symbols.h"
+#include "asm.h"
+#include "asm-peephole.h"
+
+/* Longest sequence of instructions considered for removal */
+#define PEEPHOLE_WINDOW 4
+
+/* The accumulator, then each store line the window refers to */
+#define PEEPHOLE_VARS (PEEPHOLE_WINDOW + 1)
+
+enum word_kind {
+  WK_NONE,
+  WK_DATA,
+  WK_INSTR,
+};
+
+struct peephole {
+  const struct section *section;
+  const struct asm_abstract *records;
+  const unsigned char *word_flags;
+  bool *omit;
+  unsigned char *kind;
+  bool *fixed;        /* must be kept and may be a block entry */
+  int *block;         /* positions of the live words of a block */
+  int block_len;
+};
+
+static void fix(struct peephole *p, addr_t addr) {
+  if (addr >= p->section->org && addr - p->section->org < p->section->length)
+    p->fixed[addr - p->section->org] = true;
+}
+
+static struct arch_decoded decode(struct peephole *p, int pos) {
+  return arch_decode(section_get(p->section, p->section->org + pos));
+}
+
+static bool has_operand(word_t opcode) {
+  return opcode != OP_SKN && opcode != OP_HLT;
+}
+
+static bool ends_block(word_t opcode) {
+  return opcode == OP_JMP || opcode == OP_JRP ||
+         opcode == OP_SKN || opcode == OP_HLT;
+}
+
+static bool removable(struct peephole *p, int pos) {
+  word_t opcode = decode(p, pos).opcode;
+
+  return !p->fixed[pos] &&
+         (opcode == OP_LDN || opcode == OP_STO ||
+          opcode == OP_SUB || opcode == OP_SUB_ALIAS);
+}
+
+/* Find the words that must stay where the program can see them. */
+static void find_fixed(struct peephole *p, size_t n_records) {
+  const struct section *section = p->section;
+  struct symbol *sym;
+  addr_t pos;
+  size_t i;
+
+  for (i = 0; i < n_records; i++) {
+    const struct asm_abstract *r = p->records + i;
+
+    if (r->flags & HAS_LABEL) {
+      sym = sym_lookup(r->context, SYM_T_LABEL, r->label.name, SYM_LU_SCOPE_LOCAL);
+      if (sym && (sym->subtype == SYM_ST_WORD || sym->subtype == SYM_ST_REL))
+        fix(p, sym->val.numeric);
+    }
+  }
+
+  for (pos = 0; pos < section->length; pos++) {
+    addr_t addr = section->org + pos;
+    word_t value = section_get(section, addr);
+    struct arch_decoded d = arch_decode(value);
+
+    if (p->word_flags && p->word_flags[pos] & PEEPHOLE_BARRIER)
+      p->fixed[pos] = true;
+
+    if (p->kind[pos] == WK_DATA &&
+        (!p->word_flags || p->word_flags[pos] & PEEPHOLE_ADDRESS)) {
+      /* Could be the operand of a JMP or the result of an EJA */
+      fix(p, value);
+      fix(p, value + 1);
+    } else if (p->kind[pos] == WK_INSTR) {
+      if (has_operand(d.opcode))
+        fix(p, d.operand);
+      if (d.opcode == OP_JRP && d.operand >= section->org &&
+          d.operand - section->org < section->length) {
+        value = section_get(section, d.operand);
+        fix(p, addr + value);
+        fix(p, addr + value + 1);
+      }
+      /* A skip may or may not run the next instruction */
+      if (d.opcode == OP_SKN) {
+        fix(p, addr + 1);
+        fix(p, addr + 2);
+      }
+    }
+  }
+}
+
+/* The value of the accumulator or a store line, as coefficients of the
+ * values they held before the window. */
+typedef num_t form_t[PEEPHOLE_VARS];
+
+static int var_for(addr_t *addrs, int *n, addr_t addr) {
+  int i;
+
+  for (i = 0; i < *n; i++)
+    if (addrs[i] == addr)
+      break;
+  if (i == *n)
+    addrs[(*n)++] = addr;
+  return i + 1;
+}
+
+/* Check that removing the 'len' words at block[start] leaves the block
+ * doing the same thing. */
+static bool can_remove(struct peephole *p, int start, int len) {
+  form_t state[PEEPHOLE_VARS] = { 0 };
+  addr_t addrs[PEEPHOLE_WINDOW];
+  bool differs[PEEPHOLE_VARS];
+  int n_addrs = 0;
+  int pending = 0;
+  int v, x, i;
+
+  for (i = 0; i < PEEPHOLE_VARS; i++)
+    state[i][i] = 1;
+
+  for (i = start; i < start + len; i++) {
+    struct arch_decoded d = decode(p, p->block[i]);
+
+    x = var_for(addrs, &n_addrs, d.operand);
+    for (v = 0; v < PEEPHOLE_VARS; v++) {
+      switch (d.opcode) {
+      case OP_LDN:
+        state[0][v] = -state[x][v];
+        break;
+      case OP_SUB:
+      case OP_SUB_ALIAS:
+        state[0][v] -= state[x][v];
+        break;
+      case OP_STO:
+        state[x][v] = state[0][v];
+        break;
+      }
+    }
+  }
+
+  for (i = 0; i <= n_addrs; i++) {
+    form_t unchanged = { 0 };
+
+    unchanged[i] = 1;
+    differs[i] = memcmp(state[i], unchanged, sizeof unchanged) != 0;
+    if (differs[i])
+      pending++;
+  }
+
+  /* Whatever differs must be overwritten before it is next used */
+  for (i = start + len; pending > 0 && i < p->block_len; i++) {
+    struct arch_decoded d = decode(p, p->block[i]);
+
+    if (ends_block(d.opcode) ||
+        (p->word_flags && p->word_flags[p->block[i]] & PEEPHOLE_BARRIER))
+      return false;
+
+    for (x = 1; x <= n_addrs && addrs[x - 1] != d.operand; x++);
+    if (x <= n_addrs && differs[x] && d.opcode != OP_STO)
+      return false;
+
+    switch (d.opcode) {
+    case OP_LDN:
+      if (differs[0])
+        pending--;
+      differs[0] = false;
+      break;
+    case OP_SUB:
+    case OP_SUB_ALIAS:
+      if (differs[0])
+        return false;
+      break;
+    case OP_STO:
+      if (differs[0])
+        return false;
+      if (x <= n_addrs && differs[x]) {
+        differs[x] = false;
+        pending--;
+      }
+      break;
+    }
+  }
+
+  return pending == 0;
+}
+
+static size_t optimize_block(struct peephole *p) {
+  size_t removed = 0;
+  bool changed;
+  int start, len, i;
+
+  do {
+    changed = false;
+    for (len = 1; !changed && len <= PEEPHOLE_WINDOW; len++) {
+      for (start = 0; !changed && start + len <= p->block_len; start++) {
+        for (i = start; i < start + len && removable(p, p->block[i]); i++);
+        if (i < start + len || !can_remove(p, start, len))
+          continue;
+
+        for (i = start; i < start + len; i++)
+          p->omit[section_debug(p->section, p->section->org + p->block[i]) - p->records] = true;
+        memmove(p->block + start, p->block + start + len,
+                (p->block_len - start - len) * sizeof *p->block);
+        p->block_len -= len;
+        removed += len;
+        changed = true;
+      }
+    }
+  } while (changed);
+
+  return removed;
+}
+
+size_t asm_peephole(const struct section *section,
+                    const struct asm_abstract *records, size_t n_records,
+                    const unsigned char *word_flags, bool *omit) {
+  struct peephole p = {
+    .section = section,
+    .records = records,
+    .word_flags = word_flags,
+    .omit = omit,
+  };
+  const struct mnemonic *m;
+  size_t removed = 0;
+  addr_t pos;
+
+  memset(omit, '\0', n_records * sizeof *omit);
+
+  p.kind = calloc(section->length, sizeof *p.kind);
+  p.fixed = calloc(section->length, sizeof *p.fixed);
+  p.block = calloc(section->length, sizeof *p.block);
+  if (section->length > 0 && (p.kind == NULL || p.fixed == NULL || p.block == NULL))
+    goto finish;
+
+  for (pos = 0; pos < section->length; pos++) {
+    const struct asm_abstract *r = section_debug(section, section->org + pos);
+
+    if (r && r->flags & HAS_INSTR) {
+      m = r->mnemonic;
+      p.kind[pos] = m && m->type == M_INSTR ? WK_INSTR : WK_DATA;
+    }
+  }
+
+  find_fixed(&p, n_records);
+
+  for (pos = 0; pos <= section->length; pos++) {
+    bool in_block = pos < section->length && p.kind[pos] == WK_INSTR;
+
+    if (p.block_len > 0 && (!in_block || p.fixed[pos])) {
+      removed += optimize_block(&p);
+      p.block_len = 0;
+    }
+    if (in_block) {
+      p.block[p.block_len++] = pos;
+      if (ends_block(decode(&p, pos).opcode)) {
+        removed += optimize_block(&p);
+        p.block_len = 0;
+      }
+    }
+  }
+
+finish:
+  free(p.kind);
+  free(p.fixed);
+  free(p.block);
+  return removed;
+}
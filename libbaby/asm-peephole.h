@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Peephole optimizer for assembled programs. */
+
+#ifndef LIBBABY_ASM_PEEPHOLE_H
+#define LIBBABY_ASM_PEEPHOLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "section.h"
+
+struct asm_abstract;
+
+/* Constants */
+
+/* What is known about each word of the section */
+#define PEEPHOLE_ADDRESS 01   /* holds the address of a word */
+#define PEEPHOLE_BARRIER 02   /* refers to another object */
+
+/* Public functions */
+
+/* Choose instructions that can be left out of a program without changing
+ * what it does. 'section' is the program as assembled from 'records'.
+ * Without 'word_flags', any data word might hold an address. Barrier
+ * words are neither removed nor looked past. Sets omit[i] for each record
+ * that may be left out and returns the number of them. */
+extern size_t asm_peephole(const struct section *section,
+                           const struct asm_abstract *records, size_t n_records,
+                           const unsigned char *word_flags, bool *omit);
+
+#endif
@@ -0,0 +1,376 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Allocation of store lines to temporaries.
+ *
+ * A temporary is live on entry to an instruction if some path from there
+ * reads it before writing it. Liveness is found for each temporary in
+ * turn by walking backwards from the instructions that read it until an
+ * instruction that writes it. Two temporaries may share a line unless
+ * one is live on entry to, or written by, an instruction where the other
+ * is also live or written.
+ *
+ * Control flow is taken from the program as assembled. A jump through a
+ * word that the program writes, an instruction that the program writes
+ * and a jump out of the section may go to any instruction that follows
+ * the address held in a data word. A temporary whose address is taken,
+ * or that is jumped through, is given a line of its own. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arch.h"
+#include "section.h"
+#include "symbols.h"
+#include "asm.h"
+#include "asm-temps.h"
+
+enum access {
+  ACC_NONE,
+  ACC_READ,
+  ACC_WRITE,
+  ACC_PIN,
+};
+
+struct occupant {
+  addr_t pos;
+  int temp;
+};
+
+struct alloc {
+  const struct section *section;
+  bool *instr;
+  bool *written;
+  bool *entry;          /* might be reached by an unknown jump */
+  addr_t *unknown;      /* words that might jump anywhere */
+  addr_t n_unknown;
+  addr_t *pred_start;   /* predecessors of each word, in 'preds' */
+  addr_t *preds;
+  int *temp_at;         /* temporary each word refers to, or -1 */
+  enum access *access;
+  struct occupant *occ;
+  size_t n_occ;
+  size_t occ_sz;
+};
+
+static bool in_section(struct alloc *al, addr_t addr) {
+  return addr >= al->section->org && addr - al->section->org < al->section->length;
+}
+
+static word_t value_at(struct alloc *al, addr_t addr) {
+  return section_get(al->section, addr);
+}
+
+/* Find the words that may run after the instruction at 'pos'. */
+static int successors(struct alloc *al, addr_t pos, addr_t *next, bool *unknown) {
+  addr_t addr = al->section->org + pos;
+  struct arch_decoded d = arch_decode(value_at(al, addr));
+  addr_t targets[2];
+  int n = 0;
+  int i, m = 0;
+
+  *unknown = al->written[pos];
+  switch (d.opcode) {
+  case OP_JMP:
+  case OP_JRP:
+    if (!in_section(al, d.operand) || al->written[d.operand - al->section->org])
+      *unknown = true;
+    else if (d.opcode == OP_JMP)
+      targets[n++] = value_at(al, d.operand) + 1;
+    else
+      targets[n++] = addr + value_at(al, d.operand) + 1;
+    break;
+  case OP_SKN:
+    targets[n++] = addr + 1;
+    targets[n++] = addr + 2;
+    break;
+  case OP_HLT:
+    break;
+  default:
+    targets[n++] = addr + 1;
+    break;
+  }
+
+  for (i = 0; i < n; i++)
+    if (in_section(al, targets[i]) && al->instr[targets[i] - al->section->org])
+      next[m++] = targets[i] - al->section->org;
+  return m;
+}
+
+static int build_flow(struct alloc *al, const struct asm_abstract *records,
+                      size_t n_records) {
+  const struct section *section = al->section;
+  addr_t len = section->length;
+  addr_t *fill = NULL;
+  addr_t next[2];
+  addr_t pos, target;
+  bool unknown;
+  size_t i;
+  int n, j;
+
+  for (i = 0; i < n_records; i++) {
+    const struct asm_abstract *r = records + i;
+
+    if (r->flags & HAS_INSTR && r->mnemonic && r->mnemonic->type == M_INSTR &&
+        in_section(al, r->addr))
+      al->instr[r->addr - section->org] = true;
+  }
+
+  /* Any data word might hold an address that a JMP goes through */
+  for (pos = 0; pos < len; pos++) {
+    struct arch_decoded d = arch_decode(value_at(al, section->org + pos));
+
+    if (!al->instr[pos]) {
+      target = value_at(al, section->org + pos) + 1;
+      if (in_section(al, target))
+        al->entry[target - section->org] = true;
+    } else if (d.opcode == OP_STO && in_section(al, d.operand)) {
+      al->written[d.operand - section->org] = true;
+    }
+  }
+
+  al->pred_start = calloc(len + 1, sizeof *al->pred_start);
+  al->preds = calloc(len * 2 + 1, sizeof *al->preds);
+  al->unknown = calloc(len + 1, sizeof *al->unknown);
+  fill = calloc(len + 1, sizeof *fill);
+  if (al->pred_start == NULL || al->preds == NULL || al->unknown == NULL ||
+      fill == NULL) {
+    free(fill);
+    return -1;
+  }
+
+  for (pos = 0; pos < len; pos++) {
+    if (!al->instr[pos])
+      continue;
+    n = successors(al, pos, next, &unknown);
+    for (j = 0; j < n; j++)
+      al->pred_start[next[j] + 1]++;
+    if (unknown)
+      al->unknown[al->n_unknown++] = pos;
+  }
+  for (pos = 0; pos < len; pos++)
+    al->pred_start[pos + 1] += al->pred_start[pos];
+
+  memcpy(fill, al->pred_start, len * sizeof *fill);
+  for (pos = 0; pos < len; pos++) {
+    if (!al->instr[pos])
+      continue;
+    n = successors(al, pos, next, &unknown);
+    for (j = 0; j < n; j++)
+      al->preds[fill[next[j]]++] = pos;
+  }
+  free(fill);
+  return 0;
+}
+
+static int occupy(struct alloc *al, addr_t pos, int temp) {
+  if (al->n_occ == al->occ_sz) {
+    al->occ_sz = (al->occ_sz == 0) ? 64 : al->occ_sz << 1;
+    al->occ = realloc(al->occ, sizeof *al->occ * al->occ_sz);
+    if (al->occ == NULL)
+      return -1;
+  }
+  al->occ[al->n_occ++] = (struct occupant) { pos, temp };
+  return 0;
+}
+
+/* Walk back from the reads of 'temp' at the 'n_refs' words in 'refs' to
+ * find where it is live. 'stamp' marks the words already visited for
+ * this temporary, so each is pushed on 'stack' at most once. */
+static int find_live(struct alloc *al, int temp, const addr_t *refs, size_t n_refs,
+                     int *stamp, addr_t *stack) {
+  size_t depth = 0;
+  addr_t pos, p;
+  addr_t i, n;
+  size_t u;
+
+  for (u = 0; u < n_refs; u++) {
+    pos = refs[u];
+    if (stamp[pos] == temp + 1)
+      continue;
+    stamp[pos] = temp + 1;
+    if (occupy(al, pos, temp) != 0)
+      return -1;
+    if (al->access[pos] == ACC_READ)
+      stack[depth++] = pos;
+  }
+
+  while (depth > 0) {
+    pos = stack[--depth];
+    n = al->pred_start[pos + 1] - al->pred_start[pos];
+    for (i = 0; i < n + (al->entry[pos] ? al->n_unknown : 0); i++) {
+      p = i < n ? al->preds[al->pred_start[pos] + i] : al->unknown[i - n];
+      if (stamp[p] == temp + 1)
+        continue;
+      stamp[p] = temp + 1;
+      if (occupy(al, p, temp) != 0)
+        return -1;
+      if (al->temp_at[p] != temp || al->access[p] != ACC_WRITE)
+        stack[depth++] = p;
+    }
+  }
+  return 0;
+}
+
+static int occ_by_pos(const void *a, const void *b) {
+  const struct occupant *oa = (const struct occupant *) a;
+  const struct occupant *ob = (const struct occupant *) b;
+
+  return oa->pos != ob->pos ? (oa->pos < ob->pos ? -1 : 1) :
+                              (oa->temp > ob->temp) - (oa->temp < ob->temp);
+}
+
+static int occ_by_temp(const void *a, const void *b) {
+  const struct occupant *oa = (const struct occupant *) a;
+  const struct occupant *ob = (const struct occupant *) b;
+
+  return oa->temp != ob->temp ? (oa->temp < ob->temp ? -1 : 1) :
+                                (oa->pos > ob->pos) - (oa->pos < ob->pos);
+}
+
+/* Colour the temporaries in order, each with the lowest line that no
+ * temporary it meets already has. Temporaries with a line of their own
+ * take the first lines. */
+static int colour(struct alloc *al, int n_temps, const bool *pinned, int *slot) {
+  struct occupant *by_temp = NULL;
+  size_t *first = NULL;
+  int *taken = NULL;
+  int n_pinned = 0;
+  int lines = 0;
+  size_t i, j, lo, hi;
+  int k, c;
+
+  for (k = 0; k < n_temps; k++)
+    if (pinned[k])
+      slot[k] = n_pinned++;
+  lines = n_pinned;
+
+  if (al->n_occ > 0)
+    qsort(al->occ, al->n_occ, sizeof *al->occ, occ_by_pos);
+  by_temp = calloc(al->n_occ + 1, sizeof *by_temp);
+  first = calloc(al->section->length + 1, sizeof *first);
+  taken = calloc(n_temps + 1, sizeof *taken);
+  if (by_temp == NULL || first == NULL || taken == NULL) {
+    lines = -1;
+    goto finish;
+  }
+  memcpy(by_temp, al->occ, al->n_occ * sizeof *by_temp);
+  if (al->n_occ > 0)
+    qsort(by_temp, al->n_occ, sizeof *by_temp, occ_by_temp);
+
+  /* Index the occupants of each word */
+  for (i = al->n_occ; i > 0; i--)
+    first[al->occ[i - 1].pos] = i - 1;
+
+  for (i = 0; i < al->n_occ; i = j) {
+    k = by_temp[i].temp;
+    for (j = i; j < al->n_occ && by_temp[j].temp == k; j++) {
+      for (lo = first[by_temp[j].pos], hi = lo;
+           hi < al->n_occ && al->occ[hi].pos == by_temp[j].pos; hi++)
+        if (al->occ[hi].temp != k && slot[al->occ[hi].temp] != -1)
+          taken[slot[al->occ[hi].temp]] = k + 1;
+    }
+    if (pinned[k])
+      continue;
+    for (c = n_pinned; c < lines && taken[c] == k + 1; c++);
+    slot[k] = c;
+    if (c == lines)
+      lines++;
+  }
+
+finish:
+  free(by_temp);
+  free(first);
+  free(taken);
+  return lines;
+}
+
+int asm_alloc_temps(const struct section *section,
+                    const struct asm_abstract *records, size_t n_records,
+                    const struct asm_temp_use *uses, size_t n_uses,
+                    int n_temps, int *slot) {
+  struct alloc al = { .section = section };
+  addr_t len = section->length;
+  size_t *ref_start = NULL;
+  addr_t *refs = NULL;
+  size_t *fill = NULL;
+  addr_t *stack = NULL;
+  bool *pinned = NULL;
+  int *stamp = NULL;
+  struct arch_decoded d;
+  addr_t pos;
+  size_t u;
+  int lines = -1;
+  int k;
+
+  for (k = 0; k < n_temps; k++)
+    slot[k] = -1;
+
+  al.instr = calloc(len + 1, sizeof *al.instr);
+  al.written = calloc(len + 1, sizeof *al.written);
+  al.entry = calloc(len + 1, sizeof *al.entry);
+  al.temp_at = calloc(len + 1, sizeof *al.temp_at);
+  al.access = calloc(len + 1, sizeof *al.access);
+  stamp = calloc(len + 1, sizeof *stamp);
+  stack = calloc(len + 1, sizeof *stack);
+  pinned = calloc(n_temps + 1, sizeof *pinned);
+  ref_start = calloc(n_temps + 1, sizeof *ref_start);
+  fill = calloc(n_temps + 1, sizeof *fill);
+  refs = calloc(n_uses + 1, sizeof *refs);
+  if (al.instr == NULL || al.written == NULL || al.entry == NULL ||
+      al.temp_at == NULL || al.access == NULL || stamp == NULL ||
+      stack == NULL || pinned == NULL || ref_start == NULL || fill == NULL ||
+      refs == NULL || build_flow(&al, records, n_records) != 0)
+    goto finish;
+
+  for (pos = 0; pos < len; pos++)
+    al.temp_at[pos] = -1;
+
+  for (u = 0; u < n_uses; u++) {
+    pos = uses[u].addr - section->org;
+    d = arch_decode(value_at(&al, uses[u].addr));
+    al.temp_at[pos] = uses[u].temp;
+    if (!al.instr[pos] || d.opcode == OP_JMP || d.opcode == OP_JRP)
+      al.access[pos] = ACC_PIN;
+    else if (d.opcode == OP_STO)
+      al.access[pos] = ACC_WRITE;
+    else
+      al.access[pos] = ACC_READ;
+    if (al.access[pos] == ACC_PIN)
+      pinned[uses[u].temp] = true;
+    ref_start[uses[u].temp + 1]++;
+  }
+
+  /* Group the words by the temporary they refer to */
+  for (k = 0; k < n_temps; k++)
+    ref_start[k + 1] += ref_start[k];
+  memcpy(fill, ref_start, n_temps * sizeof *fill);
+  for (u = 0; u < n_uses; u++)
+    refs[fill[uses[u].temp]++] = uses[u].addr - section->org;
+
+  for (k = 0; k < n_temps; k++)
+    if (!pinned[k] &&
+        find_live(&al, k, refs + ref_start[k], ref_start[k + 1] - ref_start[k],
+                  stamp, stack) != 0)
+      goto finish;
+
+  lines = colour(&al, n_temps, pinned, slot);
+
+finish:
+  free(al.instr);
+  free(al.written);
+  free(al.entry);
+  free(al.unknown);
+  free(al.pred_start);
+  free(al.preds);
+  free(al.temp_at);
+  free(al.access);
+  free(al.occ);
+  free(stamp);
+  free(stack);
+  free(pinned);
+  free(ref_start);
+  free(fill);
+  free(refs);
+  return lines;
+}
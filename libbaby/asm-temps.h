@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Allocation of store lines to temporaries. */
+
+#ifndef LIBBABY_ASM_TEMPS_H
+#define LIBBABY_ASM_TEMPS_H
+
+#include <stddef.h>
+
+#include "arch.h"
+#include "section.h"
+
+struct asm_abstract;
+
+/* Types */
+
+struct asm_temp_use {
+  addr_t addr;       /* word whose operand is the temporary */
+  int temp;
+};
+
+/* Public functions */
+
+/* Give each of 'n_temps' temporaries a store line, sharing lines between
+ * temporaries that are never live at the same time. 'section' is the
+ * program as assembled from 'records' and 'uses' lists every word that
+ * refers to a temporary. Sets slot[k] to the line for temporary k,
+ * counting from zero, or -1 if nothing refers to it, and returns the
+ * number of lines needed or -1 if out of memory. */
+extern int asm_alloc_temps(const struct section *section,
+                           const struct asm_abstract *records, size_t n_records,
+                           const struct asm_temp_use *uses, size_t n_uses,
+                           int n_temps, int *slot);
+
+#endif
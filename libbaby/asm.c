@@ -22,7 +22,27 @@
 #include "asm.h"
 #include "asm-ast.h"
 
-struct strtab *strtab_src;
+struct asm_ctx *asm_ctx_create(void) {
+  struct asm_ctx *ctx = calloc(1, sizeof *ctx);
+
+  if (ctx == NULL)
+    return NULL;
+  ctx->strtab = strtab_create();
+  if (ctx->strtab == NULL) {
+    free(ctx);
+    return NULL;
+  }
+  ctx->root = sym_root_create(ctx->strtab);
+  return ctx;
+}
+
+void asm_ctx_destroy(struct asm_ctx *ctx) {
+  if (ctx == NULL)
+    return;
+  sym_context_destroy(ctx->root);
+  strtab_destroy(ctx->strtab);
+  free(ctx);
+}
 
 void asm_log_abstract(struct strtab *strtab,
                       struct asm_abstract *abstract) {
@@ -47,6 +67,9 @@ size_t mnemonic_debug_str(char *buf, size_t sz, struct mnemonic *mnemonic) {
   case M_DIRECTIVE:
     return snprintf(buf, sz, "%-10s %d", "DIRECTIVE",
                     mnemonic->dir);
+  case M_PSEUDO:
+    return snprintf(buf, sz, "%-10s %d", "PSEUDO",
+                    mnemonic->pseudo);
   case M_MACRO:
     return snprintf(buf, sz, "%-10s %zd stmts %zd operands", "MACRO",
                     ast_count_list(mnemonic->ast->v.tuple[1]),
@@ -18,14 +18,33 @@
 #define HAS_LABEL 02
 #define HAS_INSTR 04
 
-#define SSTR(x) strtab_get(strtab_src, x)
-#define SSTRP(x) strtab_put(strtab_src, x)
+/* Names of a context 'c', which may be an asm_ctx or a sym_context */
+#define SSTR(c, x) strtab_get((c)->strtab, x)
+#define SSTRP(c, x) strtab_put((c)->strtab, x)
 
 /* Types */
 
+/* Everything one assembly needs that outlives a single source. Programs
+ * may be assembled concurrently in different contexts. */
+struct asm_ctx {
+  struct strtab *strtab;
+  struct sym_context *root;
+  int verbose;
+};
+
 struct source_public {
   char *path;
   char *leaf;
+  struct strtab *strtab;               /* where the scanner puts names */
+};
+
+/* Where a macro was applied, by the site it was itself expanded at */
+struct asm_site {
+  const struct asm_site *caller;       /* or NULL if applied in a source */
+  struct source_public *source;
+  int line;
+  str_idx_t macro;
+  int id;                              /* counting from 1 */
 };
 
 struct asm_abstract {
@@ -33,18 +52,22 @@ struct asm_abstract {
   int flags;
   int n_operands;
   addr_t org;
+  addr_t addr;                         /* where it is laid out */
   struct symref label;
   struct symref instr;
+  const struct mnemonic *mnemonic;     /* resolved when parsed */
   struct ast_node *operands;
   num_t opr_effective;
   struct source_public *source;
   int line;
+  const struct asm_site *site;         /* expanded at, or NULL */
 };
 
-extern struct strtab *strtab_src;
-
 /* Public functions */
 
+extern struct asm_ctx *asm_ctx_create(void);
+extern void asm_ctx_destroy(struct asm_ctx *ctx);
+
 extern void asm_log_abstract(struct strtab *strtab, struct asm_abstract *abstract);
 extern size_t mnemonic_debug_str(char *buf, size_t sz, struct mnemonic *mnemonic);
 
@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Relocatable object files.
+ *
+ * Objects are text, one record per line:
+ *
+ *   bobj 2
+ *   section abs|rel ORG LENGTH
+ *   word OFFSET VALUE
+ *   symbol NAME abs|rel VALUE global|local
+ *   reloc OFFSET word|operand NAME|-
+ *
+ * Numbers are hexadecimal. Every word of the section is given, in order
+ * when written, though they are read in any order.
+ * A relocation target of '-' stands for the start of the section.
+ * Version 1 objects have no symbol binding and export every symbol. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "butils.h"
+#include "arch.h"
+#include "section.h"
+#include "bobj.h"
+
+#define BOBJ_SECTION_BASE "-"
+
+static const char *field_names[] = {
+  [ BOBJ_FIELD_WORD ] = "word",
+  [ BOBJ_FIELD_OPERAND ] = "operand",
+};
+
+int bobj_add_symbol(struct bobj *obj, const char *name, bool relative, bool global, word_t value) {
+  if (obj->n_symbols == obj->symbols_sz) {
+    obj->symbols_sz = (obj->symbols_sz == 0) ? 32 : obj->symbols_sz << 1;
+    obj->symbols = realloc(obj->symbols, sizeof obj->symbols[0] * obj->symbols_sz);
+    if (obj->symbols == NULL)
+      return errno;
+  }
+  obj->symbols[obj->n_symbols++] = (struct bobj_symbol) {
+    .name = strdup(name),
+    .relative = relative,
+    .global = global,
+    .value = value,
+  };
+  return 0;
+}
+
+int bobj_add_reloc(struct bobj *obj, addr_t offset, enum bobj_field field, const char *target) {
+  if (obj->n_relocs == obj->relocs_sz) {
+    obj->relocs_sz = (obj->relocs_sz == 0) ? 64 : obj->relocs_sz << 1;
+    obj->relocs = realloc(obj->relocs, sizeof obj->relocs[0] * obj->relocs_sz);
+    if (obj->relocs == NULL)
+      return errno;
+  }
+  obj->relocs[obj->n_relocs++] = (struct bobj_reloc) {
+    .offset = offset,
+    .field = field,
+    .target = target ? strdup(target) : NULL,
+  };
+  return 0;
+}
+
+int bobj_write(const char *path, const struct bobj *obj) {
+  const struct section *section = &obj->section;
+  FILE *file;
+  addr_t a;
+  size_t i;
+  int rc = 0;
+
+  if (strcmp(path, "-")) {
+    file = fopen(path, "w");
+    if (file == NULL) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return EHANDLED;
+    }
+  } else {
+    file = stdout;
+  }
+
+  fprintf(file, "%s %d\n", BOBJ_MAGIC, BOBJ_VERSION);
+  fprintf(file, "section %s %08x %08x\n", obj->absolute ? "abs" : "rel",
+          section->org, section->length);
+  for (a = 0; a < section->length; a++)
+    fprintf(file, "word %08x %08x\n", a, section_get(section, section->org + a));
+  for (i = 0; i < obj->n_symbols; i++)
+    fprintf(file, "symbol %s %s %08x %s\n", obj->symbols[i].name,
+            obj->symbols[i].relative ? "rel" : "abs", obj->symbols[i].value,
+            obj->symbols[i].global ? "global" : "local");
+  for (i = 0; i < obj->n_relocs; i++)
+    fprintf(file, "reloc %08x %s %s\n", obj->relocs[i].offset,
+            field_names[obj->relocs[i].field],
+            obj->relocs[i].target ? obj->relocs[i].target : BOBJ_SECTION_BASE);
+
+  if (ferror(file))
+    rc = errno;
+  if (file != stdout)
+    fclose(file);
+  else
+    fflush(file);
+
+  return rc;
+}
+
+int bobj_read(const char *path, struct bobj *obj) {
+  size_t linesz = 0;
+  char *line = NULL;
+  addr_t length = 0;
+  addr_t words = 0;
+  int version = 0;
+  int lineno;
+  FILE *file;
+  size_t i;
+  int rc = 0;
+
+  memset(obj, '\0', sizeof *obj);
+  obj->path = path;
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return EHANDLED;
+  }
+
+  for (lineno = 1; rc == 0 && getline(&line, &linesz, file) != -1; lineno++) {
+    char *name = NULL;
+    char kind[8];
+    char binding[8];
+    unsigned int a, b;
+    int fields;
+
+    if (lineno == 1) {
+      if (sscanf(line, BOBJ_MAGIC " %d", &version) != 1 ||
+          version < 1 || version > BOBJ_VERSION)
+        rc = EINVAL;
+    } else if (sscanf(line, "section %7s %x %x", kind, &a, &b) == 3) {
+      obj->absolute = !strcmp(kind, "abs");
+      obj->section.org = obj->section.cursor = a;
+      length = b;
+    } else if (sscanf(line, "word %x %x", &a, &b) == 2) {
+      obj->section.cursor = obj->section.org + a;
+      rc = put_word(&obj->section, b, NULL);
+      if (rc == EEXIST)
+        rc = EINVAL;
+      else if (rc == 0)
+        words++;
+    } else if ((fields = sscanf(line, "symbol %ms %7s %x %7s",
+                                &name, kind, &a, binding)) >= 3) {
+      if (fields == 3 && version > 1)
+        rc = EINVAL;
+      else
+        rc = bobj_add_symbol(obj, name, !strcmp(kind, "rel"),
+                             fields == 3 || !strcmp(binding, "global"), a);
+    } else if (sscanf(line, "reloc %x %7s %ms", &a, kind, &name) == 3) {
+      rc = bobj_add_reloc(obj, a,
+                          !strcmp(kind, field_names[BOBJ_FIELD_OPERAND]) ?
+                          BOBJ_FIELD_OPERAND : BOBJ_FIELD_WORD,
+                          strcmp(name, BOBJ_SECTION_BASE) ? name : NULL);
+    } else {
+      rc = EINVAL;
+    }
+    free(name);
+  }
+
+  if (rc == 0 && ferror(file))
+    rc = errno;
+  if (rc == 0 && (obj->section.length != length || words != length))
+    rc = EINVAL;
+  for (i = 0; rc == 0 && i < obj->n_relocs; i++)
+    if (obj->relocs[i].offset >= length)
+      rc = EINVAL;
+  if (rc == EINVAL) {
+    fprintf(stderr, "%s:%d: malformed object\n", path, lineno - 1);
+    rc = EHANDLED;
+  }
+
+  free(line);
+  fclose(file);
+
+  return rc;
+}
+
+void bobj_free(struct bobj *obj) {
+  size_t i;
+
+  for (i = 0; i < obj->n_symbols; i++)
+    free(obj->symbols[i].name);
+  for (i = 0; i < obj->n_relocs; i++)
+    free(obj->relocs[i].target);
+  free(obj->symbols);
+  free(obj->relocs);
+  section_free(&obj->section);
+  memset(obj, '\0', sizeof *obj);
+}
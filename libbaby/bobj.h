@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Relocatable object files. */
+
+#ifndef LIBBABY_BOBJ_H
+#define LIBBABY_BOBJ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arch.h"
+#include "section.h"
+
+#define BOBJ_MAGIC "bobj"
+#define BOBJ_VERSION 2
+
+/* Types */
+
+enum bobj_field {
+  BOBJ_FIELD_WORD,
+  BOBJ_FIELD_OPERAND,
+};
+
+struct bobj_symbol {
+  char *name;
+  bool relative;
+  bool global;             /* exported to other objects */
+  word_t value;
+};
+
+/* Add the address of the target, or of the section if there is no
+ * target, to a field of the word at an offset into the section. The
+ * word already holds the addend. */
+struct bobj_reloc {
+  addr_t offset;
+  enum bobj_field field;
+  char *target;
+};
+
+struct bobj {
+  const char *path;
+  bool absolute;
+  struct section section;
+  struct bobj_symbol *symbols;
+  size_t n_symbols;
+  size_t symbols_sz;
+  struct bobj_reloc *relocs;
+  size_t n_relocs;
+  size_t relocs_sz;
+};
+
+/* Public functions */
+
+extern int bobj_add_symbol(struct bobj *obj, const char *name, bool relative, bool global, word_t value);
+extern int bobj_add_reloc(struct bobj *obj, addr_t offset, enum bobj_field field, const char *target);
+extern int bobj_write(const char *path, const struct bobj *obj);
+extern int bobj_read(const char *path, struct bobj *obj);
+extern void bobj_free(struct bobj *obj);
+
+/* Apply a relocation to a word, given the address of its target. */
+static inline word_t bobj_relocate(word_t word, enum bobj_field field, addr_t target) {
+  if (field == BOBJ_FIELD_OPERAND)
+    return (word & ~OPERAND_MASK) | ((word + (target << OPERAND_POS)) & OPERAND_MASK);
+  else
+    return word + target;
+}
+
+#endif
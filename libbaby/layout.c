@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Placement of regions, such as sections, in the store.
+ *
+ * The lines in use are kept as a sorted array of disjoint intervals, so
+ * that a clash or the next free lines are found by binary search. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "layout.h"
+
+void layout_init(struct layout *layout, addr_t size) {
+  memset(layout, '\0', sizeof *layout);
+  layout->size = size;
+}
+
+void layout_free(struct layout *layout) {
+  free(layout->used);
+  memset(layout, '\0', sizeof *layout);
+}
+
+/* Index of the first interval ending after 'line' */
+static int layout_find(const struct layout *layout, addr_t line) {
+  int lo = 0;
+  int hi = layout->n_used;
+  int mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (layout->used[mid].end <= line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void layout_insert(struct layout *layout, int k,
+                          addr_t start, addr_t end, int owner) {
+  if (layout->n_used == layout->used_sz) {
+    layout->used_sz = (layout->used_sz == 0) ? 16 : layout->used_sz << 1;
+    layout->used = realloc(layout->used, sizeof *layout->used * layout->used_sz);
+    if (layout->used == NULL) {
+      perror("allocating layout");
+      exit(1);
+    }
+  }
+  memmove(layout->used + k + 1, layout->used + k,
+          (layout->n_used - k) * sizeof *layout->used);
+  layout->used[k] = (struct layout_interval) { start, end, owner };
+  layout->n_used++;
+}
+
+static void layout_remove(struct layout *layout, addr_t start) {
+  int k = layout_find(layout, start);
+
+  memmove(layout->used + k, layout->used + k + 1,
+          (layout->n_used - k - 1) * sizeof *layout->used);
+  layout->n_used--;
+}
+
+int layout_reserve(struct layout *layout, addr_t start, addr_t end,
+                   int owner, int *clash) {
+  int k = layout_find(layout, start);
+
+  if (start == end)
+    return 0;
+  if (k < layout->n_used && layout->used[k].start < end) {
+    *clash = layout->used[k].owner;
+    return EEXIST;
+  }
+  layout_insert(layout, k, start, end, owner);
+  return 0;
+}
+
+static uint64_t align_up(uint64_t line, addr_t align) {
+  return align > 1 ? (line + align - 1) / align * align : line;
+}
+
+/* Find the lowest line at or after 'from' where a region fits. */
+static bool layout_fit(const struct layout *layout,
+                       const struct layout_region *region,
+                       addr_t from, addr_t *start) {
+  uint64_t limit = region->high ? region->high : layout->size;
+  uint64_t line = align_up(from > region->low ? from : region->low, region->align);
+  int k = layout_find(layout, line);
+
+  if (limit > layout->size)
+    limit = layout->size;
+  for (; k < layout->n_used && line + region->length > layout->used[k].start; k++)
+    if (layout->used[k].end > line)
+      line = align_up(layout->used[k].end, region->align);
+  if (line + region->length > limit)
+    return false;
+  *start = line;
+  return true;
+}
+
+static void layout_put(struct layout *layout, struct layout_region *regions,
+                       int i, addr_t start) {
+  regions[i].start = start;
+  regions[i].placed = true;
+  if (regions[i].length > 0)
+    layout_insert(layout, layout_find(layout, start),
+                  start, start + regions[i].length, i);
+}
+
+static void layout_take(struct layout *layout, struct layout_region *regions, int i) {
+  regions[i].placed = false;
+  if (regions[i].length > 0)
+    layout_remove(layout, regions[i].start);
+}
+
+/* Place regions in the given order each at the lowest line it fits,
+ * leaving those that do not fit unplaced. */
+static bool layout_first_fit(struct layout *layout, struct layout_region *regions,
+                             const int *order, int n) {
+  bool ok = true;
+  addr_t start;
+  int k;
+
+  for (k = 0; k < n; k++) {
+    if (layout_fit(layout, regions + order[k], 0, &start))
+      layout_put(layout, regions, order[k], start);
+    else
+      ok = false;
+  }
+  return ok;
+}
+
+static void layout_unplace(struct layout *layout, struct layout_region *regions,
+                           const int *order, int n) {
+  int k;
+
+  for (k = 0; k < n; k++)
+    if (regions[order[k]].placed)
+      layout_take(layout, regions, order[k]);
+}
+
+static addr_t layout_free_lines(const struct layout *layout) {
+  addr_t used = 0;
+  int k;
+
+  for (k = 0; k < layout->n_used && layout->used[k].start < layout->size; k++)
+    used += (layout->used[k].end < layout->size ? layout->used[k].end : layout->size) -
+            layout->used[k].start;
+  return layout->size - used;
+}
+
+static bool layout_alike(const struct layout_region *a, const struct layout_region *b) {
+  return a->length == b->length && a->align == b->align &&
+         a->low == b->low && a->high == b->high;
+}
+
+/* Try every placement of the regions from the k'th on, depth first. A
+ * region like the one before it goes after it, since swapping them would
+ * give the same layout. */
+static bool layout_search(struct layout *layout, struct layout_region *regions,
+                          const int *order, int n, int k, uint64_t need,
+                          long *steps) {
+  struct layout_region *region;
+  addr_t from = 0;
+  addr_t start;
+
+  if (k == n)
+    return true;
+  if (layout_free_lines(layout) < need)
+    return false;
+
+  region = regions + order[k];
+  if (k > 0 && layout_alike(regions + order[k - 1], region))
+    from = regions[order[k - 1]].start + 1;
+
+  for (; layout_fit(layout, region, from, &start); from = start + 1) {
+    if (++*steps > LAYOUT_SEARCH_STEPS)
+      return false;
+    layout_put(layout, regions, order[k], start);
+    if (layout_search(layout, regions, order, n, k + 1, need - region->length, steps))
+      return true;
+    layout_take(layout, regions, order[k]);
+  }
+  return false;
+}
+
+int layout_place(struct layout *layout, struct layout_region *regions,
+                 int n, int *clash) {
+  uint64_t need = 0;
+  long steps = 0;
+  int *order;
+  int i, j, k;
+  int m = 0;
+  int rc;
+
+  for (i = 0; i < n; i++) {
+    regions[i].placed = false;
+    if (!regions[i].fixed)
+      continue;
+    rc = layout_reserve(layout, regions[i].start,
+                        regions[i].start + regions[i].length, i, clash);
+    if (rc != 0)
+      return rc;
+    regions[i].placed = true;
+  }
+
+  order = calloc(n + 1, sizeof *order);
+  if (order == NULL)
+    return errno;
+  for (i = 0; i < n; i++) {
+    if (!regions[i].fixed) {
+      order[m++] = i;
+      need += regions[i].length;
+    }
+  }
+
+  if (layout_first_fit(layout, regions, order, m))
+    goto done;
+  layout_unplace(layout, regions, order, m);
+
+  /* Longest first, keeping the order of those of the same length */
+  for (k = 1; k < m; k++) {
+    i = order[k];
+    for (j = k; j > 0 && regions[order[j - 1]].length < regions[i].length; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  if (layout_first_fit(layout, regions, order, m))
+    goto done;
+  layout_unplace(layout, regions, order, m);
+
+  if (layout_search(layout, regions, order, m, 0, need, &steps))
+    goto done;
+  layout_unplace(layout, regions, order, m);
+
+  /* Leave what does fit placed so that the rest can be reported */
+  layout_first_fit(layout, regions, order, m);
+  free(order);
+  return ENOSPC;
+
+done:
+  free(order);
+  return 0;
+}
+
+bool layout_next_free(const struct layout *layout, addr_t from,
+                      addr_t *start, addr_t *end) {
+  int k = layout_find(layout, from);
+
+  for (; k < layout->n_used && layout->used[k].start <= from; k++)
+    from = layout->used[k].end;
+  if (from >= layout->size)
+    return false;
+  *start = from;
+  *end = k < layout->n_used && layout->used[k].start < layout->size ?
+         layout->used[k].start : layout->size;
+  return true;
+}
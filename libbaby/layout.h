@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Placement of regions, such as sections, in the store. */
+
+#ifndef LIBBABY_LAYOUT_H
+#define LIBBABY_LAYOUT_H
+
+#include <stdbool.h>
+
+#include "arch.h"
+
+/* Constants */
+
+/* Most candidate placements tried by the exact search before giving up */
+#define LAYOUT_SEARCH_STEPS (1 << 20)
+
+/* Types */
+
+struct layout_region {
+  addr_t length;
+  addr_t align;            /* start is a multiple of this, if not 0 */
+  addr_t low;              /* lowest line it may occupy */
+  addr_t high;             /* line after the highest, 0 for the store end */
+  bool fixed;              /* to be placed at 'start' */
+  bool placed;
+  addr_t start;
+};
+
+/* Lines in use, from 'start' up to but not including 'end' */
+struct layout_interval {
+  addr_t start;
+  addr_t end;
+  int owner;
+};
+
+/* The lines in use in a store of 'size' lines, sorted by address */
+struct layout {
+  addr_t size;
+  struct layout_interval *used;
+  int n_used;
+  int used_sz;
+};
+
+/* Public functions */
+
+extern void layout_init(struct layout *layout, addr_t size);
+extern void layout_free(struct layout *layout);
+
+/* Mark lines as used by 'owner'. If any are already in use, EEXIST is
+ * returned and the owner of the first such line put in 'clash'. */
+extern int layout_reserve(struct layout *layout, addr_t start, addr_t end,
+                          int owner, int *clash);
+
+/* Place the 'n' regions, the owners of their lines being their indices.
+ * Fixed regions must not overlap anything. The rest go, in order, at the
+ * lowest line where they fit or, if that fails, are packed first fit
+ * decreasing and, failing that, by a search of every placement. ENOSPC is
+ * returned if no placement is found, with the unplaced regions marked. */
+extern int layout_place(struct layout *layout, struct layout_region *regions,
+                        int n, int *clash);
+
+/* Find the first free lines at or after 'from', returning false if there
+ * are none before the end of the store. */
+extern bool layout_next_free(const struct layout *layout, addr_t from,
+                             addr_t *start, addr_t *end);
+
+#endif
@@ -6,10 +6,10 @@ d=lib$(this)
 
 $(d)_YACC=asm-parse.y
 $(d)_LEX=asm-lex.l
-$(d)_SRC=arch.c asm.c writer.c section.c loader.c objfile.c memory.c segment.c symbols.c asm-ast.c strtab.c
+$(d)_SRC=arch.c asm.c writer.c section.c loader.c objfile.c memory.c segment.c symbols.c asm-ast.c asm-cache.c asm-peephole.c asm-gc.c asm-temps.c asm-mulc.c asm-outline.c asm-build.c lines.c layout.c srcbuf.c strtab.c bobj.c wcet.c
 $(d)_OBJ=$($(d)_SRC:.c=.o) $($(d)_YACC:.y=.o) $($(d)_LEX:.l=.o)
 $(d)_DEP=$($(d)_SRC:.c=.d)
-$(d)_GENERATED=$($(d)_YACC:.y=.c) $($(d)_YACC:.y=.h) $($(d)_LEX:.l=.c)
+$(d)_GENERATED=$($(d)_YACC:.y=.c) $($(d)_YACC:.y=.h) $($(d)_LEX:.l=.c) arch-tables.h mkarch loader-scan.h mkscan
 
 SUBDIRS+=$(d)
 LIBS+=$(this)
@@ -17,7 +17,24 @@ LIBS+=$(this)
 %.c %.h: %.y
 	$(YACC.y) -o$(<:.y=.c) --defines=$(<:.y=.h) $<
 
-$(d)/asm-ast.o $(d)/asm.o: $(d)/asm-parse.h
+$(d)/asm-ast.o $(d)/asm.o $(d)/asm-cache.o $(d)/asm-mulc.o $(d)/asm-outline.o $(d)/asm-build.o: $(d)/asm-parse.h
+
+# Mnemonic tables are generated by a program run on the build host
+$(d)/mkarch: $(d)/mkarch.c $(d)/arch-mnemonics.def $(d)/arch.h
+	$(CC) $(BUILD_CFLAGS) -I$(dir $@) -o $@ $<
+
+$(d)/arch-tables.h: $(d)/mkarch
+	./$< > $@
+
+$(d)/arch.o: $(d)/arch-tables.h
+
+$(d)/mkscan: $(d)/mkscan.c
+	$(CC) $(BUILD_CFLAGS) -o $@ $<
+
+$(d)/loader-scan.h: $(d)/mkscan
+	./$< > $@
+
+$(d)/loader.o: $(d)/loader-scan.h
 
 $(d).a: $(addprefix $d/,$($(d)_OBJ))
 	$(AR) r $@ $^
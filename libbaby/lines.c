@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Source lines of assembled programs.
+ *
+ * A lines file records where each word of the store was assembled from,
+ * one record per line:
+ *
+ *   lines 1
+ *   file FILE PATH
+ *   site SITE CALLER FILE LINE MACRO
+ *   code|data ADDR FILE LINE SITE
+ *
+ * A site is an application of MACRO at LINE of FILE, itself expanded at
+ * site CALLER, and a word is expanded at SITE, so following the callers
+ * gives its macro expansion stack. Files and sites are numbered from 1
+ * and given before they are referred to; a site of 0 is none. Addresses
+ * are hexadecimal and only words put by the program are given. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "butils.h"
+#include "arch.h"
+#include "section.h"
+#include "asm.h"
+#include "lines.h"
+
+/* Largest store a program may be placed in, and most sites expected */
+#define LINES_MAX_WORDS 0x2000
+#define LINES_MAX_SITES 0x100000
+
+/* Numbers given to the sources and sites as they are first written */
+struct numbering {
+  const struct source_public **files;
+  int n_files;
+  int files_sz;
+  bool *sites;             /* written, by site id */
+  int sites_sz;
+};
+
+/* Make room for element 'i' of an array, zeroing any new elements */
+static void *grow(void *array, int *sz, int i, size_t elem) {
+  int new_sz;
+
+  if (i < *sz)
+    return array;
+  for (new_sz = (*sz == 0) ? 16 : *sz << 1; new_sz <= i; new_sz <<= 1);
+  array = realloc(array, new_sz * elem);
+  if (array == NULL) {
+    perror("allocating lines");
+    exit(1);
+  }
+  memset((char *) array + *sz * elem, '\0', (new_sz - *sz) * elem);
+  *sz = new_sz;
+  return array;
+}
+
+static int write_file(FILE *stream, struct numbering *n, const struct source_public *source) {
+  int i;
+
+  for (i = 0; i < n->n_files; i++)
+    if (n->files[i] == source)
+      return i + 1;
+  n->files = grow(n->files, &n->files_sz, n->n_files, sizeof *n->files);
+  n->files[n->n_files++] = source;
+  fprintf(stream, "file %d %s\n", n->n_files, source->path);
+  return n->n_files;
+}
+
+/* Write a site after the sites it was expanded at */
+static void write_site(FILE *stream, struct numbering *n, const struct asm_site *site) {
+  int file;
+
+  if (site == NULL || (site->id < n->sites_sz && n->sites[site->id]))
+    return;
+  n->sites = grow(n->sites, &n->sites_sz, site->id, sizeof *n->sites);
+  n->sites[site->id] = true;
+  write_site(stream, n, site->caller);
+  file = write_file(stream, n, site->source);
+  fprintf(stream, "site %d %d %d %d %s\n", site->id, site->caller ? site->caller->id : 0,
+          file, site->line, strtab_get(site->source->strtab, site->macro));
+}
+
+int lines_write(FILE *stream, const struct section *section) {
+  struct numbering n = { 0 };
+  const struct asm_abstract *r;
+  addr_t a;
+  int file;
+
+  fprintf(stream, LINES_MAGIC " %d\n", LINES_VERSION);
+  for (a = section->org; a < section->org + section->length; a++) {
+    r = section_debug(section, a);
+    if (r == NULL || r->source == NULL)
+      continue;
+    write_site(stream, &n, r->site);
+    file = write_file(stream, &n, r->source);
+    fprintf(stream, "%s %x %d %d %d\n",
+            r->mnemonic && r->mnemonic->type == M_INSTR ? "code" : "data",
+            a, file, r->line, r->site ? r->site->id : 0);
+  }
+
+  free(n.files);
+  free(n.sites);
+  return ferror(stream) ? EIO : 0;
+}
+
+int lines_read(const char *path, struct lines *lines) {
+  int files_sz = 0, sites_sz = 0, words_sz = 0;
+  size_t linesz = 0;
+  char *line = NULL;
+  int version = 0;
+  int lineno;
+  FILE *file;
+  int rc = 0;
+
+  memset(lines, '\0', sizeof *lines);
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return EHANDLED;
+  }
+
+  for (lineno = 1; rc == 0 && getline(&line, &linesz, file) != -1; lineno++) {
+    struct lines_site site = { 0 };
+    struct lines_word word = { 0 };
+    char *name = NULL;
+    char kind[8];
+    unsigned int a;
+    int id;
+
+    if (lineno == 1) {
+      if (sscanf(line, LINES_MAGIC " %d", &version) != 1 ||
+          version < 1 || version > LINES_VERSION)
+        rc = EINVAL;
+    } else if (sscanf(line, "file %d %m[^\n]", &id, &name) == 2) {
+      if (id != lines->n_files + 1) {
+        rc = EINVAL;
+      } else {
+        lines->files = grow(lines->files, &files_sz, id, sizeof *lines->files);
+        lines->files[id] = name;
+        lines->n_files = id;
+        name = NULL;
+      }
+    } else if (sscanf(line, "site %d %d %d %d %ms", &id, &site.caller,
+                      &site.file, &site.line, &site.macro) == 5) {
+      if (id < 1 || id > LINES_MAX_SITES ||
+          site.caller < 0 || site.caller > lines->n_sites ||
+          (site.caller != 0 && lines->sites[site.caller].file == 0) ||
+          site.file < 1 || site.file > lines->n_files) {
+        free(site.macro);
+        rc = EINVAL;
+      } else {
+        lines->sites = grow(lines->sites, &sites_sz, id, sizeof *lines->sites);
+        free(lines->sites[id].macro);
+        lines->sites[id] = site;
+        if (id > lines->n_sites)
+          lines->n_sites = id;
+      }
+    } else if (sscanf(line, "%7s %x %d %d %d", kind, &a,
+                      &word.file, &word.line, &word.site) == 5 &&
+               (!strcmp(kind, "code") || !strcmp(kind, "data"))) {
+      word.code = !strcmp(kind, "code");
+      if (a >= LINES_MAX_WORDS ||
+          word.file < 1 || word.file > lines->n_files ||
+          word.site < 0 || word.site > lines->n_sites ||
+          (word.site != 0 && lines->sites[word.site].file == 0)) {
+        rc = EINVAL;
+      } else {
+        lines->words = grow(lines->words, &words_sz, a, sizeof *lines->words);
+        lines->words[a] = word;
+        if (a >= lines->n_words)
+          lines->n_words = a + 1;
+      }
+    } else {
+      rc = EINVAL;
+    }
+    free(name);
+  }
+
+  if (rc == 0 && ferror(file))
+    rc = errno;
+  if (rc == 0 && version == 0)
+    rc = EINVAL;
+  if (rc == EINVAL) {
+    fprintf(stderr, "%s:%d: malformed lines\n", path, lineno - 1);
+    rc = EHANDLED;
+  }
+
+  free(line);
+  fclose(file);
+
+  if (rc != 0)
+    lines_free(lines);
+  return rc;
+}
+
+void lines_free(struct lines *lines) {
+  int i;
+
+  for (i = 1; i <= lines->n_files; i++)
+    free(lines->files[i]);
+  for (i = 1; i <= lines->n_sites; i++)
+    free(lines->sites[i].macro);
+  free(lines->files);
+  free(lines->sites);
+  free(lines->words);
+  memset(lines, '\0', sizeof *lines);
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Source lines of assembled programs. */
+
+#ifndef LIBBABY_LINES_H
+#define LIBBABY_LINES_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "arch.h"
+#include "section.h"
+
+#define LINES_MAGIC "lines"
+#define LINES_VERSION 1
+
+/* Types */
+
+/* An application of a macro */
+struct lines_site {
+  int caller;              /* site it was expanded at, or 0 */
+  int file;                /* 0 if no such site */
+  int line;
+  char *macro;
+};
+
+struct lines_word {
+  bool code;               /* an instruction rather than data */
+  int file;                /* 0 if no word of the program is here */
+  int line;
+  int site;                /* site it was expanded at, or 0 */
+};
+
+/* Files and sites are indexed by their numbers, which start at 1 */
+struct lines {
+  char **files;
+  int n_files;
+  struct lines_site *sites;
+  int n_sites;
+  struct lines_word *words;
+  addr_t n_words;
+};
+
+/* Public functions */
+
+/* Write where each word of a section with debug pointers came from */
+extern int lines_write(FILE *stream, const struct section *section);
+
+extern int lines_read(const char *path, struct lines *lines);
+extern void lines_free(struct lines *lines);
+
+#endif
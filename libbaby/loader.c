@@ -17,7 +17,6 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <regex.h>
 
 #include "arch.h"
 #include "segment.h"
@@ -26,43 +25,29 @@
 #include "binfmt.h"
 #include "loader.h"
 
-enum regex {
-  REG_SNP_IGNORE,
-  REG_SNP_STMT,
-  REG_PLAIN_BITS,
-  REG_MAX
-};
-
-#define SNP_COMMENT "[[:space:]]*(;.*)?$"
-
-static const char *regexes[] = {
-  "^" SNP_COMMENT,
-  "^([[:digit:]]+): ([01]{32})" SNP_COMMENT,
-  "^([01]{32})" SNP_COMMENT,
-};
-static regex_t regex[REG_MAX];
-
-int loaders_init(void) {
-  int rc;
-  int i;
-  char errbuf[256];
-
-  for (i = 0; i < REG_MAX; i++) {
-    rc = regcomp(regex + i, regexes[i], REG_EXTENDED);
-    if (rc != 0) {
-      regerror(rc, regex + i, errbuf, sizeof errbuf);
-      fprintf(stderr, "loaders_init: %s\n", errbuf);
-      return EINVAL;
-    }
+/* Line scanners generated by mkscan, matching the same as
+ *   SCAN_IGNORE  ^[[:space:]]*(;.*)?$
+ *   SCAN_SNP     ^([[:digit:]]+): ([01]{32})[[:space:]]*(;.*)?$
+ *   SCAN_BITS    ^([01]{32})[[:space:]]*(;.*)?$ */
+#include "loader-scan.h"
+
+/* Run a scanner over a line, collecting its address and its bits with
+ * the first as the most significant. */
+static bool scan(int state, const char *line, addr_t *addr, uword_t *bits) {
+  const unsigned char *p = (const unsigned char *) line;
+  const struct scan_step *step;
+
+  *addr = 0;
+  *bits = 0;
+  for (; state > SCAN_ACCEPT; p++) {
+    step = &scan_table[state][scan_classes[*p]];
+    if (step->action == SCAN_A_ADDR)
+      *addr = *addr * 10 + (*p - '0');
+    else if (step->action == SCAN_A_BIT)
+      *bits = *bits << 1 | (*p == '1');
+    state = step->next;
   }
-  return 0;
-}
-
-void loaders_finit(void) {
-  int i;
-
-  for (i = 0; i < REG_MAX; i++)
-    regfree(regex + i);
+  return state == SCAN_ACCEPT;
 }
 
 static int binary_stat(const struct loader *loader, struct object_file *file, struct segment *segment) {
@@ -120,9 +105,9 @@ static int bits_read(const struct loader *loader, struct object_file *file, stru
   ssize_t linelen;
   int lineno = 0;
   int rc = 0;
-  regmatch_t matches[4];
-  int n_matches = sizeof matches / sizeof *matches;
   addr_t max_addr = 0;
+  addr_t a;
+  uword_t bits;
   const bool strict = true;
   const bool ssem = loader->flags & BITS_SSEM;
   const bool snp = loader->flags & BITS_ADDR;
@@ -148,36 +133,23 @@ static int bits_read(const struct loader *loader, struct object_file *file, stru
       break;
     }
 
-    if (regexec(regex + (snp ? REG_SNP_STMT : REG_PLAIN_BITS), line, n_matches, matches, 0) == 0) {
-      addr_t a;
+    if (scan(snp ? SCAN_SNP : SCAN_BITS, line, &a, &bits)) {
       word_t v = 0;
       uword_t bit;
-      const char *vc;
-
-      if (matches[1].rm_so == -1 ||
-          (snp && matches[2].rm_so == -1)) {
-        rc = EINVAL;
-        break;
-      }
 
-      line[matches[1].rm_eo] = '\0';
       if (snp) {
-        line[matches[2].rm_eo] = '\0';
-        a = strtoul(line + matches[1].rm_so, NULL, 10);
         if (strict && a != max_addr) {
           fprintf(stderr, "non-sequential address %d != %d\n", a, max_addr);
           rc = EINVAL;
           break;
         }
-        vc = line + matches[2].rm_so;
       } else {
         a = max_addr;
-        vc = line + matches[1].rm_so;
       }
 
       if (vm != NULL) {
-        for (bit = ssem ? 1 : 0x80000000UL; bit != 0; bit = ssem ? bit << 1 : bit >> 1)
-          if (*vc++ == '1')
+        for (bit = ssem ? 1 : 0x80000000UL; bit != 0; bit = ssem ? bit << 1 : bit >> 1, bits <<= 1)
+          if (bits & 0x80000000UL)
             v |= bit;
 
         write_word(vm, segment->load_address + a, v);
@@ -185,7 +157,7 @@ static int bits_read(const struct loader *loader, struct object_file *file, stru
 
       max_addr = a + 1;
 
-    } else if (regexec(regex + REG_SNP_IGNORE, line, n_matches, matches, 0) == REG_NOMATCH) {
+    } else if (!scan(SCAN_IGNORE, line, &a, &bits)) {
       rc = EINVAL;
       break;
     }
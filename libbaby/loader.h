@@ -23,7 +23,4 @@ struct loader {
 
 extern const struct loader loaders[];
 
-extern int loaders_init(void);
-extern void loaders_finit(void);
-
 #endif
@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Generate the mnemonic tables for Manchester Baby at build time.
+ *
+ * The mnemonics in arch-mnemonics.def are written out sorted by name,
+ * together with a perfect hash of their names, ignoring case, and the
+ * mnemonics for each opcode in the order they are defined. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+
+#include "arch.h"
+
+/* Seeds tried for each table size before trying a bigger table */
+#define MAX_SEEDS 1000000
+
+#define NUM_OPCODES ((OPCODE_MASK >> OPCODE_POS) + 1)
+
+struct def {
+  const char *name;
+  const char *type;
+  const char *what;
+  int opcode;
+  int order;
+};
+
+static struct def defs[] = {
+#define INSTR(name, op) { #name, "M_INSTR", ".ins = &I_" #op, OP_##op },
+#define DIRECTIVE(name, dir) { #name, "M_DIRECTIVE", ".dir = D_" #dir, -1 },
+#define PSEUDO(name, p) { #name, "M_PSEUDO", ".pseudo = P_" #p, -1 },
+#include "arch-mnemonics.def"
+#undef INSTR
+#undef DIRECTIVE
+#undef PSEUDO
+};
+#define NUM_DEFS ((int) (sizeof defs / sizeof *defs))
+
+static int defcmp(const void *a, const void *b) {
+  return strcasecmp(((const struct def *) a)->name, ((const struct def *) b)->name);
+}
+
+/* The slot in baby_mnemonics of the order'th definition */
+static int sorted(int order) {
+  int i;
+
+  for (i = 0; defs[i].order != order; i++);
+  return i;
+}
+
+/* Find a seed for which no two names share a slot */
+static bool find_seed(int bits, uint32_t *seed, int *slots) {
+  uint32_t h;
+  int i;
+
+  for (*seed = 0; *seed < MAX_SEEDS; (*seed)++) {
+    for (i = 0; i < 1 << bits; i++)
+      slots[i] = -1;
+    for (i = 0; i < NUM_DEFS; i++) {
+      h = arch_mnemonic_hash(defs[i].name, *seed) >> (32 - bits);
+      if (slots[h] != -1)
+        break;
+      slots[h] = i;
+    }
+    if (i == NUM_DEFS)
+      return true;
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  int n_aliases[NUM_OPCODES] = { 0 };
+  int max_aliases = 0;
+  size_t max_len = 0;
+  int *slots = NULL;
+  uint32_t seed;
+  int bits;
+  int i, op;
+
+  for (i = 0; i < NUM_DEFS; i++)
+    defs[i].order = i;
+  qsort(defs, NUM_DEFS, sizeof *defs, defcmp);
+  for (i = 0; i < NUM_DEFS; i++) {
+    if (strlen(defs[i].name) > max_len)
+      max_len = strlen(defs[i].name);
+    if (defs[i].opcode != -1 && ++n_aliases[defs[i].opcode] > max_aliases)
+      max_aliases = n_aliases[defs[i].opcode];
+  }
+
+  for (bits = 1; (1 << bits) < NUM_DEFS; bits++);
+  for (;; bits++) {
+    slots = realloc(slots, sizeof *slots << bits);
+    if (slots == NULL) {
+      perror("allocating hash table");
+      return 1;
+    }
+    if (find_seed(bits, &seed, slots))
+      break;
+  }
+
+  printf("/* Generated by mkarch from arch-mnemonics.def. Do not edit. */\n\n");
+  printf("#define ARCH_MNEMONIC_MAX %zu\n", max_len);
+  printf("#define ARCH_HASH_SEED %uU\n", seed);
+  printf("#define ARCH_HASH_BITS %d\n", bits);
+  printf("#define ARCH_OPCODE_ALIASES %d\n\n", max_aliases + 1);
+
+  printf("static const struct mnemonic baby_mnemonics[] = {\n");
+  for (i = 0; i < NUM_DEFS; i++)
+    printf("  { \"%s\", %s, %s },\n", defs[i].name, defs[i].type, defs[i].what);
+  printf("};\n\n");
+
+  printf("static const signed char mnemonic_slots[1 << ARCH_HASH_BITS] = {");
+  for (i = 0; i < (1 << bits); i++)
+    printf("%s%d,", i % 8 ? " " : "\n  ", slots[i]);
+  printf("\n};\n\n");
+
+  printf("static const struct mnemonic *const opcode_mnemonics[%d][ARCH_OPCODE_ALIASES] = {\n",
+         NUM_OPCODES);
+  for (op = 0; op < NUM_OPCODES; op++) {
+    printf("  [%d] = {", op);
+    for (i = 0; i < NUM_DEFS; i++)
+      if (defs[sorted(i)].opcode == op)
+        printf(" baby_mnemonics + %d,", sorted(i));
+    printf(" NULL },\n");
+  }
+  printf("};\n");
+
+  free(slots);
+  return 0;
+}
@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Generate the scanners for lines of bits images at build time.
+ *
+ * Each grammar is a sequence of elements, each matching between 'min'
+ * and 'max' characters of a set of character classes. The elements are
+ * unrolled into a deterministic state machine over the classes, which
+ * the loader runs with one table lookup per character. A comment ends
+ * the scan at once, since nothing after it matters. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+enum class {
+  C_ZERO,
+  C_ONE,
+  C_DIGIT,
+  C_COLON,
+  C_BLANK,
+  C_SPACE,
+  C_SEMI,
+  C_OTHER,
+  C_END,
+  N_CLASSES
+};
+
+static const char *class_names[] = {
+  "ZERO", "ONE", "DIGIT", "COLON", "BLANK", "SPACE", "SEMI", "OTHER", "END",
+};
+
+enum action {
+  A_NONE,
+  A_ADDR,
+  A_BIT,
+  A_ACCEPT,
+};
+
+static const char *action_names[] = {
+  "NONE", "ADDR", "BIT", "ACCEPT",
+};
+
+#define S(c) (1 << (c))
+#define DIGITS (S(C_ZERO) | S(C_ONE) | S(C_DIGIT))
+#define BITS (S(C_ZERO) | S(C_ONE))
+#define SPACES (S(C_BLANK) | S(C_SPACE))
+#define MANY -1
+
+struct element {
+  unsigned set;
+  int min;
+  int max;
+  enum action action;
+};
+
+/* [[:space:]]*(;.*)?$ */
+#define COMMENT { SPACES, 0, MANY, A_NONE }, { S(C_SEMI), 0, 1, A_ACCEPT }
+
+static const struct element ignore[] = { COMMENT };
+static const struct element snp[] = {
+  { DIGITS, 1, MANY, A_ADDR }, { S(C_COLON), 1, 1, A_NONE }, { S(C_BLANK), 1, 1, A_NONE },
+  { BITS, 32, 32, A_BIT }, COMMENT
+};
+static const struct element bits[] = { { BITS, 32, 32, A_BIT }, COMMENT };
+
+struct grammar {
+  const char *name;
+  const struct element *elements;
+  int n;
+};
+
+#define GRAMMAR(name, g) { name, g, sizeof g / sizeof *g }
+static const struct grammar grammars[] = {
+  GRAMMAR("IGNORE", ignore),
+  GRAMMAR("SNP", snp),
+  GRAMMAR("BITS", bits),
+};
+#define N_GRAMMARS ((int) (sizeof grammars / sizeof *grammars))
+
+/* States after matching 'k' characters of element 'e', numbered from
+ * SCAN_FIRST. An unbounded element counts only up to its minimum. */
+#define SCAN_REJECT 0
+#define SCAN_ACCEPT 1
+#define SCAN_FIRST 2
+
+struct state {
+  int grammar;
+  int e;
+  int k;
+};
+
+static struct state states[256];
+static int n_states = SCAN_FIRST;
+
+static int state_of(int g, int e, int k) {
+  int s;
+
+  if (e < grammars[g].n && grammars[g].elements[e].max == k)
+    return state_of(g, e + 1, 0);
+  for (s = SCAN_FIRST; s < n_states; s++)
+    if (states[s].grammar == g && states[s].e == e && states[s].k == k)
+      return s;
+  if (n_states == sizeof states / sizeof *states) {
+    fprintf(stderr, "mkscan: too many states\n");
+    exit(1);
+  }
+  states[n_states] = (struct state) { g, e, k };
+  return n_states++;
+}
+
+static void step(const struct state *st, enum class c, int *next, enum action *action) {
+  const struct grammar *g = grammars + st->grammar;
+  const struct element *el = g->elements + st->e;
+  int k;
+
+  if (st->e == g->n) {
+    *next = c == C_END ? SCAN_ACCEPT : SCAN_REJECT;
+    *action = A_NONE;
+  } else if (el->set & S(c)) {
+    k = el->max == MANY ? (st->k < el->min ? st->k + 1 : st->k) : st->k + 1;
+    *action = el->action;
+    *next = el->action == A_ACCEPT ? SCAN_ACCEPT : state_of(st->grammar, st->e, k);
+  } else if (st->k >= el->min) {
+    step(&(struct state) { st->grammar, st->e + 1, 0 }, c, next, action);
+  } else {
+    *next = SCAN_REJECT;
+    *action = A_NONE;
+  }
+}
+
+static enum class class_of(int ch) {
+  if (ch == '\0')
+    return C_END;
+  else if (ch == '0')
+    return C_ZERO;
+  else if (ch == '1')
+    return C_ONE;
+  else if (isdigit(ch))
+    return C_DIGIT;
+  else if (ch == ':')
+    return C_COLON;
+  else if (ch == ' ')
+    return C_BLANK;
+  else if (isspace(ch))
+    return C_SPACE;
+  else if (ch == ';')
+    return C_SEMI;
+  else
+    return C_OTHER;
+}
+
+int main(int argc, char *argv[]) {
+  int next[256][N_CLASSES];
+  enum action action[256][N_CLASSES];
+  int start[N_GRAMMARS];
+  int g, s, c;
+
+  for (g = 0; g < N_GRAMMARS; g++)
+    start[g] = state_of(g, 0, 0);
+  for (s = SCAN_FIRST; s < n_states; s++)
+    for (c = 0; c < N_CLASSES; c++)
+      step(states + s, c, &next[s][c], &action[s][c]);
+
+  printf("/* Generated by mkscan. Do not edit. */\n\n");
+  printf("#define SCAN_REJECT %d\n", SCAN_REJECT);
+  printf("#define SCAN_ACCEPT %d\n", SCAN_ACCEPT);
+  for (g = 0; g < N_GRAMMARS; g++)
+    printf("#define SCAN_%s %d\n", grammars[g].name, start[g]);
+  printf("\nenum scan_class {\n");
+  for (c = 0; c < N_CLASSES; c++)
+    printf("  SCAN_C_%s,\n", class_names[c]);
+  printf("  SCAN_N_CLASSES\n};\n\n");
+  printf("enum scan_action {\n");
+  for (c = 0; c < (int) (sizeof action_names / sizeof *action_names); c++)
+    printf("  SCAN_A_%s,\n", action_names[c]);
+  printf("};\n\n");
+
+  printf("static const unsigned char scan_classes[256] = {");
+  for (c = 0; c < 256; c++)
+    printf("%s%d,", c % 16 ? " " : "\n  ", class_of(c));
+  printf("\n};\n\n");
+
+  printf("static const struct scan_step {\n"
+         "  unsigned char next;\n"
+         "  unsigned char action;\n"
+         "} scan_table[%d][SCAN_N_CLASSES] = {\n", n_states);
+  for (s = SCAN_FIRST; s < n_states; s++) {
+    printf("  [%d] = {", s);
+    for (c = 0; c < N_CLASSES; c++)
+      printf(" { %d, SCAN_A_%s },", next[s][c], action_names[action[s][c]]);
+    printf(" },\n");
+  }
+  printf("};\n");
+
+  return 0;
+}
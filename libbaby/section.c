@@ -10,33 +10,83 @@
 
 #include "section.h"
 
-int put_word(struct section *section, word_t word, struct asm_abstract *abs) {
-  if (section->cursor < section->org) {
-    fprintf(stderr, "cannot write to 0x%x before section start 0x%x\n",
-            section->cursor, section->org);
-    return ESPIPE;
-  }
-  if (section->cursor >= section->org + section->capacity) {
-    size_t old_capacity = section->capacity;
-    section->capacity = section->cursor - section->org + 0x400;
-    section->data = realloc(section->data, sizeof(*section->data) * section->capacity);
-    if (section->data == NULL) {
-      fprintf(stderr, "error expanding section to %ud words\n", section->capacity);
-      return errno;
-    }
-   memset(section->data + old_capacity, '\0', (section->capacity - old_capacity) * sizeof(*section->data));
+/* The page holding a line, allocated if need be, or NULL if out of memory */
+static struct section_page *section_page_alloc(struct section *section, addr_t line) {
+  addr_t n = line >> SECTION_PAGE_BITS;
+  struct section_page **pages;
+  addr_t n_pages;
+
+  /* Only the directory grows, so words already put stay where they are */
+  if (n >= section->n_pages) {
+    for (n_pages = section->n_pages; n >= n_pages; )
+      n_pages = (n_pages == 0) ? 4 : n_pages << 1;
+    pages = realloc(section->pages, sizeof *section->pages * n_pages);
+    if (pages == NULL)
+      return NULL;
+    memset(pages + section->n_pages, '\0',
+           (n_pages - section->n_pages) * sizeof *section->pages);
+    section->pages = pages;
+    section->n_pages = n_pages;
   }
-  if (section->data[section->cursor - section->org].debug != NULL) {
-    fprintf(stderr, "section already includes data at 0x%08x\n", section->cursor);
+  if (section->pages[n] == NULL)
+    section->pages[n] = calloc(1, sizeof *section->pages[n]);
+  return section->pages[n];
+}
+
+int put_word(struct section *section, word_t word, struct asm_abstract *abs) {
+  addr_t line = section->cursor;
+  addr_t i = line & SECTION_PAGE_MASK;
+  struct section_page *page;
+
+  if (section_used(section, line)) {
+    fprintf(stderr, "section already includes data at 0x%08x\n", line);
     return EEXIST;
   }
-  section->data[section->cursor   - section->org].debug = abs;
-  section->data[section->cursor++ - section->org].value = word;
-  if (section->cursor - section->org > section->length)
-    section->length = section->cursor - section->org;
+  page = section_page_alloc(section, line);
+  if (page == NULL)
+    return ENOMEM;
+  page->used[i / 64] |= UINT64_C(1) << (i % 64);
+  page->value[i] = word;
+  page->debug[i] = abs;
+  section->cursor++;
+
+  if (line < section->org) {
+    section->length += section->length ? section->org - line : 0;
+    section->org = line;
+  }
+  if (line - section->org >= section->length)
+    section->length = line - section->org + 1;
   return 0;
 }
 
-void section_free (struct section *section) {
-  free(section->data);
+const word_t *section_next_range(const struct section *section, addr_t from,
+                                 addr_t *start, addr_t *end) {
+  const struct section_page *page;
+  addr_t n = from >> SECTION_PAGE_BITS;
+  addr_t i = from & SECTION_PAGE_MASK;
+  addr_t j;
+
+  for (; n < section->n_pages; n++, i = 0) {
+    page = section->pages[n];
+    if (page == NULL)
+      continue;
+    for (; i < SECTION_PAGE_WORDS && !(page->used[i / 64] & (UINT64_C(1) << (i % 64))); i++)
+      if (i % 64 == 0 && page->used[i / 64] == 0)
+        i += 63;
+    if (i == SECTION_PAGE_WORDS)
+      continue;
+    for (j = i; j < SECTION_PAGE_WORDS && page->used[j / 64] & (UINT64_C(1) << (j % 64)); j++);
+    *start = (n << SECTION_PAGE_BITS) + i;
+    *end = (n << SECTION_PAGE_BITS) + j;
+    return page->value + i;
+  }
+  return NULL;
+}
+
+void section_free(struct section *section) {
+  addr_t n;
+
+  for (n = 0; n < section->n_pages; n++)
+    free(section->pages[n]);
+  free(section->pages);
 }
@@ -1,28 +1,101 @@
 /* SPDX-License-Identifier: MIT */
 /* (c) Copyright 2023 Andrew Bower */
 
-/* Section handling. */
+/* Section handling.
+ *
+ * The contents of a section are kept in pages that are allocated when
+ * first written to, so words may be put at lines in any order and are
+ * never moved once put. */
 
 #ifndef LIBBABY_SECTION_H
 #define LIBBABY_SECTION_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+
 #include "arch.h"
 
+/* Constants */
+
+#define SECTION_PAGE_BITS 8
+#define SECTION_PAGE_WORDS (1 << SECTION_PAGE_BITS)
+#define SECTION_PAGE_MASK (SECTION_PAGE_WORDS - 1)
+
+/* Types */
+
 struct asm_abstract;
 
-struct sectiondata {
-  word_t value;
-  struct asm_abstract *debug;
+struct section_page {
+  word_t value[SECTION_PAGE_WORDS];
+  struct asm_abstract *debug[SECTION_PAGE_WORDS];
+  uint64_t used[SECTION_PAGE_WORDS / 64];
 };
 
 struct section {
-  addr_t capacity;
-  addr_t length;
-  addr_t org;
+  addr_t length;                 /* lines from org to after the highest */
+  addr_t org;                    /* start as set by the owner, or the lowest
+                                  * line put if lower; 0 unless set, so a
+                                  * word need not have been put there */
   addr_t cursor;
-  struct sectiondata *data;
+  struct section_page **pages;   /* indexed by line >> SECTION_PAGE_BITS */
+  addr_t n_pages;
 };
 
+/* Inline functions */
+
+static inline struct section_page *section_page(const struct section *section,
+                                                addr_t line) {
+  addr_t n = line >> SECTION_PAGE_BITS;
+
+  return n < section->n_pages ? section->pages[n] : NULL;
+}
+
+static inline bool section_used(const struct section *section, addr_t line) {
+  const struct section_page *page = section_page(section, line);
+  addr_t i = line & SECTION_PAGE_MASK;
+
+  return page && page->used[i / 64] & (UINT64_C(1) << (i % 64));
+}
+
+/* The word at a line, 0 if none was put there */
+static inline word_t section_get(const struct section *section, addr_t line) {
+  const struct section_page *page = section_page(section, line);
+
+  return page ? page->value[line & SECTION_PAGE_MASK] : 0;
+}
+
+static inline struct asm_abstract *section_debug(const struct section *section,
+                                                 addr_t line) {
+  const struct section_page *page = section_page(section, line);
+
+  return page ? page->debug[line & SECTION_PAGE_MASK] : NULL;
+}
+
+/* Change a word that has already been put */
+static inline void section_set(struct section *section, addr_t line, word_t word) {
+  assert(section_used(section, line));
+  section_page(section, line)->value[line & SECTION_PAGE_MASK] = word;
+}
+
+static inline void section_set_debug(struct section *section, addr_t line,
+                                     struct asm_abstract *abs) {
+  assert(section_used(section, line));
+  section_page(section, line)->debug[line & SECTION_PAGE_MASK] = abs;
+}
+
+/* Public functions */
+
+/* Put a word at the cursor, which may be anywhere, moving the section's
+ * org down or its end up to take it in. EEXIST is returned if there is
+ * already a word there and ENOMEM if there is no room for it. */
 extern int put_word(struct section *section, word_t word, struct asm_abstract *abs);
+
+/* Find the first run of words put at or after line 'from', stopping at
+ * the end of a page. The run is [*start, *end) and its values follow the
+ * returned pointer; NULL is returned if there are no more words. */
+extern const word_t *section_next_range(const struct section *section, addr_t from,
+                                        addr_t *start, addr_t *end);
+
 extern void section_free(struct section *section);
 #endif
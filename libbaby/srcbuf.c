@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Source text buffers.
+ *
+ * Regular files are mapped privately, over an anonymous mapping one page
+ * larger where necessary, so that the two NUL bytes the scanner needs
+ * after the text are there without copying it. Anything else, such as
+ * standard input or a pipe, is read fully into the heap, as is text
+ * already in memory. */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "srcbuf.h"
+
+#define SRCBUF_PAD 2
+#define SRCBUF_READ_SIZE 4096
+
+static int read_fd(struct srcbuf *buf, int fd) {
+  size_t sz = SRCBUF_READ_SIZE;
+  ssize_t n;
+  char *text;
+
+  buf->text = malloc(sz);
+  if (buf->text == NULL)
+    return errno;
+
+  while ((n = read(fd, buf->text + buf->len, sz - buf->len - SRCBUF_PAD)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    buf->len += n;
+    if (sz - buf->len == SRCBUF_PAD) {
+      text = realloc(buf->text, sz <<= 1);
+      if (text == NULL)
+        return errno;
+      buf->text = text;
+    }
+  }
+  memset(buf->text + buf->len, '\0', SRCBUF_PAD);
+
+  return 0;
+}
+
+static int map_fd(struct srcbuf *buf, int fd, size_t len) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  void *base;
+
+  buf->len = len;
+  buf->mapsz = (len + SRCBUF_PAD + page - 1) & ~(page - 1);
+  base = mmap(NULL, buf->mapsz, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    buf->mapsz = 0;
+    return errno;
+  }
+  buf->text = base;
+
+  /* The tail of the last page of a file reads as zeros, as do the pages
+   * of the anonymous mapping beyond it. The scanner writes to the buffer
+   * as it goes, hence the private writable mapping. */
+  if (len > 0 &&
+      mmap(base, len, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    return errno;
+
+  return 0;
+}
+
+static int index_lines(struct srcbuf *buf) {
+  const char *ptr;
+  const char *end = buf->text + buf->len;
+  int n = 0;
+
+  for (ptr = buf->text; ptr < end && (ptr = memchr(ptr, '\n', end - ptr)); ptr++)
+    n++;
+  if (buf->len > 0 && end[-1] != '\n')
+    n++;
+
+  buf->lines = calloc(n + 1, sizeof *buf->lines);
+  if (buf->lines == NULL)
+    return errno;
+
+  buf->n_lines = n;
+  buf->lines[0] = 0;
+  for (ptr = buf->text, n = 1; ptr < end && (ptr = memchr(ptr, '\n', end - ptr)); ptr++)
+    buf->lines[n++] = ptr + 1 - buf->text;
+  buf->lines[buf->n_lines] = buf->len;
+
+  return 0;
+}
+
+int srcbuf_open(struct srcbuf *buf, const char *path) {
+  struct stat statbuf;
+  int fd = STDIN_FILENO;
+  int rc;
+
+  memset(buf, '\0', sizeof *buf);
+
+  if (strcmp(path, "-")) {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      return errno;
+  }
+
+  if (fstat(fd, &statbuf) == -1)
+    rc = errno;
+  else if (S_ISREG(statbuf.st_mode))
+    rc = map_fd(buf, fd, statbuf.st_size);
+  else
+    rc = read_fd(buf, fd);
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+
+  if (rc == 0)
+    rc = index_lines(buf);
+
+  if (rc != 0)
+    srcbuf_close(buf);
+
+  return rc;
+}
+
+int srcbuf_copy(struct srcbuf *buf, const char *text, size_t len) {
+  int rc;
+
+  memset(buf, '\0', sizeof *buf);
+
+  buf->text = malloc(len + SRCBUF_PAD);
+  if (buf->text == NULL)
+    return errno;
+  memcpy(buf->text, text, len);
+  memset(buf->text + len, '\0', SRCBUF_PAD);
+  buf->len = len;
+
+  rc = index_lines(buf);
+  if (rc != 0)
+    srcbuf_close(buf);
+
+  return rc;
+}
+
+void srcbuf_close(struct srcbuf *buf) {
+  if (buf->mapsz)
+    munmap(buf->text, buf->mapsz);
+  else
+    free(buf->text);
+  free(buf->lines);
+  memset(buf, '\0', sizeof *buf);
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Source text buffers. */
+
+#ifndef LIBBABY_SRCBUF_H
+#define LIBBABY_SRCBUF_H
+
+#include <stddef.h>
+
+/* Types */
+
+/* The whole text of a source, terminated by two NUL bytes so that it can
+ * be scanned in place, with the offset at which each line starts. */
+struct srcbuf {
+  char *text;
+  size_t len;
+  size_t mapsz;   /* size of mapping, or 0 if allocated on the heap */
+  size_t *lines;  /* start of each line, then the end of the text */
+  int n_lines;
+};
+
+/* Public functions */
+
+/* Map a file, or read standard input if path is "-". */
+extern int srcbuf_open(struct srcbuf *buf, const char *path);
+/* Copy 'len' bytes of text already in memory. */
+extern int srcbuf_copy(struct srcbuf *buf, const char *text, size_t len);
+extern void srcbuf_close(struct srcbuf *buf);
+
+/* Return line number 'line' (from 1) and its length without the newline,
+ * or NULL if there is no such line. */
+static inline const char *srcbuf_line(const struct srcbuf *buf, int line, size_t *len) {
+  size_t start, end;
+
+  if (line < 1 || line > buf->n_lines)
+    return NULL;
+
+  start = buf->lines[line - 1];
+  end = buf->lines[line];
+  if (end > start && buf->text[end - 1] == '\n')
+    end--;
+  *len = end - start;
+  return buf->text + start;
+}
+
+#endif
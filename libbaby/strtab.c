@@ -12,6 +12,7 @@
 #include <getopt.h>
 #include <errno.h>
 #include <search.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <assert.h>
 
@@ -32,9 +33,14 @@ struct strtab {
   /* Hash table for existence checks */
   struct hsearch_data htab;
   size_t htab_size;
+
+  /* Serialises insertions from concurrent parsers */
+  pthread_mutex_t lock;
 };
 
-static int rebuild_htab(struct strtab *table, bool had_enomem) {
+/* Rebuild the hash table if it needs to grow or if the string buffer,
+ * into which its keys point, has moved. */
+static int rebuild_htab(struct strtab *table, bool had_enomem, bool moved) {
   size_t min_size = 0;
   str_idx_t ptr;
   ENTRY *r;
@@ -56,7 +62,7 @@ static int rebuild_htab(struct strtab *table, bool had_enomem) {
   if (min_size == table->htab_size && had_enomem)
     min_size <<= 1;
 
-  if (min_size != table->htab_size) {
+  if (min_size != table->htab_size || moved) {
     if (table->htab_size != 0)
       hdestroy_r(&table->htab);
 
@@ -72,7 +78,7 @@ static int rebuild_htab(struct strtab *table, bool had_enomem) {
       };
       rc = hsearch_r(e, ENTER, &r, &table->htab);
       if (rc == 0 && errno == ENOMEM)
-        return rebuild_htab(table, true);
+        return rebuild_htab(table, true, false);
       else if (r == 0)
         return errno;
       ptr += strlen(e.key) + 1;
@@ -101,9 +107,11 @@ struct strtab *strtab_create(void) {
   }
 
   if (table) {
-    rc = rebuild_htab(table, false);
+    pthread_mutex_init(&table->lock, NULL);
+    rc = rebuild_htab(table, false, false);
     if (rc != 0) {
       errno = rc;
+      pthread_mutex_destroy(&table->lock);
       free(table->buf);
       free(table);
       table = NULL;
@@ -119,6 +127,7 @@ void strtab_destroy(struct strtab *table) {
   if (table->htab_size != 0)
     hdestroy_r(&table->htab);
 
+  pthread_mutex_destroy(&table->lock);
   free(table->buf);
   free(table);
 }
@@ -130,14 +139,19 @@ str_idx_t strtab_put(struct strtab *table, const char *str) {
   };
   ENTRY *r;
   size_t len;
+  bool moved = false;
   int rc;
 
   assert(table);
 
+  pthread_mutex_lock(&table->lock);
+
   /* Return index of string if already stored */
   rc = hsearch_r(e, FIND, &r, &table->htab);
-  if (rc != 0)
+  if (rc != 0) {
+    pthread_mutex_unlock(&table->lock);
     return (str_idx_t) r->data;
+  }
   assert(errno == ESRCH);
 
   /* Else insert into the string table */
@@ -151,14 +165,19 @@ str_idx_t strtab_put(struct strtab *table, const char *str) {
       table->sz = old_size + len + 1;
     table->buf = realloc(table->buf, table->sz * sizeof *table->buf);
     memset(table->buf + old_size, '\0', table->sz - old_size);
+    moved = true;
   }
+  e.key = table->buf + table->ptr;
   e.data = (void *) table->ptr;
   strcpy(table->buf + table->ptr, str);
   table->ptr += len + 1;
+  table->n_entries++;
 
   /* Add to hash table if space, rebuilding if necessary */
-  rc = hsearch_r(e, ENTER, &r, &table->htab);
-  rebuild_htab(table, rc == 0);
+  rc = moved ? 1 : hsearch_r(e, ENTER, &r, &table->htab);
+  rebuild_htab(table, rc == 0, moved);
+
+  pthread_mutex_unlock(&table->lock);
 
   return (str_idx_t) e.data;
 }
@@ -166,3 +185,16 @@ str_idx_t strtab_put(struct strtab *table, const char *str) {
 const char *strtab_get(struct strtab *table, str_idx_t idx) {
   return table->buf + idx;
 }
+
+size_t strtab_copy(struct strtab *table, str_idx_t idx, char *buf, size_t sz) {
+  size_t len;
+
+  pthread_mutex_lock(&table->lock);
+  len = strlen(table->buf + idx);
+  if (sz > 0) {
+    memcpy(buf, table->buf + idx, len < sz ? len : sz - 1);
+    buf[len < sz ? len : sz - 1] = '\0';
+  }
+  pthread_mutex_unlock(&table->lock);
+  return len;
+}
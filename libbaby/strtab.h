@@ -20,7 +20,12 @@ struct strtab;
 
 extern struct strtab *strtab_create(void);
 extern void strtab_destroy(struct strtab *strtab);
+/* Insertions may be made concurrently. Pointers returned by strtab_get()
+ * are invalidated by insertions. */
 extern str_idx_t strtab_put(struct strtab *strtab, const char *str);
 const char *strtab_get(struct strtab *strtab, str_idx_t);
+/* Copy a string, safely while others insert, truncating it to fit 'sz'.
+ * Its full length is returned. */
+extern size_t strtab_copy(struct strtab *strtab, str_idx_t idx, char *buf, size_t sz);
 
 #endif
@@ -24,10 +24,10 @@
 #include "strtab.h"
 #include "symbols.h"
 
-/* TODO: stop sorting the symbols by name now that we use indexes
- * into a string table as the name reference. In any case this
- * was only a temporary solution pending more appropriate
- * data structure. */
+/* Names are interned in a string table, so the case-sensitive tables
+ * find symbols by hashing the string index. The case-insensitive ones,
+ * which hold the mnemonics, are few and are searched in name order.
+ * Tables are still sorted by name for printing and iteration. */
 
 const char *sym_type_names[SYM_T_MAX] = {
   [ SYM_T_MNEMONIC ] = "MNEMONIC",
@@ -39,6 +39,8 @@ const char sym_subtype_id[] = {
   [ SYM_ST_WORD ] = 'D',
   [ SYM_ST_MNEM ] = 'M',
   [ SYM_ST_AST ] = 'A',
+  [ SYM_ST_REL ] = 'R',
+  [ SYM_ST_EXT ] = 'X',
 };
 
 
@@ -46,35 +48,74 @@ struct sym_table {
   struct symbol *symbols;
   size_t count;
   size_t capacity;
+  size_t *slots;              /* position + 1 of each symbol, by name hash */
+  size_t n_slots;
   bool case_insensitive;
   bool sorted;
 };
 
-static struct sym_context *sym_global_context = NULL;
-static struct strtab *sym_strtab;
-
-static const char *str_text(str_idx_t idx) {
-  return strtab_get(sym_strtab, idx);
+static int symsort(const void *a, const void *b, void *strtab) {
+  const struct symbol *sa = (const struct symbol *) a;
+  const struct symbol *sb = (const struct symbol *) b;
+  return strcmp(strtab_get(strtab, sa->ref.name), strtab_get(strtab, sb->ref.name));
 }
 
-static int symsort(const void *a, const void *b) {
+static int symcasesort(const void *a, const void *b, void *strtab) {
   const struct symbol *sa = (const struct symbol *) a;
   const struct symbol *sb = (const struct symbol *) b;
-  return strcmp(str_text(sa->ref.name), str_text(sb->ref.name));
+  return strcasecmp(strtab_get(strtab, sa->ref.name), strtab_get(strtab, sb->ref.name));
 }
 
-static int symsearch(const void *key, const void *a) {
-  return symsort(&(struct symbol) { .ref.name = (str_idx_t) key }, a);
+/* Binary search of a sorted case-insensitive table */
+static struct symbol *symcasesearch(const struct sym_table *tab, struct strtab *strtab,
+                                    str_idx_t name) {
+  const char *key = strtab_get(strtab, name);
+  size_t lo = 0, hi = tab->count, mid;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    cmp = strcasecmp(key, strtab_get(strtab, tab->symbols[mid].ref.name));
+    if (cmp == 0)
+      return tab->symbols + mid;
+    else if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
 }
 
-static int symcasesort(const void *a, const void *b) {
-  const struct symbol *sa = (const struct symbol *) a;
-  const struct symbol *sb = (const struct symbol *) b;
-  return strcasecmp(str_text(sa->ref.name), str_text(sb->ref.name));
+static size_t slot_hash(const struct sym_table *tab, str_idx_t name) {
+  return ((uint64_t) name * 0x9e3779b97f4a7c15ull) >> 32 & (tab->n_slots - 1);
 }
 
-static int symcasesearch(const void *key, const void *a) {
-  return symcasesort(&(struct symbol) { .ref.name = (str_idx_t) key }, a);
+static size_t *find_slot(const struct sym_table *tab, str_idx_t name) {
+  size_t i;
+
+  for (i = slot_hash(tab, name);
+       tab->slots[i] && tab->symbols[tab->slots[i] - 1].ref.name != name;
+       i = (i + 1) & (tab->n_slots - 1));
+  return tab->slots + i;
+}
+
+/* Index every symbol, growing the index to keep it at most half full. */
+static void reindex(struct sym_table *tab) {
+  size_t i;
+
+  if (tab->n_slots < 2 * (tab->count + 1)) {
+    while (tab->n_slots < 2 * (tab->count + 1))
+      tab->n_slots = tab->n_slots ? tab->n_slots << 1 : 64;
+    free(tab->slots);
+    tab->slots = malloc(tab->n_slots * sizeof *tab->slots);
+    if (tab->slots == NULL) {
+      perror("indexing symbol table");
+      exit(1);
+    }
+  }
+  memset(tab->slots, '\0', tab->n_slots * sizeof *tab->slots);
+  for (i = 0; i < tab->count; i++)
+    *find_slot(tab, tab->symbols[i].ref.name) = i + 1;
 }
 
 void sym_sort(struct sym_context *context, enum sym_type type) {
@@ -82,9 +123,12 @@ void sym_sort(struct sym_context *context, enum sym_type type) {
 
   assert(type < SYM_T_MAX);
 
-  qsort(tab->symbols, tab->count, sizeof tab->symbols[0],
-        tab->case_insensitive ? symcasesort : symsort);
+  if (tab->count > 0)
+    qsort_r(tab->symbols, tab->count, sizeof tab->symbols[0],
+            tab->case_insensitive ? symcasesort : symsort, context->strtab);
   tab->sorted = true;
+  if (!tab->case_insensitive)
+    reindex(tab);
 }
 
 const char *sym_type_name(enum sym_type type) {
@@ -106,12 +150,15 @@ struct symbol *sym_lookup_with_context(struct sym_context *context,
 
   while (context && !sym) {
     tab = context->tables[type];
-    if (tab) {
+    if (tab && tab->count && !tab->case_insensitive) {
+      size_t slot = *find_slot(tab, name);
+
+      sym = slot ? tab->symbols + slot - 1 : NULL;
+    } else if (tab && tab->count) {
       if (!tab->sorted)
         sym_sort(context, type);
 
-      sym = bsearch((void *) name, tab->symbols, tab->count, sizeof tab->symbols[0],
-                    tab->case_insensitive ? symcasesearch : symsearch);
+      sym = symcasesearch(tab, context->strtab, name);
     }
     if (!sym ||
         (scope == SYM_LU_SCOPE_EXCLUDE_SPECIFIED_UNDEF &&
@@ -152,10 +199,15 @@ struct symref *sym_getref(struct sym_context *context, enum sym_type type, str_i
     tab->symbols = realloc(tab->symbols, sizeof tab->symbols[0] * tab->capacity);
   }
   sym = &tab->symbols[tab->count++];
+  memset(sym, '\0', sizeof *sym);
   sym->ref.type = type;
   sym->ref.name = name;
   sym->subtype = SYM_ST_UNDEF;
   tab->sorted = false;
+  if (!tab->case_insensitive && tab->n_slots < 2 * (tab->count + 1))
+    reindex(tab);
+  else if (!tab->case_insensitive)
+    *find_slot(tab, name) = tab->count;
 
   return &sym->ref;
 }
@@ -166,7 +218,7 @@ union symval sym_getval(struct sym_context *context, struct symref *ref) {
   sym = sym_lookup(context, ref->type, ref->name, false);
 
   if (sym == NULL || sym->ref.type != ref->type) {
-    fprintf(stderr, "error: symbol '%s' not found\n", strtab_get(sym_strtab, ref->name));
+    fprintf(stderr, "error: symbol '%s' not found\n", strtab_get(context->strtab, ref->name));
     return (union symval) { .numeric = 0 };
   }
 
@@ -205,13 +257,18 @@ void sym_table_destroy(struct sym_context *context, enum sym_type type) {
 
   assert(table);
   free(table->symbols);
+  free(table->slots);
   free(table);
   context->tables[type] = NULL;
 }
 
 struct sym_context *sym_context_create(struct sym_context *parent) {
   struct sym_context *context = (struct sym_context *) calloc(1, sizeof *context);
-  context->parent = parent;
+
+  if (context && parent) {
+    context->parent = parent;
+    context->strtab = parent->strtab;
+  }
   return context;
 }
 
@@ -227,34 +284,27 @@ void sym_context_destroy(struct sym_context *context) {
   free(context);
 }
 
-void sym_init(struct strtab *strtab) {
+struct sym_context *sym_root_create(struct strtab *strtab) {
+  struct sym_context *root;
   int rc;
   int i;
 
-  sym_global_context = sym_context_create(NULL);
-  sym_strtab = strtab;
-  if (sym_global_context == NULL) {
-    perror("creating global context");
+  root = sym_context_create(NULL);
+  if (root == NULL) {
+    perror("creating root context");
     exit(1);
   }
+  root->strtab = strtab;
 
-  /* Root/global context has one of each symbol table type. */
+  /* The root context has one of each symbol table type. */
   for (i = 0; i < SYM_T_MAX; i++) {
-    rc = sym_table_create(sym_global_context, i);
+    rc = sym_table_create(root, i);
     if (rc != 0) {
       perror("sym_table_create");
       exit(1);
     }
   }
-}
-
-void sym_finit(void) {
-  sym_context_destroy(sym_global_context);
-  sym_global_context = NULL;
-}
-
-struct sym_context *sym_root_context(void) {
-  return sym_global_context;
+  return root;
 }
 
 struct symref *sym_add(struct sym_context *context,
@@ -293,15 +343,35 @@ void sym_print_table(struct sym_context *context, enum sym_type type) {
             sym_type_names[sym->ref.type],
             sym->val.numeric,
             sym_subtype_id[sym->subtype],
-            str_text(sym->ref.name),
+            strtab_get(context->strtab, sym->ref.name),
             extra_info ? "(" : "",
             extra_info ? extra : "",
             extra_info ? ")" : "",
-            sym->subtype == SYM_ST_AST ? "AST: " : "\n");
+            sym->subtype == SYM_ST_AST ? "AST: " :
+            sym->subtype == SYM_ST_EXT ? "EXT: " : "\n");
     if (sym->subtype == SYM_ST_AST) {
-      ast_plot_tree(stderr, sym->val.ast);
+      ast_plot_tree(stderr, context->strtab, sym->val.ast);
       fprintf(stderr, "\n");
+    } else if (sym->subtype == SYM_ST_EXT) {
+      fprintf(stderr, "%s\n", strtab_get(context->strtab, sym->val.ext.name));
     }
   }
 }
 
+void sym_iterate(struct sym_context *context, enum sym_type type,
+                 void (*fn)(struct symbol *sym, void *arg), void *arg) {
+  struct sym_table *tab = context->tables[type];
+  size_t i;
+
+  assert(type < SYM_T_MAX);
+
+  if (tab == NULL || tab->count == 0)
+    return;
+
+  if (!tab->sorted)
+    sym_sort(context, type);
+
+  for (i = 0; i < tab->count; i++)
+    fn(tab->symbols + i, arg);
+}
+
@@ -30,6 +30,12 @@ enum sym_subtype {
   SYM_ST_MNEM,
   SYM_ST_WORD,
   SYM_ST_AST,
+
+  /* Words relative to the start of a relocatable section */
+  SYM_ST_REL,
+
+  /* Offsets from a symbol defined in another object */
+  SYM_ST_EXT,
 };
 
 enum sym_lookup_scope {
@@ -48,6 +54,10 @@ union symval {
   void *internal;
   struct ast_node *ast;
   struct mnemonic mnem;
+  struct {
+    num_t addend;
+    str_idx_t name;
+  } ext;
 };
 
 #define SYM_VAL_NUL ((union symval) { .numeric = 0 })
@@ -56,21 +66,26 @@ struct symbol {
   struct symref ref;
   union symval val;
   enum sym_subtype subtype;
+  bool referenced;          /* value used before layout was complete */
+  bool temp;                /* a temporary, or an argument naming one */
 };
 
 /* Opaque types */
 struct syn_table;
 
+/* A scope of symbols. Names are kept in 'strtab', which a context
+ * shares with its parent. */
 struct sym_context {
   struct sym_context *parent;
+  struct strtab *strtab;
   struct sym_table *tables[SYM_T_MAX];
 };
 
 /* Public functions */
 
-extern void sym_init(struct strtab *strtab);
-extern void sym_finit(void);
-struct sym_context *sym_root_context(void);
+/* Create a context with no parent and a table of each type, for names
+ * kept in 'strtab'. It is freed with sym_context_destroy(). */
+extern struct sym_context *sym_root_create(struct strtab *strtab);
 
 const char *sym_type_name(enum sym_type type);
 
@@ -101,6 +116,10 @@ static inline struct symref *sym_add_num(struct sym_context *context, enum sym_t
 extern void sym_sort(struct sym_context *context, enum sym_type type);
 extern void sym_print_table(struct sym_context *context, enum sym_type type);
 
+/* Call fn for each symbol of a type in a context, in name order. */
+extern void sym_iterate(struct sym_context *context, enum sym_type type,
+                        void (*fn)(struct symbol *sym, void *arg), void *arg);
+
 extern struct sym_context *sym_context_create(struct sym_context *parent);
 extern void sym_context_destroy(struct sym_context *context);
 extern int sym_table_create(struct sym_context *context, enum sym_type type);
@@ -0,0 +1,882 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Static cycle count analysis of Manchester Baby programs.
+ *
+ * Every instruction takes one cycle, as in the simulator. The program is
+ * split into basic blocks joined by the edges the machine can take: SKN
+ * goes to either of the next two instructions and JMP and JRP go through
+ * the data words they name, if nothing the program runs can write them.
+ *
+ * Loops are the strongly connected parts of the graph, found innermost
+ * first, each entered only at its header. A loop is bounded when one of
+ * its exits is an SKN on every way round that tests the accumulator as a
+ * counter plus a constant, where the counter is the accumulator or a store
+ * line that goes up by the same amount on every way round and holds a
+ * known value when the loop is entered. Values are tracked as a constant
+ * or as a variable plus a constant, which is all the arithmetic a counter
+ * needs. A bounded loop costs at most its bound times the most cycles of
+ * any way round, less what is left after the counter's exit. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "arch.h"
+#include "wcet.h"
+
+enum val_kind {
+  V_UNDEF,
+  V_CONST,
+  V_VAR,
+  V_TOP,
+};
+
+/* A constant 'k' or, relative to the start of a loop, 'sign * var + k' */
+struct val {
+  enum val_kind kind;
+  int sign;
+  int var;
+  num_t k;
+};
+
+struct range {
+  bool reached;
+  uint64_t best;
+  uint64_t worst;
+};
+
+struct block {
+  addr_t start;
+  addr_t end;
+  unsigned cycles;
+  int succ[2];
+  int n_succ;
+  bool halts;
+  bool unknown;            /* may go anywhere */
+  const char *why;
+};
+
+struct analysis {
+  const word_t *mem;
+  addr_t mask;
+  struct block *blocks;
+  int nb;
+  int *block_at;
+  int *var_of;             /* store line to variable, -1 if constant */
+  int n_vars;
+  addr_t *var_addr;
+  const struct val *init;  /* state on entry to the routine */
+  int entry;
+  struct val *global;      /* state after each block of the routine */
+  struct wcet *result;
+  const struct wcet_loop *unbounded;
+};
+
+/* Variable 0 is the accumulator */
+#define VAR_AC 0
+
+static uint64_t sat_add(uint64_t a, uint64_t b) {
+  return a > WCET_UNBOUNDED - b ? WCET_UNBOUNDED : a + b;
+}
+
+static uint64_t sat_mul(uint64_t a, uint64_t b) {
+  return a != 0 && b > WCET_UNBOUNDED / a ? WCET_UNBOUNDED : a * b;
+}
+
+static struct range range_add(struct range r, uint64_t best, uint64_t worst) {
+  return (struct range) { r.reached, sat_add(r.best, best), sat_add(r.worst, worst) };
+}
+
+static void range_join(struct range *to, struct range r) {
+  if (!r.reached)
+    return;
+  if (!to->reached) {
+    *to = r;
+  } else {
+    if (r.best < to->best)
+      to->best = r.best;
+    if (r.worst > to->worst)
+      to->worst = r.worst;
+  }
+}
+
+static struct arch_decoded decode(const struct analysis *a, addr_t addr) {
+  return arch_decode(a->mem[addr & a->mask]);
+}
+
+static bool ends_block(word_t opcode) {
+  return opcode == OP_JMP || opcode == OP_JRP ||
+         opcode == OP_SKN || opcode == OP_HLT;
+}
+
+/* Addresses the instruction at 'addr' may go on to, ignoring whether
+ * the data words it jumps through can change. */
+static int next_addrs(const struct analysis *a, addr_t addr, addr_t next[2]) {
+  struct arch_decoded d = decode(a, addr);
+  word_t data = a->mem[d.operand & a->mask];
+
+  switch (d.opcode) {
+  case OP_HLT:
+    return 0;
+  case OP_JMP:
+    next[0] = (data + 1) & a->mask;
+    return 1;
+  case OP_JRP:
+    next[0] = (addr + data + 1) & a->mask;
+    return 1;
+  case OP_SKN:
+    next[0] = (addr + 1) & a->mask;
+    next[1] = (addr + 2) & a->mask;
+    return 2;
+  default:
+    next[0] = (addr + 1) & a->mask;
+    return 1;
+  }
+}
+
+/* Find the instructions reachable from the entries, the store lines they
+ * write and the basic blocks they make. */
+static int find_blocks(struct analysis *a, const addr_t *entries, int n_entries,
+                       const bool *inputs) {
+  addr_t size = a->mask + 1;
+  addr_t *work = calloc(size, sizeof *work);
+  bool *reached = calloc(size, sizeof *reached);
+  bool *leader = calloc(size, sizeof *leader);
+  bool *stored = calloc(size, sizeof *stored);
+  addr_t addr, next[2];
+  int n_work = 0;
+  int rc = 0;
+  int i, n;
+
+  a->block_at = malloc(size * sizeof *a->block_at);
+  a->var_of = malloc(size * sizeof *a->var_of);
+  a->var_addr = malloc((size + 1) * sizeof *a->var_addr);
+  a->blocks = calloc(size, sizeof *a->blocks);
+  if (!work || !reached || !leader || !stored || !a->block_at ||
+      !a->var_of || !a->var_addr || !a->blocks) {
+    rc = ENOMEM;
+    goto finish;
+  }
+
+  for (i = 0; i < n_entries; i++) {
+    addr = entries[i] & a->mask;
+    leader[addr] = true;
+    if (!reached[addr]) {
+      reached[addr] = true;
+      work[n_work++] = addr;
+    }
+  }
+
+  while (n_work > 0) {
+    struct arch_decoded d;
+
+    addr = work[--n_work];
+    d = decode(a, addr);
+    if (d.opcode == OP_STO)
+      stored[d.operand & a->mask] = true;
+    n = next_addrs(a, addr, next);
+    for (i = 0; i < n; i++) {
+      if (ends_block(d.opcode))
+        leader[next[i]] = true;
+      if (!reached[next[i]]) {
+        reached[next[i]] = true;
+        work[n_work++] = next[i];
+      }
+    }
+  }
+
+  /* A modified instruction could become anything */
+  for (addr = 0; addr < size; addr++)
+    if (reached[addr] && stored[addr])
+      for (i = 0, n = next_addrs(a, addr, next); i < n; i++)
+        leader[next[i]] = true;
+
+  a->var_addr[0] = WCET_COUNTER_AC;
+  a->n_vars = 1;
+  for (addr = 0; addr < size; addr++) {
+    a->block_at[addr] = -1;
+    a->var_of[addr] = -1;
+    if (stored[addr] || (inputs && inputs[addr])) {
+      a->var_of[addr] = a->n_vars;
+      a->var_addr[a->n_vars++] = addr;
+    }
+  }
+
+  for (addr = 0; addr < size; addr++) {
+    struct block *b = a->blocks + a->nb;
+    struct arch_decoded d;
+
+    if (!reached[addr] || !leader[addr])
+      continue;
+
+    a->block_at[addr] = a->nb++;
+    b->start = addr;
+    for (b->end = addr, b->cycles = 1;; b->end = (b->end + 1) & a->mask, b->cycles++) {
+      d = decode(a, b->end);
+      if (ends_block(d.opcode) || stored[b->end] ||
+          leader[(b->end + 1) & a->mask])
+        break;
+    }
+
+    b->halts = d.opcode == OP_HLT;
+    if (stored[b->end]) {
+      b->unknown = true;
+      b->why = "instruction is modified";
+    } else if ((d.opcode == OP_JMP || d.opcode == OP_JRP) &&
+               a->var_of[d.operand & a->mask] != -1) {
+      b->unknown = true;
+      b->why = "jump through a store line that changes";
+    }
+  }
+
+  for (i = 0; i < a->nb; i++) {
+    struct block *b = a->blocks + i;
+
+    if (b->unknown)
+      continue;
+    n = next_addrs(a, b->end, next);
+    for (b->n_succ = 0; b->n_succ < n; b->n_succ++)
+      b->succ[b->n_succ] = a->block_at[next[b->n_succ]];
+  }
+
+finish:
+  free(work);
+  free(reached);
+  free(leader);
+  free(stored);
+  return rc;
+}
+
+/* Values */
+
+static struct val val_const(num_t k) {
+  return (struct val) { .kind = V_CONST, .k = k };
+}
+
+static struct val val_neg(struct val v) {
+  v.sign = -v.sign;
+  v.k = -v.k;
+  return v;
+}
+
+static struct val val_sub(struct val x, struct val y) {
+  if (x.kind == V_UNDEF || y.kind == V_UNDEF)
+    return (struct val) { V_UNDEF };
+  if (x.kind == V_TOP || y.kind == V_TOP)
+    return (struct val) { V_TOP };
+  if (y.kind == V_CONST) {
+    x.k -= y.k;
+    return x;
+  }
+  if (x.kind == V_CONST)
+    return val_neg((struct val) { V_VAR, y.sign, y.var, y.k - x.k });
+  if (x.var == y.var && x.sign == y.sign)
+    return val_const(x.k - y.k);
+  return (struct val) { V_TOP };
+}
+
+static bool val_eq(struct val x, struct val y) {
+  return x.kind == y.kind &&
+         (x.kind != V_CONST || x.k == y.k) &&
+         (x.kind != V_VAR || (x.var == y.var && x.sign == y.sign && x.k == y.k));
+}
+
+static bool val_join(struct val *to, struct val v) {
+  if (v.kind == V_UNDEF || to->kind == V_TOP || val_eq(*to, v))
+    return false;
+  *to = to->kind == V_UNDEF ? v : (struct val) { V_TOP };
+  return true;
+}
+
+static bool state_join(const struct analysis *a, struct val *to, const struct val *from) {
+  bool changed = false;
+  int v;
+
+  for (v = 0; v < a->n_vars; v++)
+    changed |= val_join(to + v, from[v]);
+  return changed;
+}
+
+static struct val load(const struct analysis *a, const struct val *state, word_t addr) {
+  int v = a->var_of[addr & a->mask];
+
+  return v == -1 ? val_const(a->mem[addr & a->mask]) : state[v];
+}
+
+static void transfer(const struct analysis *a, const struct block *b, struct val *state) {
+  addr_t addr;
+
+  for (addr = b->start;; addr = (addr + 1) & a->mask) {
+    struct arch_decoded d = decode(a, addr);
+
+    switch (d.opcode) {
+    case OP_LDN:
+      state[VAR_AC] = val_neg(load(a, state, d.operand));
+      break;
+    case OP_SUB:
+    case OP_SUB_ALIAS:
+      state[VAR_AC] = val_sub(state[VAR_AC], load(a, state, d.operand));
+      break;
+    case OP_STO:
+      state[a->var_of[d.operand & a->mask]] = state[VAR_AC];
+      break;
+    }
+    if (addr == b->end)
+      break;
+  }
+}
+
+/* Work out the state after each block of 'region' entered at 'root'. In a
+ * loop, edges back to 'root' are not followed. */
+static int propagate(const struct analysis *a, const bool *region, int root,
+                     bool loop, const struct val *init, struct val *out) {
+  struct val *in = calloc((size_t) a->nb * a->n_vars, sizeof *in);
+  int *work = malloc((a->nb + 1) * sizeof *work);
+  bool *queued = calloc(a->nb, sizeof *queued);
+  int n_work = 0;
+  int b, i;
+
+  if (!in || !work || !queued) {
+    free(in);
+    free(work);
+    free(queued);
+    return ENOMEM;
+  }
+
+  memset(out, '\0', (size_t) a->nb * a->n_vars * sizeof *out);
+  memcpy(in + (size_t) root * a->n_vars, init, a->n_vars * sizeof *init);
+  work[n_work++] = root;
+  queued[root] = true;
+
+  while (n_work > 0) {
+    struct val *o;
+
+    b = work[--n_work];
+    queued[b] = false;
+    o = out + (size_t) b * a->n_vars;
+    memcpy(o, in + (size_t) b * a->n_vars, a->n_vars * sizeof *o);
+    transfer(a, a->blocks + b, o);
+
+    for (i = 0; i < a->blocks[b].n_succ; i++) {
+      int s = a->blocks[b].succ[i];
+
+      if (!region[s] || (loop && s == root))
+        continue;
+      if (state_join(a, in + (size_t) s * a->n_vars, o) && !queued[s]) {
+        work[n_work++] = s;
+        queued[s] = true;
+      }
+    }
+  }
+
+  free(in);
+  free(work);
+  free(queued);
+  return 0;
+}
+
+/* Loops */
+
+static bool has_edge(const struct block *b, int to) {
+  int i;
+
+  for (i = 0; i < b->n_succ; i++)
+    if (b->succ[i] == to)
+      return true;
+  return false;
+}
+
+/* Whether every way round the loop at 'header' passes block 'x'. */
+static bool on_every_path(const struct analysis *a, const bool *loop, int header, int x) {
+  int *work = malloc(a->nb * sizeof *work);
+  bool *seen = calloc(a->nb, sizeof *seen);
+  bool every = true;
+  int n_work = 0;
+  int b, i;
+
+  if (!work || !seen) {
+    every = false;
+    goto finish;
+  }
+
+  if (x == header)
+    goto finish;
+
+  work[n_work++] = header;
+  seen[header] = true;
+  while (every && n_work > 0) {
+    b = work[--n_work];
+    for (i = 0; i < a->blocks[b].n_succ; i++) {
+      int s = a->blocks[b].succ[i];
+
+      if (s == header)
+        every = false;
+      else if (loop[s] && s != x && !seen[s]) {
+        seen[s] = true;
+        work[n_work++] = s;
+      }
+    }
+  }
+
+finish:
+  free(work);
+  free(seen);
+  return every;
+}
+
+/* Iterations after the first before a test that starts at 'start' and
+ * changes by 'step' each time leaves the loop, or -1 if it never does. */
+static int64_t trip(num_t start, num_t step, bool exit_negative) {
+  int64_t t = (int32_t) start;
+  int64_t d = (int32_t) step;
+
+  if ((t < 0) == exit_negative)
+    return 0;
+  if (d == 0)
+    return -1;
+  if (exit_negative)
+    return d > 0 ? (INT64_C(0x80000000) - t + d - 1) / d : t / -d + 1;
+  else
+    return d > 0 ? (-t + d - 1) / d : (t + INT64_C(0x80000000)) / -d + 1;
+}
+
+/* Find the most times the header of 'loop' can run and the block whose
+ * exit is taken when it has. */
+static int bound_loop(struct analysis *a, const bool *loop, int header,
+                      uint64_t *bound, int *exit_block, addr_t *counter) {
+  size_t n = (size_t) a->nb * a->n_vars;
+  struct val *init = calloc(a->n_vars, sizeof *init);
+  struct val *entry = calloc(a->n_vars, sizeof *entry);
+  struct val *back = calloc(a->n_vars, sizeof *back);
+  struct val *out = calloc(n, sizeof *out);
+  int rc = 0;
+  int b, v;
+
+  *bound = 0;
+  if (!init || !entry || !back || !out) {
+    rc = ENOMEM;
+    goto finish;
+  }
+
+  for (v = 0; v < a->n_vars; v++)
+    init[v] = (struct val) { V_VAR, 1, v, 0 };
+  rc = propagate(a, loop, header, true, init, out);
+  if (rc != 0)
+    goto finish;
+
+  if (header == a->entry)
+    state_join(a, entry, a->init);
+  for (b = 0; b < a->nb; b++) {
+    if (!has_edge(a->blocks + b, header))
+      continue;
+    if (loop[b])
+      state_join(a, back, out + (size_t) b * a->n_vars);
+    else
+      state_join(a, entry, a->global + (size_t) b * a->n_vars);
+  }
+
+  for (b = 0; b < a->nb; b++) {
+    const struct block *blk = a->blocks + b;
+    struct val test = out[(size_t) b * a->n_vars + VAR_AC];
+    struct val step, start;
+    int64_t i;
+    int e;
+
+    if (!loop[b] || blk->unknown || decode(a, blk->end).opcode != OP_SKN ||
+        blk->n_succ != 2 || loop[blk->succ[0]] == loop[blk->succ[1]] ||
+        test.kind != V_VAR)
+      continue;
+
+    step = back[test.var];
+    start = entry[test.var];
+    if (step.kind != V_VAR || step.var != test.var || step.sign != 1 ||
+        step.k == 0 || start.kind != V_CONST ||
+        !on_every_path(a, loop, header, b))
+      continue;
+
+    /* The skip leaves the loop when the accumulator is negative */
+    e = loop[blk->succ[0]] ? 1 : 0;
+    i = trip(test.sign * start.k + test.k, test.sign * step.k, e == 1);
+    if (i >= 0 && (*bound == 0 || (uint64_t) i + 1 < *bound)) {
+      *bound = i + 1;
+      *exit_block = b;
+      *counter = a->var_addr[test.var];
+    }
+  }
+
+finish:
+  free(init);
+  free(entry);
+  free(back);
+  free(out);
+  return rc;
+}
+
+static int region_costs(struct analysis *a, const bool *region, int root,
+                        bool loop, struct range *end);
+
+static struct wcet_loop *add_loop(struct analysis *a, const struct wcet_loop *loop) {
+  struct wcet *w = a->result;
+  int i;
+
+  for (i = 0; i < w->n_loops; i++)
+    if (w->loops[i].header == loop->header)
+      return w->loops + i;
+  w->loops[w->n_loops] = *loop;
+  return w->loops + w->n_loops++;
+}
+
+/* Fill in the cycles to the end of each block of 'loop' that leaves it,
+ * given those to the start of its header. */
+static int loop_costs(struct analysis *a, const bool *loop, int header,
+                      struct range start, struct range *end) {
+  struct range *inner = calloc(a->nb, sizeof *inner);
+  struct wcet_loop summary = { .header = a->blocks[header].start };
+  const struct wcet_loop *recorded;
+  uint64_t best = WCET_UNBOUNDED;
+  uint64_t worst = 0;
+  int exit_block = -1;
+  int rc;
+  int b, i;
+
+  if (inner == NULL)
+    return ENOMEM;
+
+  rc = region_costs(a, loop, header, true, inner);
+  if (rc == 0)
+    rc = bound_loop(a, loop, header, &summary.bound, &exit_block, &summary.counter);
+  if (rc != 0)
+    goto finish;
+
+  for (b = 0; b < a->nb; b++) {
+    if (loop[b] && inner[b].reached && has_edge(a->blocks + b, header)) {
+      if (inner[b].best < best)
+        best = inner[b].best;
+      if (inner[b].worst > worst)
+        worst = inner[b].worst;
+    }
+  }
+  summary.iteration = worst;
+  if (summary.bound == 0)
+    summary.why = "no counter controls its exits";
+  recorded = add_loop(a, &summary);
+  if (summary.bound == 0 && a->unbounded == NULL)
+    a->unbounded = recorded;
+
+  for (b = 0; b < a->nb; b++) {
+    const struct block *blk = a->blocks + b;
+    bool leaves = blk->halts || blk->unknown;
+    struct range r = inner[b];
+
+    for (i = 0; i < blk->n_succ; i++)
+      leaves |= !loop[blk->succ[i]];
+    if (!loop[b] || !r.reached || !leaves)
+      continue;
+
+    if (summary.bound == 0) {
+      r.worst = WCET_UNBOUNDED;
+    } else {
+      r.worst = sat_add(sat_mul(summary.bound - 1, worst), r.worst);
+      if (b == exit_block)
+        r.best = sat_add(sat_mul(summary.bound - 1, best), r.best);
+    }
+    end[b] = range_add(r, start.best, start.worst);
+  }
+
+finish:
+  free(inner);
+  return rc;
+}
+
+struct tarjan {
+  const struct analysis *a;
+  const bool *region;
+  int root;
+  bool loop;
+  int *index;
+  int *low;
+  int *stack;
+  bool *on_stack;
+  int *comp;         /* component of each block */
+  int *order;        /* blocks, components in reverse topological order */
+  int n_stack;
+  int n_order;
+  int next_index;
+  int n_comps;
+};
+
+static bool follows(const struct tarjan *t, int to) {
+  return t->region[to] && !(t->loop && to == t->root);
+}
+
+static void strongconnect(struct tarjan *t, int b) {
+  const struct block *blk = t->a->blocks + b;
+  int i, s;
+
+  t->index[b] = t->low[b] = t->next_index++;
+  t->stack[t->n_stack++] = b;
+  t->on_stack[b] = true;
+
+  for (i = 0; i < blk->n_succ; i++) {
+    s = blk->succ[i];
+    if (!follows(t, s))
+      continue;
+    if (t->index[s] == -1) {
+      strongconnect(t, s);
+      if (t->low[s] < t->low[b])
+        t->low[b] = t->low[s];
+    } else if (t->on_stack[s] && t->index[s] < t->low[b]) {
+      t->low[b] = t->index[s];
+    }
+  }
+
+  if (t->low[b] == t->index[b]) {
+    do {
+      s = t->stack[--t->n_stack];
+      t->on_stack[s] = false;
+      t->comp[s] = t->n_comps;
+      t->order[t->n_order++] = s;
+    } while (s != b);
+    t->n_comps++;
+  }
+}
+
+/* Work out the cycles from the start of 'root' to the end of each block
+ * of 'region' reached from it. In a loop, edges back to 'root' are not
+ * followed. */
+static int region_costs(struct analysis *a, const bool *region, int root,
+                        bool loop, struct range *end) {
+  struct tarjan t = { .a = a, .region = region, .root = root, .loop = loop };
+  struct range *start = calloc(a->nb, sizeof *start);
+  bool *inner = calloc(a->nb, sizeof *inner);
+  int rc = 0;
+  int first, last, c, i, j, b;
+
+  t.index = malloc(a->nb * sizeof *t.index);
+  t.low = malloc(a->nb * sizeof *t.low);
+  t.stack = malloc(a->nb * sizeof *t.stack);
+  t.on_stack = calloc(a->nb, sizeof *t.on_stack);
+  t.comp = malloc(a->nb * sizeof *t.comp);
+  t.order = malloc(a->nb * sizeof *t.order);
+  if (!start || !inner || !t.index || !t.low || !t.stack || !t.on_stack ||
+      !t.comp || !t.order) {
+    rc = ENOMEM;
+    goto finish;
+  }
+
+  for (b = 0; b < a->nb; b++)
+    t.index[b] = -1;
+  strongconnect(&t, root);
+
+  memset(end, '\0', a->nb * sizeof *end);
+  start[root] = (struct range) { true, 0, 0 };
+
+  /* Take the components in topological order */
+  for (last = t.n_order; rc == 0 && last > 0; last = first) {
+    int header = -1;
+    int entries = 0;
+    bool cyclic;
+
+    c = t.comp[t.order[last - 1]];
+    for (first = last; first > 0 && t.comp[t.order[first - 1]] == c; first--);
+    b = t.order[first];
+    cyclic = last - first > 1 || (has_edge(a->blocks + b, b) && follows(&t, b));
+
+    for (i = first; i < last; i++) {
+      if (start[t.order[i]].reached) {
+        header = t.order[i];
+        entries++;
+      }
+    }
+    if (entries == 0)
+      continue;
+
+    if (!cyclic) {
+      end[b] = range_add(start[b], a->blocks[b].cycles, a->blocks[b].cycles);
+    } else if (entries == 1) {
+      for (i = first; i < last; i++)
+        inner[t.order[i]] = true;
+      rc = loop_costs(a, inner, header, start[header], end);
+      for (i = first; i < last; i++)
+        inner[t.order[i]] = false;
+    } else {
+      struct wcet_loop summary = {
+        .header = a->blocks[header].start,
+        .why = "it has more than one entry",
+      };
+      const struct wcet_loop *recorded = add_loop(a, &summary);
+
+      if (a->unbounded == NULL)
+        a->unbounded = recorded;
+      for (i = first; i < last; i++) {
+        j = t.order[i];
+        end[j] = (struct range) { true, 0, WCET_UNBOUNDED };
+        if (start[j].reached)
+          end[j].best = sat_add(start[j].best, a->blocks[j].cycles);
+      }
+    }
+
+    /* Pass the cycles on to the components that follow */
+    for (i = first; i < last; i++) {
+      const struct block *blk = a->blocks + t.order[i];
+
+      for (j = 0; j < blk->n_succ; j++)
+        if (follows(&t, blk->succ[j]) && t.comp[blk->succ[j]] != c)
+          range_join(start + blk->succ[j], end[t.order[i]]);
+    }
+  }
+
+finish:
+  free(start);
+  free(inner);
+  free(t.index);
+  free(t.low);
+  free(t.stack);
+  free(t.on_stack);
+  free(t.comp);
+  free(t.order);
+  return rc;
+}
+
+/* Routines */
+
+static int analyse_routine(struct analysis *a, addr_t entry, bool as_loaded,
+                           struct wcet_routine *routine) {
+  struct val *init = calloc(a->n_vars, sizeof *init);
+  struct range *end = calloc(a->nb, sizeof *end);
+  bool *region = calloc(a->nb, sizeof *region);
+  int *work = malloc(a->nb * sizeof *work);
+  bool halts = false;
+  int n_work = 0;
+  int rc = 0;
+  int b, i, v;
+
+  routine->entry = entry;
+  routine->best = routine->worst = WCET_UNBOUNDED;
+  a->global = calloc((size_t) a->nb * a->n_vars, sizeof *a->global);
+  if (!init || !end || !region || !work || !a->global) {
+    rc = ENOMEM;
+    goto finish;
+  }
+
+  a->entry = a->block_at[entry];
+  a->init = init;
+  a->unbounded = NULL;
+
+  init[VAR_AC] = as_loaded ? val_const(0) : (struct val) { V_TOP };
+  for (v = 1; v < a->n_vars; v++)
+    init[v] = as_loaded ? val_const(a->mem[a->var_addr[v]]) : (struct val) { V_TOP };
+
+  region[a->entry] = true;
+  work[n_work++] = a->entry;
+  while (n_work > 0) {
+    b = work[--n_work];
+    for (i = 0; i < a->blocks[b].n_succ; i++) {
+      int s = a->blocks[b].succ[i];
+
+      if (!region[s]) {
+        region[s] = true;
+        work[n_work++] = s;
+      }
+    }
+  }
+
+  rc = propagate(a, region, a->entry, false, init, a->global);
+  if (rc == 0)
+    rc = region_costs(a, region, a->entry, false, end);
+  if (rc != 0)
+    goto finish;
+
+  routine->worst = 0;
+  for (b = 0; b < a->nb; b++) {
+    const struct block *blk = a->blocks + b;
+
+    if (!end[b].reached)
+      continue;
+    if (blk->unknown) {
+      if (routine->why == NULL) {
+        routine->why = blk->why;
+        routine->why_at = blk->end;
+      }
+      routine->worst = WCET_UNBOUNDED;
+    }
+    if (blk->halts) {
+      halts = true;
+      if (end[b].best < routine->best)
+        routine->best = end[b].best;
+      if (end[b].worst > routine->worst)
+        routine->worst = end[b].worst;
+    }
+  }
+
+  if (!halts) {
+    routine->best = routine->worst = WCET_UNBOUNDED;
+    if (routine->why == NULL) {
+      routine->why = "it never halts";
+      routine->why_at = entry;
+    }
+  } else if (routine->worst == WCET_UNBOUNDED && routine->why == NULL &&
+             a->unbounded != NULL) {
+    routine->why = "loop has no bound";
+    routine->why_at = a->unbounded->header;
+  }
+
+finish:
+  free(init);
+  free(end);
+  free(region);
+  free(work);
+  free(a->global);
+  a->global = NULL;
+  return rc;
+}
+
+int wcet_analyse(const word_t *mem, addr_t size,
+                 const addr_t *entries, int n_entries,
+                 const bool *inputs, struct wcet *result) {
+  struct analysis a = { .mem = mem, .mask = size - 1, .result = result };
+  int rc;
+  int i;
+
+  memset(result, '\0', sizeof *result);
+
+  rc = find_blocks(&a, entries, n_entries, inputs);
+  if (rc == 0) {
+    result->blocks = calloc(a.nb + 1, sizeof *result->blocks);
+    result->loops = calloc(a.nb + 1, sizeof *result->loops);
+    result->routines = calloc(n_entries + 1, sizeof *result->routines);
+    if (!result->blocks || !result->loops || !result->routines)
+      rc = ENOMEM;
+  }
+
+  for (i = 0; rc == 0 && i < a.nb; i++)
+    result->blocks[result->n_blocks++] = (struct wcet_block) {
+      a.blocks[i].start, a.blocks[i].end, a.blocks[i].cycles
+    };
+
+  for (i = 0; rc == 0 && i < n_entries; i++) {
+    addr_t entry = entries[i] & a.mask;
+
+    rc = analyse_routine(&a, entry, entry == 1, result->routines + i);
+    result->n_routines++;
+  }
+
+  free(a.blocks);
+  free(a.block_at);
+  free(a.var_of);
+  free(a.var_addr);
+  if (rc != 0)
+    wcet_free(result);
+  return rc;
+}
+
+void wcet_free(struct wcet *result) {
+  free(result->blocks);
+  free(result->loops);
+  free(result->routines);
+  memset(result, '\0', sizeof *result);
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Static cycle count analysis of Manchester Baby programs. */
+
+#ifndef LIBBABY_WCET_H
+#define LIBBABY_WCET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arch.h"
+
+/* Constants */
+
+/* Cycle count of a path with no bound */
+#define WCET_UNBOUNDED UINT64_MAX
+
+/* Counter of a loop that is the accumulator rather than a store line */
+#define WCET_COUNTER_AC ((addr_t) -1)
+
+/* Types */
+
+struct wcet_block {
+  addr_t start;
+  addr_t end;              /* last instruction */
+  unsigned cycles;
+};
+
+struct wcet_loop {
+  addr_t header;
+  uint64_t bound;          /* times the header runs, 0 if unbounded */
+  addr_t counter;
+  uint64_t iteration;      /* worst cycles per iteration */
+  const char *why;         /* reason there is no bound */
+};
+
+struct wcet_routine {
+  addr_t entry;
+  uint64_t best;           /* WCET_UNBOUNDED if it cannot halt */
+  uint64_t worst;
+  const char *why;         /* reason 'worst' is unbounded */
+  addr_t why_at;
+};
+
+struct wcet {
+  struct wcet_block *blocks;
+  int n_blocks;
+  struct wcet_loop *loops;
+  int n_loops;
+  struct wcet_routine *routines;
+  int n_routines;
+};
+
+/* Public functions */
+
+/* Work out the fewest and most cycles the program in 'mem' can run for
+ * from each of the 'n_entries' instruction addresses in 'entries' until it
+ * halts. 'mem' has 'size' words, a power of two, and is aliased throughout
+ * the address space as it is in the simulator. The routine at address 1,
+ * where the machine starts, begins with the machine as loaded; others begin
+ * with the accumulator and every store line the program writes unknown.
+ * Store lines flagged in 'inputs', which may be NULL, are never assumed to
+ * hold their loaded values. */
+extern int wcet_analyse(const word_t *mem, addr_t size,
+                        const addr_t *entries, int n_entries,
+                        const bool *inputs, struct wcet *result);
+extern void wcet_free(struct wcet *result);
+
+#endif
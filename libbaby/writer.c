@@ -18,6 +18,7 @@
 
 #include "arch.h"
 #include "section.h"
+#include "lines.h"
 #include "writer.h"
 
 #define BITS_SSEM 1
@@ -27,15 +28,64 @@ static bool verbose = false;
 
 static const word_t fill_value = 0x0;
 
+/* The words from line 0 to the end of the section, with any lines that
+ * were not put filled, a page-long run at a time. */
+struct words {
+  const struct section *section;
+  addr_t line;
+  addr_t end;
+  addr_t run_start;
+  addr_t run_end;
+  const word_t *run;
+  word_t fill[SECTION_PAGE_WORDS];
+};
+
+static void words_init(struct words *w, const struct section *section) {
+  addr_t i;
+
+  w->section = section;
+  w->line = 0;
+  w->end = section->org + section->length;
+  w->run = section_next_range(section, 0, &w->run_start, &w->run_end);
+  for (i = 0; i < SECTION_PAGE_WORDS; i++)
+    w->fill[i] = fill_value;
+}
+
+/* The next run of words, which are either all put or all filled */
+static const word_t *words_next(struct words *w, addr_t *count) {
+  const word_t *run;
+
+  if (w->line >= w->end)
+    return NULL;
+  if (w->run && w->line == w->run_start) {
+    run = w->run;
+    *count = w->run_end - w->run_start;
+    w->run = section_next_range(w->section, w->run_end, &w->run_start, &w->run_end);
+  } else {
+    run = w->fill;
+    *count = (w->run ? w->run_start : w->end) - w->line;
+    if (*count > SECTION_PAGE_WORDS)
+      *count = SECTION_PAGE_WORDS;
+  }
+  w->line += *count;
+  return run;
+}
+
 static int logisim_writer(FILE *stream, const struct section *section, int flags) {
-  addr_t word;
+  const word_t *run;
+  struct words w;
+  addr_t word = 0;
+  addr_t count;
+  addr_t i;
   int rc;
 
   fprintf(stream, "v2.0 raw\n");
-  for (word = 0; word < section->org + section->length; word++) {
-    rc = fprintf(stream, "%08x\n", word < section->org ? fill_value : section->data[word - section->org].value);
-    if (rc < 0)
-      return errno;
+  for (words_init(&w, section); (run = words_next(&w, &count)); word += count) {
+    for (i = 0; i < count; i++) {
+      rc = fprintf(stream, "%08x\n", run[i]);
+      if (rc < 0)
+        return errno;
+    }
   }
 
   if (verbose) {
@@ -46,21 +96,27 @@ static int logisim_writer(FILE *stream, const struct section *section, int flags
 }
 
 static int bits_writer(FILE *stream, const struct section *section, int flags) {
-  addr_t word;
+  const word_t *run;
+  struct words w;
+  addr_t word = 0;
+  addr_t count;
+  addr_t i;
   uword_t tst;
   int rc;
   const bool ssem = flags & BITS_SSEM;
 
-  for (word = 0; word < section->org + section->length; word++) {
-    word_t val = word < section->org ? fill_value : section->data[word - section->org].value;
-    if (flags & BITS_ADDR)
-      fprintf(stream, "%04d: ", word);
-    for (tst = ssem ? 1 : 0x80000000UL; tst != 0; tst = ssem ? tst << 1 : tst >> 1)
-      if ((rc = fputc(val & tst ? '1' : '0', stream)) == EOF)
+  for (words_init(&w, section); (run = words_next(&w, &count)); ) {
+    for (i = 0; i < count; i++, word++) {
+      word_t val = run[i];
+      if (flags & BITS_ADDR)
+        fprintf(stream, "%04d: ", word);
+      for (tst = ssem ? 1 : 0x80000000UL; tst != 0; tst = ssem ? tst << 1 : tst >> 1)
+        if ((rc = fputc(val & tst ? '1' : '0', stream)) == EOF)
+          return errno;
+      rc = fputc('\n', stream);
+      if (rc == EOF)
         return errno;
-    rc = fputc('\n', stream);
-    if (rc == EOF)
-      return errno;
+    }
   }
 
   if (verbose) {
@@ -71,12 +127,15 @@ static int bits_writer(FILE *stream, const struct section *section, int flags) {
 }
 
 static int binary_writer(FILE *stream, const struct section *section, int flags) {
-  addr_t word;
-  int rc;
+  const word_t *run;
+  struct words w;
+  addr_t word = 0;
+  addr_t count;
+  size_t rc;
 
-  for (word = 0; word < section->org + section->length; word++) {
-    rc = fwrite(&section->data[word - section->org].value, sizeof(word_t), 1, stream);
-    if (rc < 1)
+  for (words_init(&w, section); (run = words_next(&w, &count)); word += count) {
+    rc = fwrite(run, sizeof(word_t), count, stream);
+    if (rc < count)
       return errno;
   }
 
@@ -87,15 +146,30 @@ static int binary_writer(FILE *stream, const struct section *section, int flags)
   return 0;
 }
 
+static int lines_writer(FILE *stream, const struct section *section, int flags) {
+  return lines_write(stream, section);
+}
+
 const struct format formats[] = {
   { WRITER_LOGISIM,               logisim_writer, 0 },
   { WRITER_BINARY,                binary_writer,  0 },
   { WRITER_BITS,                  bits_writer,    0 },
   { WRITER_BITS BITS_SUFFIX_SSEM, bits_writer,    BITS_SSEM },
   { WRITER_BITS BITS_SUFFIX_SNP,  bits_writer,    BITS_SSEM | BITS_ADDR },
+  { WRITER_LINES,                 lines_writer,   0 },
   { NULL,                         NULL,           0 }
 };
 
+const struct format *find_format(const char *name) {
+  int i;
+
+  for (i = 0; formats[i].name != NULL; i++) {
+    if (!strcmp(name, formats[i].name))
+      return formats + i;
+  }
+  return NULL;
+}
+
 int write_section(const char *path, const struct section *section, const struct format *format) {
   FILE *file;
   int rc;
@@ -126,3 +200,57 @@ int write_section(const char *path, const struct section *section, const struct
   return rc;
 }
 
+static void outputs_put(struct outputs *outputs, const char *path,
+                        const struct format *format) {
+  if (outputs->n == outputs->sz) {
+    outputs->sz = (outputs->sz == 0) ? 4 : outputs->sz << 1;
+    outputs->list = realloc(outputs->list, outputs->sz * sizeof *outputs->list);
+    if (outputs->list == NULL) {
+      perror("expanding outputs");
+      exit(1);
+    }
+  }
+  outputs->list[outputs->n++] = (struct output) { path, format };
+}
+
+void outputs_add(struct outputs *outputs, const char *arg) {
+  const char *eq = strchr(arg, '=');
+  const struct format *format = NULL;
+  int i;
+
+  /* Only a known format counts, so other paths may contain '=' */
+  for (i = 0; eq && formats[i].name != NULL; i++) {
+    if (strlen(formats[i].name) == eq - arg &&
+        !strncmp(arg, formats[i].name, eq - arg)) {
+      format = formats + i;
+      arg = eq + 1;
+      break;
+    }
+  }
+  outputs_put(outputs, arg, format);
+}
+
+void outputs_default(struct outputs *outputs, const char *path,
+                     const struct format *format) {
+  int i;
+
+  if (outputs->n == 0)
+    outputs_put(outputs, path, format);
+  for (i = 0; i < outputs->n; i++) {
+    if (outputs->list[i].format == NULL)
+      outputs->list[i].format = format;
+  }
+}
+
+int write_outputs(const struct outputs *outputs, const struct section *section) {
+  int rc = 0;
+  int i;
+
+  for (i = 0; rc == 0 && i < outputs->n; i++)
+    rc = write_section(outputs->list[i].path, section, outputs->list[i].format);
+  return rc;
+}
+
+void outputs_free(struct outputs *outputs) {
+  free(outputs->list);
+}
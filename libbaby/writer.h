@@ -9,6 +9,7 @@
 #define WRITER_LOGISIM "logisim"
 #define WRITER_BINARY BINFMT_BINARY
 #define WRITER_BITS BINFMT_BITS
+#define WRITER_LINES "lines"
 
 struct format {
   const char *name;
@@ -16,8 +17,35 @@ struct format {
   const int flags;
 };
 
+/* Images to write, each to a file in a format */
+struct output {
+  const char *path;
+  const struct format *format;   /* NULL for the default format */
+};
+
+struct outputs {
+  struct output *list;
+  int n;
+  int sz;
+};
+
 extern const struct format formats[];
 
+extern const struct format *find_format(const char *name);
+
 extern int write_section(const char *path, const struct section *section, const struct format *format);
 
+/* Add an output given as FMT=FILE or as FILE in the default format */
+extern void outputs_add(struct outputs *outputs, const char *arg);
+
+/* Write to 'path' if there are no outputs and give outputs without a
+ * format the default one. */
+extern void outputs_default(struct outputs *outputs, const char *path,
+                            const struct format *format);
+
+/* Write a section to every output */
+extern int write_outputs(const struct outputs *outputs, const struct section *section);
+
+extern void outputs_free(struct outputs *outputs);
+
 #endif
@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Assemble sources concurrently with asm_assemble(), one thread and
+ * context each, and write each image for comparison with bas.
+ *
+ *   assemble-threads SOURCE OUTPUT [SOURCE OUTPUT...]
+ *
+ * Each source is assembled repeatedly while the others are, and every
+ * image must match the first. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "butils.h"
+#include "arch.h"
+#include "section.h"
+#include "asm.h"
+#include "asm-build.h"
+#include "srcbuf.h"
+#include "writer.h"
+
+#define MEMORY_SIZE 32
+#define ROUNDS 50
+
+struct job {
+  pthread_t thread;
+  const char *source;
+  const char *output;
+  struct srcbuf text;
+  struct section image;
+  int rc;
+};
+
+static bool same_image(const struct section *a, const struct section *b) {
+  addr_t addr;
+
+  if (a->org != b->org || a->length != b->length)
+    return false;
+  for (addr = a->org; addr < a->org + a->length; addr++)
+    if (section_get(a, addr) != section_get(b, addr))
+      return false;
+  return true;
+}
+
+static void *assemble_job(void *arg) {
+  struct asm_options opts = { .memory = MEMORY_SIZE, .jobs = 1 };
+  struct job *job = arg;
+  struct section again;
+  struct asm_ctx *ctx;
+  int i;
+
+  ctx = asm_ctx_create();
+  if (ctx == NULL) {
+    job->rc = errno;
+    return NULL;
+  }
+  job->rc = asm_assemble(ctx, job->source, job->text.text, job->text.len,
+                         &opts, &job->image);
+  for (i = 1; job->rc == 0 && i < ROUNDS; i++) {
+    job->rc = asm_assemble(ctx, job->source, job->text.text, job->text.len,
+                           &opts, &again);
+    if (job->rc == 0 && !same_image(&job->image, &again)) {
+      fprintf(stderr, "%s: image differs in round %d\n", job->source, i);
+      job->rc = EHANDLED;
+    }
+    section_free(&again);
+  }
+  asm_ctx_destroy(ctx);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  const struct format *format = find_format(WRITER_BITS BITS_SUFFIX_SNP);
+  struct job *jobs;
+  int n_jobs;
+  int rc = 0;
+  int i;
+
+  if (argc < 3 || argc % 2 != 1) {
+    fprintf(stderr, "usage: %s SOURCE OUTPUT [SOURCE OUTPUT...]\n", argv[0]);
+    return 1;
+  }
+  n_jobs = (argc - 1) / 2;
+  jobs = calloc(n_jobs, sizeof *jobs);
+  if (jobs == NULL) {
+    perror("allocating jobs");
+    return 1;
+  }
+
+  for (i = 0; rc == 0 && i < n_jobs; i++) {
+    jobs[i].source = argv[1 + 2 * i];
+    jobs[i].output = argv[2 + 2 * i];
+    rc = srcbuf_open(&jobs[i].text, jobs[i].source);
+    if (rc != 0)
+      fprintf(stderr, "%s: %s\n", jobs[i].source, strerror(rc));
+  }
+  n_jobs = i;
+
+  for (i = 0; rc == 0 && i < n_jobs; i++) {
+    rc = pthread_create(&jobs[i].thread, NULL, assemble_job, jobs + i);
+    if (rc != 0)
+      fprintf(stderr, "creating thread: %s\n", strerror(rc));
+  }
+  while (i-- > 0)
+    pthread_join(jobs[i].thread, NULL);
+
+  for (i = 0; i < n_jobs; i++) {
+    if (rc == 0 && jobs[i].rc != 0) {
+      if (jobs[i].rc != EHANDLED)
+        fprintf(stderr, "%s: %s\n", jobs[i].source, strerror(jobs[i].rc));
+      rc = EHANDLED;
+    }
+    if (rc == 0)
+      rc = write_section(jobs[i].output, &jobs[i].image, format);
+    section_free(&jobs[i].image);
+    srcbuf_close(&jobs[i].text);
+  }
+
+  free(jobs);
+  return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,11 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Copy that bsopt must not shorten to 'LDN x; STO y', which differs
+-- when x and y are the same line
+
+cp MACRO x, y
+  STO y
+  LDN x
+  STO y
+  ENDM
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: MIT */
+/* (c) Copyright 2024 Andrew Bower */
+
+/* Emit a program through the asm_emit_*() calls and check it encodes to
+ * the same image as its source text given to asm_assemble(), then check
+ * that a failed call leaves the emitter failed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "butils.h"
+#include "arch.h"
+#include "section.h"
+#include "asm.h"
+#include "asm-build.h"
+
+#define MEMORY_SIZE 32
+
+/* Labels used before they are placed and literals, some of them shared */
+static const char text[] =
+  "  jmp =start - 1\n"
+  "r:\n"
+  "  num 0\n"
+  "start:\n"
+  "  ldn =-10\n"
+  "  sub =3\n"
+  "  sub one\n"
+  "  sto r\n"
+  "  ldn =-10\n"
+  "  jrp skip\n"
+  "  hlt\n"
+  "  hlt\n"
+  "  jmp =fin - 1\n"
+  "fin:\n"
+  "  hlt\n"
+  "one:\n"
+  "  num 1\n"
+  "skip:\n"
+  "  num 1\n";
+
+/* Errors are left for asm_emit_end() to return */
+static void emit_text(struct asm_emitter *em) {
+  str_idx_t start = asm_emit_label(em, "start");
+  str_idx_t fin = asm_emit_label(em, "fin");
+  str_idx_t one = asm_emit_label(em, "one");
+  str_idx_t skip = asm_emit_label(em, NULL);
+  str_idx_t r = asm_emit_label(em, "r");
+
+  asm_emit_instr(em, "JMP", (struct asm_operand) {
+      .literal = true, .symbolic = true, .label = start, .addend = -1 });
+  asm_emit_place(em, r);
+  asm_emit_word(em, 0);
+  asm_emit_place(em, start);
+  asm_emit_instr(em, "LDN", ASM_LIT(-10));
+  asm_emit_instr(em, "SUB", ASM_LIT(3));
+  asm_emit_instr(em, "SUB", ASM_REF(one, 0));
+  asm_emit_instr(em, "STO", ASM_REF(r, 0));
+  asm_emit_instr(em, "LDN", ASM_LIT(-10));
+  asm_emit_instr(em, "JRP", ASM_REF(skip, 0));
+  asm_emit_instr(em, "HLT", ASM_NUM(0));
+  asm_emit_instr(em, "HLT", ASM_NUM(0));
+  asm_emit_instr(em, "JMP", (struct asm_operand) {
+      .literal = true, .symbolic = true, .label = fin, .addend = -1 });
+  asm_emit_place(em, fin);
+  asm_emit_instr(em, "HLT", ASM_NUM(0));
+  asm_emit_place(em, one);
+  asm_emit_word(em, 1);
+  asm_emit_place(em, skip);
+  asm_emit_word(em, 1);
+}
+
+static bool same_image(const struct section *a, const struct section *b) {
+  addr_t addr;
+
+  if (a->org != b->org || a->length != b->length)
+    return false;
+  for (addr = a->org; addr < a->org + a->length; addr++)
+    if (section_get(a, addr) != section_get(b, addr))
+      return false;
+  return true;
+}
+
+/* A program that fails at 'fail' must fail there and at the end */
+static bool check_failure(struct asm_ctx *ctx, const char *name,
+                          int (*fail)(struct asm_emitter *em)) {
+  struct asm_emitter *em = asm_emit_begin(ctx, name, MEMORY_SIZE);
+  struct section image;
+  bool ok;
+
+  if (em == NULL)
+    return false;
+  ok = asm_emit_word(em, 7) == 0;
+  ok = fail(em) == EHANDLED && ok;
+  ok = asm_emit_word(em, 7) == EHANDLED && ok;
+  ok = asm_emit_end(em, &image) == EHANDLED && ok;
+  section_free(&image);
+  if (!ok)
+    fprintf(stderr, "%s: emitter did not fail\n", name);
+  return ok;
+}
+
+static int unknown_mnemonic(struct asm_emitter *em) {
+  return asm_emit_instr(em, "FROB", ASM_NUM(1));
+}
+
+static int placed_twice(struct asm_emitter *em) {
+  str_idx_t label = asm_emit_label(em, "twice");
+  int rc;
+
+  rc = asm_emit_place(em, label);
+  rc = rc ? rc : asm_emit_word(em, 1);
+  return rc ? rc : asm_emit_place(em, label);
+}
+
+int main(void) {
+  struct asm_options opts = { .memory = MEMORY_SIZE, .jobs = 1 };
+  struct section assembled, emitted = { 0 };
+  struct asm_emitter *em;
+  struct asm_ctx *ctx;
+  bool ok = true;
+  int rc;
+
+  ctx = asm_ctx_create();
+  if (ctx == NULL) {
+    perror("creating context");
+    return 1;
+  }
+
+  rc = asm_assemble(ctx, "text", text, sizeof text - 1, &opts, &assembled);
+  em = asm_emit_begin(ctx, "emit", MEMORY_SIZE);
+  if (em == NULL) {
+    rc = rc ? rc : ENOMEM;
+  } else {
+    emit_text(em);
+    if (asm_emit_end(em, &emitted) != 0 && rc == 0)
+      rc = EHANDLED;
+  }
+  if (rc != 0) {
+    fprintf(stderr, "assembling: %s\n", rc == EHANDLED ? "failed" : strerror(rc));
+    ok = false;
+  } else if (!same_image(&assembled, &emitted)) {
+    fprintf(stderr, "emitted image differs from assembled text\n");
+    ok = false;
+  }
+  section_free(&assembled);
+  section_free(&emitted);
+
+  ok = check_failure(ctx, "unknown", unknown_mnemonic) && ok;
+  ok = check_failure(ctx, "twice", placed_twice) && ok;
+
+  asm_ctx_destroy(ctx);
+  return ok ? 0 : 1;
+}
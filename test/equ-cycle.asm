@@ -0,0 +1,12 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Test that a circular symbol definition is an error
+
+01:
+  ldn a
+  hlt
+
+a equ b
+b equ c
+c equ a
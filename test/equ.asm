@@ -0,0 +1,16 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Test symbols defined by expressions that refer forwards
+
+01:
+  ldn a          -- a is two words beyond dat
+  sto b
+  hlt
+
+a equ b + 1
+b equ c + 1
+c equ dat
+
+dat:
+  num 7
@@ -0,0 +1,11 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Library for test/link-main.asm
+
+  EXPORT value
+
+loop:
+  jmp tmp
+tmp: num loop - 1
+value: num -42
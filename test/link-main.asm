@@ -0,0 +1,15 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Test linking objects that define the same local labels
+
+01:
+loop:
+  ldn value
+  sto tmp
+  ldn tmp
+  sto result
+  hlt
+
+tmp: num 0
+result: num 0
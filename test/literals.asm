@@ -0,0 +1,37 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Literal operands sharing a constant pool
+
+neg2 MACRO x, y          ; x := -y
+  ldn y
+  sto x
+  ENDM
+
+01:
+  ldn =-10               ; 10
+  sub =3
+  sub =1
+  sto r                  ; 6
+  ldn =0xffffffff        ; 1, sharing a line with =-1
+  sub =1
+  sto z                  ; 0
+  neg2 n, =-4            ; 4
+  neg2 m, =1             ; -1
+  ldn =-1
+  jmp =fin - 1
+  hlt
+fin:
+  sto s                  ; 1
+  hlt
+
+r:
+  num 99
+z:
+  num 99
+n:
+  num 99
+m:
+  num 99
+s:
+  num 99
@@ -0,0 +1,21 @@
+-- # SPDX-License-Identifier: MIT
+-- # (c) Copyright 2024 Andrew Bower
+--
+-- Test multiplication by constants
+
+01:
+start:
+  MULC a, x, 10
+  MULC b, x, -7
+  MULC c, =3, 255
+  MULC x, x, 0
+  HLT
+
+x:
+  NUM 5
+a:
+  NUM 0                -- should become 50
+b:
+  NUM 0                -- should become -35
+c:
+  NUM 0                -- should become 765
@@ -0,0 +1,10 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- First of two sources assembled together with multi-b.asm
+
+01:
+  ldn first_b    -- label at the end of this source
+  sto 10
+  hlt
+first_b:
@@ -0,0 +1,6 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Second of two sources assembled together with multi-a.asm
+
+  num -42        -- first word, labelled first_b by multi-a.asm
@@ -0,0 +1,32 @@
+-- # SPDX-License-Identifier: MIT
+-- # (c) Copyright 2024 Andrew Bower
+--
+-- Test outlining of repeated macro bodies. Inline, the three ticks take
+-- 30 lines and the program does not fit the 32-line store; with -S they
+-- share one copy.
+
+add2 macro x, y          ; x := x + y
+    ldn x
+    sub y
+    sto x
+    ldn x
+    sto x
+    endm
+
+tick macro               ; total := total + step, step := step + 1
+    add2 total, step
+    add2 step, one
+    endm
+
+01:
+    tick
+    tick
+    tick
+    hlt
+
+total:
+    num 0                -- should become 6
+step:
+    num 1                -- should become 4
+one:
+    num 1
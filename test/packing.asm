@@ -0,0 +1,30 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Sections that only fit a store of 16 words one way round
+
+  SECTION table
+y1:
+  num 1
+y2:
+  num 2
+y3:
+  num 3
+y4:
+  num 4
+
+  SECTION results, BELOW 12
+x1:
+  num 0
+x2:
+  num 0
+
+  SECTION code, AT 1
+  ldn y4
+  sub y3
+  sub y2
+  sub y1
+  sto x1                 ; -10
+  ldn x1
+  sto x2                 ; 10
+  hlt
@@ -0,0 +1,45 @@
+-- # SPDX-License-Identifier: MIT
+-- # (c) Copyright 2024 Andrew Bower
+--
+-- Test repeated and conditional blocks
+
+shifts EQU 3
+
+-- Multiply by -2 'n' times, unrolled
+mshift MACRO n, x
+  REPT n
+  LDN x
+  SUB x
+  STO x
+  ENDM
+  ENDM
+
+01:
+start:
+  mshift shifts, v
+  IF shifts - 3
+  LDN one
+  ELSE
+  IF 0
+  LDN one
+  ENDIF
+  LDN two
+  ENDIF
+  STO w
+  HLT
+
+v:
+  NUM 5                -- should become -40
+w:
+  NUM 0                -- should become -2
+one:
+  NUM 1
+two:
+  NUM 2
+  IRP k, 1, shifts, two
+  NUM k
+  ENDM
+  REPT 2
+here:
+  NUM here             -- each repetition has its own label
+  ENDM
@@ -0,0 +1,35 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Sections placed by the assembler rather than by hand
+
+  SECTION code, AT 1
+  ldn a
+  sub b
+  sto neg_sum            ; -7
+
+  SECTION data
+a:
+  num 3
+b:
+  num 4
+
+  SECTION code
+  ldn neg_sum
+  sto sum                ; 7
+  ldn =-1
+  sto top
+  hlt
+
+  SECTION results, ALIGN 4
+neg_sum:
+  num 0
+sum:
+  num 0
+
+  SECTION stack, ABOVE 28
+  num 0
+  num 0
+  num 0
+top:
+  num 0
@@ -0,0 +1,16 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- A macro label that shadows a global already used by the macro body
+
+m MACRO
+  ldn x
+  sub $
+x: num 5
+  ENDM
+x: num 7
+01:
+  m
+  m
+  ldn x
+  hlt
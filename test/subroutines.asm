@@ -74,7 +74,7 @@ ret_instr:
 ; Application
 ;;;;;;;;;;;;;
 
-count: num 5
+count: num 1
 
 01:
 _start:
@@ -88,10 +88,14 @@ count_recursive:
     jsr count_recursive
     rts
 
-60:
+    SECTION stack
+    num 0                ; room for two calls
+    num 0
 _stack:
 _sp:
     num _stack           ; full descending stack
+
+    SECTION data
 _one:
     num 1
 _tmp:
@@ -0,0 +1,36 @@
+-- SPDX-License-Identifier: MIT
+-- (c) Copyright 2024 Andrew Bower
+--
+-- Macro temporaries sharing store lines
+
+negi MACRO               ; AC := -AC
+  TEMP t
+  sto t
+  ldn t
+  ENDM
+
+ld MACRO x
+  ldn x
+  negi
+  ENDM
+
+swap MACRO x, y          ; x, y := y, x
+  TEMP a, b
+  ld x
+  sto a
+  ld y
+  sto b
+  ld a
+  sto y
+  ld b
+  sto x
+  ENDM
+
+01:
+  swap p, q
+  hlt
+
+p:
+  num 3
+q:
+  num 5